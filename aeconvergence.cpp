@@ -0,0 +1,79 @@
+#include "aeconvergence.h"
+
+#include <math.h>
+#include <chrono>
+
+
+AeConvergence::AeConvergence(double tolerance, int stableFrames)
+    : tolerance(tolerance)
+    , stableFrames(stableFrames > 0 ? stableFrames : 1)
+    , nStable(0)
+    , bHaveLast(false)
+    , lastExposure(0)
+{
+    for(int i=0; i<N_VALUES; i++)
+        last[i] = 0.0;
+}
+
+
+/**
+ * New camera settings (called from the control port callback)
+ * @param exposure    Exposure time in us
+ * @param analogGain  Sensor gain
+ * @param digitalGain ISP gain
+ * @param redGain     AWB red gain
+ * @param blueGain    AWB blue gain
+ */
+void
+AeConvergence::update(uint32_t exposure, double analogGain, double digitalGain,
+                      double redGain, double blueGain)
+{
+    double values[N_VALUES];
+    values[EXPOSURE]  = exposure*analogGain*digitalGain;
+    values[RED_GAIN]  = redGain;
+    values[BLUE_GAIN] = blueGain;
+    std::lock_guard<std::mutex> lock(mutex);
+    lastExposure = exposure;
+    bool bStable = bHaveLast;
+    for(int i=0; i<N_VALUES && bStable; i++) {
+        if(fabs(values[i] - last[i]) > tolerance*fabs(last[i]))
+            bStable = false;
+    }
+    for(int i=0; i<N_VALUES; i++)
+        last[i] = values[i];
+    bHaveLast = true;
+    nStable = bStable ? nStable+1 : 0;
+    if(nStable >= stableFrames)
+        settled.notify_all();
+}
+
+
+/// The scene has changed (e.g. the lamp): the settled state starts over
+void
+AeConvergence::restart() {
+    std::lock_guard<std::mutex> lock(mutex);
+    nStable   = 0;
+    bHaveLast = false;
+}
+
+
+/**
+ * Wait for the exposure and white balance to settle
+ * @param msecTimeout Longest wait
+ * @return false on timeout (or if the camera sends no settings)
+ */
+bool
+AeConvergence::wait(int msecTimeout) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return settled.wait_for(lock,
+                            std::chrono::milliseconds(msecTimeout),
+                            [this] { return nStable >= stableFrames; });
+}
+
+
+/// Exposure time of the last frame, in us
+uint32_t
+AeConvergence::exposure() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lastExposure;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+
+
+// Tells when the automatic exposure and white balance have settled.
+// The camera reports its settings (exposure, gains, AWB gains) with every
+// preview frame (MMAL_PARAMETER_CAMERA_SETTINGS events): they are settled
+// when none of them changes more than the tolerance for a few frames in a row.
+class AeConvergence
+{
+public:
+    AeConvergence(double tolerance, int stableFrames);
+
+public:
+    void update(uint32_t exposure, double analogGain, double digitalGain,
+                double redGain, double blueGain);
+    void restart();
+    bool wait(int msecTimeout);
+    uint32_t exposure();
+
+private:
+    enum {
+        EXPOSURE   = 0, /// Exposure time times the gains (the brightness)
+        RED_GAIN   = 1,
+        BLUE_GAIN  = 2,
+        N_VALUES   = 3
+    };
+
+    double tolerance;        /// Relative change still considered stable
+    int stableFrames;        /// Stable frames in a row needed
+    int nStable;
+    bool bHaveLast;
+    double last[N_VALUES];
+    uint32_t lastExposure;   /// in us
+    std::mutex mutex;
+    std::condition_variable settled;
+};
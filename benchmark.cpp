@@ -0,0 +1,112 @@
+#include "benchmark.h"
+#include "qoiencoder.h"
+#include "jpegencoder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+
+#define ALIGN_UP(x, n) (((x) + (n) - 1) & ~((n) - 1))
+
+
+/// A smooth gradient with some sensor-like noise: compresses like a real still
+static void
+makeFrame(std::vector<uint8_t>& frame, int width, int height, uint32_t stride) {
+    srand(1);
+    for(int y=0; y<height; y++) {
+        uint8_t *p = frame.data() + size_t(y)*stride;
+        for(int x=0; x<width; x++, p+=3) {
+            int noise = rand() % 5 - 2;
+            p[0] = uint8_t(std::min(std::max(x*255/width + noise, 0), 255));
+            p[1] = uint8_t(std::min(std::max(y*255/height + noise, 0), 255));
+            p[2] = uint8_t(std::min(std::max((x+y)*127/(width+height) + 64 + noise, 0), 255));
+        }
+    }
+}
+
+
+static long
+fileSize(const char *sPathName) {
+    FILE *pFile = fopen(sPathName, "rb");
+    if(!pFile)
+        return 0;
+    fseek(pFile, 0, SEEK_END);
+    long size = ftell(pFile);
+    fclose(pFile);
+    return size;
+}
+
+
+/**
+ * Compare the CPU QOI encoder with the PNG encoder of the GPU
+ * on the same RGB24 frame (run with: slowMotion --benchmark [width height])
+ * @param width   Frame width
+ * @param height  Frame height
+ * @param nFrames Frames encoded by every encoder
+ * @return the process exit status
+ */
+int
+runLosslessBenchmark(int width, int height, int nFrames) {
+    const uint32_t stride    = uint32_t(ALIGN_UP(width, 32))*3;
+    const uint32_t frameSize = stride*uint32_t(ALIGN_UP(height, 16));
+    std::vector<uint8_t> frame(frameSize);
+    makeFrame(frame, width, height, stride);
+
+    // CPU: QOI, striped across the cores, written to a file
+    QoiEncoder qoiEncoder(width, height, stride);
+    auto start = std::chrono::steady_clock::now();
+    size_t qoiBytes = 0;
+    for(int i=0; i<nFrames; i++) {
+        const std::vector<uint8_t>& encoded = qoiEncoder.encode(frame.data());
+        FILE *pFile = fopen("/tmp/slowMotion_benchmark.qoi", "wb");
+        if(!pFile) {
+            fprintf(stderr, "Unable to write the QOI file\n");
+            return EXIT_FAILURE;
+        }
+        fwrite(encoded.data(), 1, encoded.size(), pFile);
+        fclose(pFile);
+        qoiBytes = encoded.size();
+    }
+    double qoiMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count()/nFrames;
+    printf("CPU QOI: %dx%d %8.1f ms/frame %10zu bytes\n", width, height, qoiMs, qoiBytes);
+
+    // GPU: PNG from the image encoder, fed from the ARM side as in the HDR path
+    JpegEncoder pngEncoder;
+    if(pngEncoder.setEncoding(MMAL_ENCODING_PNG) != MMAL_SUCCESS) {
+        fprintf(stderr, "PNG is not supported by the image encoder\n");
+        pngEncoder.destroy();
+        return EXIT_FAILURE;
+    }
+    MMAL_ES_FORMAT_T *pFormat = mmal_format_alloc();
+    pFormat->type     = MMAL_ES_TYPE_VIDEO;
+    pFormat->encoding = MMAL_ENCODING_RGB24;
+    pFormat->es->video.width       = uint32_t(ALIGN_UP(width, 32));
+    pFormat->es->video.height      = uint32_t(ALIGN_UP(height, 16));
+    pFormat->es->video.crop.x      = 0;
+    pFormat->es->video.crop.y      = 0;
+    pFormat->es->video.crop.width  = width;
+    pFormat->es->video.crop.height = height;
+    if(pngEncoder.startDirect(pFormat, frameSize) != MMAL_SUCCESS) {
+        fprintf(stderr, "Unable to start the PNG encoder\n");
+        mmal_format_free(pFormat);
+        pngEncoder.destroy();
+        return EXIT_FAILURE;
+    }
+    FrameWriter writer; // Nothing flushed: only the encoding is timed
+    writer.begin(QString("/tmp"), 0, 0, FrameWriter::FLUSH_ON_STOP, 1);
+    start = std::chrono::steady_clock::now();
+    for(int i=0; i<nFrames; i++)
+        pngEncoder.encode(frame.data(), frameSize, &writer, QString("/tmp/slowMotion_benchmark.png"));
+    double pngMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count()/nFrames;
+    printf("GPU PNG: %dx%d %8.1f ms/frame %10ld bytes\n", width, height, pngMs,
+           fileSize("/tmp/slowMotion_benchmark.png"));
+    pngEncoder.stopDirect();
+    pngEncoder.destroy();
+    mmal_format_free(pFormat);
+    remove("/tmp/slowMotion_benchmark.qoi");
+    remove("/tmp/slowMotion_benchmark.png");
+    return EXIT_SUCCESS;
+}
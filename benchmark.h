@@ -0,0 +1,4 @@
+#pragma once
+
+
+int runLosslessBenchmark(int width, int height, int nFrames);
@@ -0,0 +1,134 @@
+#include "bufferplanner.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+
+#define FIRMWARE_RESERVE  (16ULL << 20) // gpu_mem taken by the firmware itself
+#define APP_RESERVE       (64ULL << 20) // ARM memory of the application and Qt
+#define ARM_MARGIN        0.8           // Part of the available ARM memory we may plan for
+#define SENSOR_FRAMES     2             // Raw frames the camera receives into (ping-pong)
+#define ENCODE_BANDWIDTH  (40.0*1024*1024) // GPU image encoder output, bytes per second
+#define PREVIEW_FPS       30
+#define RENDER_SERVICE_MS 40.0          // The renderer holds a frame up to the next vsync
+#define VIDEO_SERVICE_MS  20.0          // Motion analysis or MJPEG encoding of a frame
+
+
+// Size of an image of the camera (rows and lines padded as on the VideoCore)
+static uint64_t
+imageBytes(int width, int height, double bytesPerPixel) {
+    uint64_t alignedWidth  = (uint64_t(width)  + 31) & ~uint64_t(31);
+    uint64_t alignedHeight = (uint64_t(height) + 15) & ~uint64_t(15);
+    return uint64_t(alignedWidth*alignedHeight*bytesPerPixel);
+}
+
+
+/**
+ * Smallest number of buffers that sustains a rate (Little's law):
+ * the one being filled plus the ones waiting to be serviced
+ * @param rate      Buffers per second
+ * @param serviceMs Time the consumer holds a buffer
+ * @param minDepth  Lowest depth the port accepts
+ */
+int
+BufferPlanner::depthFor(double rate, double serviceMs, int minDepth) {
+    int depth = int(ceil(rate*serviceMs/1000.0)) + 1;
+    return std::max(depth, minDepth);
+}
+
+
+/// ARM memory available to the application (MemAvailable), 0 if unknown
+uint64_t
+BufferPlanner::armAvailable() {
+    FILE *pFile = fopen("/proc/meminfo", "r");
+    if(!pFile)
+        return 0;
+    char line[128];
+    unsigned long long kB = 0;
+    while(fgets(line, sizeof line, pFile)) {
+        if(sscanf(line, "MemAvailable: %llu kB", &kB) == 1)
+            break;
+    }
+    fclose(pFile);
+    return uint64_t(kB) << 10;
+}
+
+
+/**
+ * Plan a pipeline configuration
+ * @param config       The configuration
+ * @param gpuAvailable gpu_mem in bytes (0 = unknown, not checked)
+ * @param armAvailable ARM memory in bytes (0 = unknown, not checked)
+ * @return the buffer depths, the memory needs and whether they fit
+ */
+BufferPlanner::PLAN_T
+BufferPlanner::plan(const CONFIG_T& config, uint64_t gpuAvailable, uint64_t armAvailable) {
+    PLAN_T plan;
+    plan.bFeasible   = true;
+    plan.bMemoryFits = true;
+
+    // Buffer depths
+    plan.previewFrames = depthFor(PREVIEW_FPS, RENDER_SERVICE_MS, 2);
+    plan.videoBuffers  = config.videoWidth > 0 ? depthFor(config.videoFps, VIDEO_SERVICE_MS, 3) : 0;
+    // The encoder may fill buffers faster than the storage drains them:
+    // room for the part of the largest still the storage cannot absorb
+    // meanwhile. The larger the stills of the encoding, the larger the
+    // buffers, so that an uncompressed one does not need too many of them
+    uint64_t bufferSize = (uint64_t(config.maxStillBytes)/MAX_ENCODER_BUFFERS + 4095) & ~uint64_t(4095);
+    plan.encoderBufferSize = uint32_t(std::min(std::max(bufferSize, uint64_t(ENCODER_BUFFER_SIZE)),
+                                               uint64_t(MAX_ENCODER_BUFFER_SIZE)));
+    double backlog = 1.0 - std::min(1.0, config.writeBandwidth/ENCODE_BANDWIDTH);
+    int stillBuffers = int(ceil(double(config.maxStillBytes)/plan.encoderBufferSize));
+    plan.encoderBuffers = std::min(std::max(int(ceil(stillBuffers*backlog)) + 1, 2), MAX_ENCODER_BUFFERS);
+
+    // VideoCore side
+    uint64_t gpu = FIRMWARE_RESERVE;
+    gpu += SENSOR_FRAMES*imageBytes(config.width, config.height, config.bRaw ? 2.0 : 1.25);
+    gpu += imageBytes(config.width, config.height, 1.5);  // ISP still output
+    gpu += uint64_t(plan.previewFrames)*imageBytes(config.previewWidth, config.previewHeight, 1.5);
+    if(config.videoWidth > 0)
+        gpu += uint64_t(plan.videoBuffers)*imageBytes(config.videoWidth, config.videoHeight, 1.5);
+    if(config.bVideoEncoder) // Input, reference and reconstructed frames
+        gpu += 3*imageBytes(config.videoWidth, config.videoHeight, 1.5);
+    if(config.outputWidth > 0 && config.outputHeight > 0 && !config.bDirect)
+        gpu += 2*imageBytes(config.outputWidth, config.outputHeight, 1.5);
+    if(config.bDirect) // RGB24 conversion, then the encoder input of the processed frame
+        gpu += 2*imageBytes(config.width, config.height, 3.0);
+    gpu += uint64_t(plan.encoderBuffers)*plan.encoderBufferSize;
+    plan.gpuBytes = gpu;
+
+    // ARM side
+    uint64_t arm = APP_RESERVE;
+    arm += uint64_t(plan.encoderBuffers)*plan.encoderBufferSize;
+    if(config.videoWidth > 0 && !config.bVideoEncoder)
+        arm += uint64_t(plan.videoBuffers)*imageBytes(config.videoWidth, config.videoHeight, 1.5);
+    if(config.bDirect) // Still port pool and the frames kept by the processing
+        arm += uint64_t(1 + config.armFrames)*imageBytes(config.width, config.height, 3.0);
+    arm += config.ringBytes;
+    arm += config.busBytes;
+    plan.armBytes = arm;
+
+    if(gpuAvailable && plan.gpuBytes > gpuAvailable) {
+        plan.bFeasible   = false;
+        plan.bMemoryFits = false;
+        plan.sReason = QString("needs %1 MB of gpu_mem, %2 MB configured")
+                       .arg(plan.gpuBytes >> 20)
+                       .arg(gpuAvailable >> 20);
+    }
+    else if(armAvailable && plan.armBytes > uint64_t(armAvailable*ARM_MARGIN)) {
+        plan.bFeasible   = false;
+        plan.bMemoryFits = false;
+        plan.sReason = QString("needs %1 MB of memory, %2 MB available")
+                       .arg(plan.armBytes >> 20)
+                       .arg(armAvailable >> 20);
+    }
+    else if(config.stillRate*config.stillBytes >= config.writeBandwidth) {
+        plan.bFeasible = false;
+        plan.sReason = QString("%1 stills/s of %2 KB do not fit in %3 MB/s of storage")
+                       .arg(config.stillRate, 0, 'f', 2)
+                       .arg(config.stillBytes >> 10)
+                       .arg(config.writeBandwidth/(1024*1024), 0, 'f', 1);
+    }
+    return plan;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <QString>
+#include <stdint.h>
+
+
+// Works out, before anything is brought up, the memory a pipeline
+// configuration needs on the GPU (camera, ISP and encoder images, taken
+// from gpu_mem) and on the ARM (buffer pools, frame copies, rings), and
+// the smallest buffer depths that keep up with the requested rates.
+// The sizes are estimates from the frame geometry: they are meant to
+// refuse the configurations that cannot work, not to account every byte.
+class BufferPlanner
+{
+public:
+    typedef struct {
+        int width;              /// Sensor frame (still) size
+        int height;
+        int outputWidth;        /// ISP stage output (0 = no ISP stage)
+        int outputHeight;
+        int previewWidth;       /// Camera preview port
+        int previewHeight;
+        int videoWidth;         /// Camera video port (0 = unused)
+        int videoHeight;
+        int videoFps;
+        bool bVideoEncoder;     /// The video port feeds the MJPEG encoder (pre-trigger ring)
+        uint64_t ringBytes;     /// Pre-trigger ring
+        uint64_t busBytes;      /// Shared memory frame buses
+        bool bRaw;              /// Bayer data attached to the stills
+        bool bDirect;           /// The stills are copied to the ARM side (RGB24)
+        int armFrames;          /// RGB24 frames the direct path keeps on the ARM side
+        double stillRate;       /// Stills per second to sustain
+        uint32_t stillBytes;    /// Expected encoded size of a still
+        uint32_t maxStillBytes; /// Largest still of the encoding (the whole image if uncompressed)
+        double writeBandwidth;  /// Storage throughput, in bytes per second
+    } CONFIG_T;
+
+    typedef struct {
+        int previewFrames;      /// num_preview_video_frames of the camera configuration
+        int videoBuffers;       /// Camera video port buffers
+        int encoderBuffers;     /// Image encoder output buffers
+        uint32_t encoderBufferSize; /// At least: the encoder may ask for more
+        uint64_t gpuBytes;      /// Estimated needs
+        uint64_t armBytes;
+        bool bFeasible;
+        bool bMemoryFits;       /// gpu_mem and ARM memory: the pipeline can be brought up
+        QString sReason;        /// Why not
+    } PLAN_T;
+
+public:
+    static PLAN_T plan(const CONFIG_T& config, uint64_t gpuAvailable, uint64_t armAvailable);
+    static uint64_t armAvailable();
+    static int depthFor(double rate, double serviceMs, int minDepth);
+
+public:
+    static const uint32_t ENCODER_BUFFER_SIZE = 80*1024;      /// Smallest image encoder output buffer
+    static const uint32_t MAX_ENCODER_BUFFER_SIZE = 1024*1024; /// Largest one
+    static const int MAX_ENCODER_BUFFERS = 16;
+};
@@ -623,3 +623,25 @@ CameraControl::set_stereo_mode(MMAL_PORT_T *port, MMAL_PARAMETER_STEREOSCOPIC_MO
     }
     return mmal_status_to_int(mmal_port_parameter_set(port, &stereo.hdr));
 }
+
+
+/**
+ * Read the camera clock (the time base of the buffers pts)
+ * @return the current STC in us (0 if unavailable)
+ */
+uint64_t
+CameraControl::get_system_time() {
+    if(!pComponent) {
+        qDebug() << QString("%1: Component not existing").arg(__func__);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t systemTime = 0;
+    MMAL_STATUS_T status = mmal_port_parameter_get_uint64(pComponent->control, MMAL_PARAMETER_SYSTEM_TIME, &systemTime);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Unable to get System Time: (%2)")
+                    .arg(__func__)
+                    .arg(mmal_status_to_int(status));
+        return 0;
+    }
+    return systemTime;
+}
@@ -108,6 +108,7 @@ public:
 
 //Individual getting functions (NOT YET IMPLEMENTED)
     uint32_t get_shutter_speed();
+    uint64_t get_system_time();
 
 //    int get_saturation(MMAL_COMPONENT_T *camera);
 //    int get_sharpness(MMAL_COMPONENT_T *camera);
@@ -0,0 +1,79 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+
+#if defined(__ARM_FEATURE_CRC32)
+
+uint32_t
+crc32c(uint32_t crc, const void *pData, size_t length) {
+    const uint8_t *p = static_cast<const uint8_t*>(pData);
+    crc = ~crc;
+    while(length && (uintptr_t(p) & 7)) {
+        crc = __crc32cb(crc, *p++);
+        length--;
+    }
+    for(; length >= 8; length -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+    }
+    while(length--)
+        crc = __crc32cb(crc, *p++);
+    return ~crc;
+}
+
+#else
+
+#define CRC32C_POLY 0x82f63b78 // Reflected Castagnoli polynomial
+
+
+// Slice-by-8 tables: table[k][b] is the CRC of byte b followed by k zero bytes
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for(uint32_t i=0; i<256; i++) {
+            uint32_t c = i;
+            for(int k=0; k<8; k++)
+                c = (c & 1) ? CRC32C_POLY ^ (c >> 1) : c >> 1;
+            table[0][i] = c;
+        }
+        for(uint32_t i=0; i<256; i++)
+            for(int k=1; k<8; k++)
+                table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xff];
+    }
+};
+
+
+uint32_t
+crc32c(uint32_t crc, const void *pData, size_t length) {
+    static const Crc32cTables tables; // Built once, thread safe
+    const uint32_t (*t)[256] = tables.table;
+    const uint8_t *p = static_cast<const uint8_t*>(pData);
+    crc = ~crc;
+    while(length && (uintptr_t(p) & 7)) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+    // Little endian host assumed (as the rest of the code)
+    for(; length >= 8; length -= 8, p += 8) {
+        uint32_t low, high;
+        memcpy(&low,  p,   4);
+        memcpy(&high, p+4, 4);
+        low ^= crc;
+        crc = t[7][low & 0xff]          ^ t[6][(low >> 8) & 0xff] ^
+              t[5][(low >> 16) & 0xff]  ^ t[4][low >> 24]         ^
+              t[3][high & 0xff]         ^ t[2][(high >> 8) & 0xff] ^
+              t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+    }
+    while(length--)
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#endif
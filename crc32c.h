@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// CRC-32C (Castagnoli), computed incrementally: start from 0 and feed
+// the chunks as they arrive, crc = crc32c(crc, pData, length).
+// Uses the ARMv8 CRC instructions when the compiler is allowed to,
+// slice-by-8 tables otherwise.
+uint32_t crc32c(uint32_t crc, const void *pData, size_t length);
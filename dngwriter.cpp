@@ -0,0 +1,176 @@
+#include "dngwriter.h"
+
+#include <string.h>
+#include <algorithm>
+
+
+// TIFF field types
+#define TIFF_BYTE      1
+#define TIFF_ASCII     2
+#define TIFF_SHORT     3
+#define TIFF_LONG      4
+#define TIFF_SRATIONAL 10
+
+#define TIFF_HEADER_SIZE 8
+#define TIFF_ENTRY_SIZE  12
+
+
+static uint32_t
+typeSize(uint16_t type) {
+    switch(type) {
+        case TIFF_SHORT:     return 2;
+        case TIFF_LONG:      return 4;
+        case TIFF_SRATIONAL: return 8;
+        default:             return 1;
+    }
+}
+
+
+static void
+put16(std::vector<uint8_t>& v, uint16_t value) {
+    v.push_back(uint8_t(value));
+    v.push_back(uint8_t(value >> 8));
+}
+
+
+static void
+put32(std::vector<uint8_t>& v, uint32_t value) {
+    put16(v, uint16_t(value));
+    put16(v, uint16_t(value >> 16));
+}
+
+
+DngWriter::DngWriter() {
+}
+
+
+void
+DngWriter::addEntry(uint16_t tag, uint16_t type, uint32_t count, const void *pValue) {
+    TIFF_ENTRY_T entry;
+    entry.tag   = tag;
+    entry.type  = type;
+    entry.count = count;
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(pValue);
+    entry.value.assign(p, p + count*typeSize(type));
+    entries.push_back(entry);
+}
+
+
+void
+DngWriter::addShort(uint16_t tag, uint16_t value) {
+    addEntry(tag, TIFF_SHORT, 1, &value);
+}
+
+
+void
+DngWriter::addLong(uint16_t tag, uint32_t value) {
+    addEntry(tag, TIFF_LONG, 1, &value);
+}
+
+
+void
+DngWriter::addAscii(uint16_t tag, const char *value) {
+    addEntry(tag, TIFF_ASCII, uint32_t(strlen(value)+1), value);
+}
+
+
+/**
+ * Write a single strip, uncompressed, CFA DNG (little endian host assumed)
+ * @param pWriter       Output layer, with the DNG file open
+ * @param pData         Bayer samples, width*height, no padding
+ * @param width         Image width
+ * @param height        Image height
+ * @param bayerOrder    A DngWriter::BayerOrder
+ * @param bitsPerSample Significant bits of the samples (10 or 12)
+ * @param cameraName    Sensor name
+ * @return true if all OK
+ */
+bool
+DngWriter::write(FrameWriter *pWriter, const uint16_t *pData, int width, int height,
+                 int bayerOrder, int bitsPerSample, const char *cameraName)
+{
+    static const uint8_t cfaPatterns[4][4] = {
+        {0, 1, 1, 2}, // RGGB
+        {1, 2, 0, 1}, // GBRG
+        {2, 1, 1, 0}, // BGGR
+        {1, 0, 2, 1}  // GRBG
+    };
+    // XYZ to linear sRGB: a neutral starting point, grading replaces it with a real profile
+    static const int32_t colorMatrix[18] = {
+         32406, 10000, -15372, 10000,  -4986, 10000,
+         -9689, 10000,  18758, 10000,    415, 10000,
+           557, 10000,  -2040, 10000,  10570, 10000
+    };
+    static const uint16_t cfaRepeat[2]  = {2, 2};
+    static const uint8_t  dngVersion[4] = {1, 4, 0, 0};
+    static const uint8_t  dngBackward[4]= {1, 1, 0, 0};
+    const uint32_t dataBytes = uint32_t(width)*uint32_t(height)*2;
+
+    entries.clear();
+    addLong (254, 0);                        // NewSubFileType: main image
+    addLong (256, uint32_t(width));          // ImageWidth
+    addLong (257, uint32_t(height));         // ImageLength
+    addShort(258, 16);                       // BitsPerSample
+    addShort(259, 1);                        // Compression: none
+    addShort(262, 32803);                    // PhotometricInterpretation: CFA
+    addAscii(271, "Raspberry Pi");           // Make
+    addAscii(272, cameraName);               // Model
+    addLong (273, 0);                        // StripOffsets (patched below)
+    addShort(274, 1);                        // Orientation
+    addShort(277, 1);                        // SamplesPerPixel
+    addLong (278, uint32_t(height));         // RowsPerStrip
+    addLong (279, dataBytes);                // StripByteCounts
+    addShort(284, 1);                        // PlanarConfiguration
+    addAscii(305, "slowMotion");             // Software
+    addEntry(33421, TIFF_SHORT, 2, cfaRepeat);
+    addEntry(33422, TIFF_BYTE, 4, cfaPatterns[bayerOrder & 3]);
+    addEntry(50706, TIFF_BYTE, 4, dngVersion);
+    addEntry(50707, TIFF_BYTE, 4, dngBackward);
+    addAscii(50708, cameraName);             // UniqueCameraModel
+    addLong (50714, uint32_t(64 << (bitsPerSample-10)));  // BlackLevel
+    addLong (50717, uint32_t((1 << bitsPerSample) - 1));  // WhiteLevel
+    addEntry(50721, TIFF_SRATIONAL, 9, colorMatrix);     // ColorMatrix1
+    addShort(50778, 21);                     // CalibrationIlluminant1: D65
+
+    std::sort(entries.begin(), entries.end(),
+              [](const TIFF_ENTRY_T& a, const TIFF_ENTRY_T& b) { return a.tag < b.tag; });
+    // Layout: header, IFD, out of line values, image data
+    const uint32_t ifdSize = 2 + uint32_t(entries.size())*TIFF_ENTRY_SIZE + 4;
+    uint32_t extraOffset = TIFF_HEADER_SIZE + ifdSize;
+    uint32_t dataOffset  = extraOffset;
+    for(const auto& entry : entries)
+        if(entry.value.size() > 4)
+            dataOffset += uint32_t((entry.value.size() + 1) & ~size_t(1));
+    for(auto& entry : entries)
+        if(entry.tag == 273)
+            memcpy(entry.value.data(), &dataOffset, 4);
+
+    std::vector<uint8_t> header;
+    header.push_back('I');
+    header.push_back('I');
+    put16(header, 42);
+    put32(header, TIFF_HEADER_SIZE);
+    put16(header, uint16_t(entries.size()));
+    std::vector<uint8_t> extra;
+    for(const auto& entry : entries) {
+        put16(header, entry.tag);
+        put16(header, entry.type);
+        put32(header, entry.count);
+        if(entry.value.size() <= 4) {
+            std::vector<uint8_t> value(entry.value);
+            value.resize(4, 0);
+            header.insert(header.end(), value.begin(), value.end());
+        }
+        else {
+            put32(header, extraOffset + uint32_t(extra.size()));
+            extra.insert(extra.end(), entry.value.begin(), entry.value.end());
+            if(extra.size() & 1) // Values start on word boundaries
+                extra.push_back(0);
+        }
+    }
+    put32(header, 0); // No next IFD
+    header.insert(header.end(), extra.begin(), extra.end());
+    if(pWriter->write(header.data(), uint32_t(header.size())) != header.size())
+        return false;
+    return pWriter->write(reinterpret_cast<const uint8_t*>(pData), dataBytes) == dataBytes;
+}
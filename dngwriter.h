@@ -0,0 +1,42 @@
+#pragma once
+
+#include "framewriter.h"
+
+#include <stdint.h>
+#include <vector>
+
+
+// Minimal DNG (TIFF/EP) writer for uncompressed 16 bit Bayer frames
+class DngWriter
+{
+public:
+    DngWriter();
+
+public:
+    bool write(FrameWriter *pWriter, const uint16_t *pData, int width, int height,
+               int bayerOrder, int bitsPerSample, const char *cameraName);
+
+protected:
+    void addEntry(uint16_t tag, uint16_t type, uint32_t count, const void *pValue);
+    void addShort(uint16_t tag, uint16_t value);
+    void addLong(uint16_t tag, uint32_t value);
+    void addAscii(uint16_t tag, const char *value);
+
+public:
+    enum BayerOrder {
+        BAYER_RGGB = 0,
+        BAYER_GBRG = 1,
+        BAYER_BGGR = 2,
+        BAYER_GRBG = 3
+    };
+
+private:
+    typedef struct {
+        uint16_t tag;
+        uint16_t type;
+        uint32_t count;
+        std::vector<uint8_t> value;
+    } TIFF_ENTRY_T;
+
+    std::vector<TIFF_ENTRY_T> entries;
+};
@@ -0,0 +1,193 @@
+#include "exifwriter.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+
+
+// TIFF field types
+#define TIFF_ASCII     2
+#define TIFF_SHORT     3
+#define TIFF_LONG      4
+#define TIFF_RATIONAL  5
+#define TIFF_UNDEFINED 7
+
+#define TIFF_ENTRY_SIZE  12
+
+
+static uint32_t
+typeSize(uint16_t type) {
+    switch(type) {
+        case TIFF_SHORT:    return 2;
+        case TIFF_LONG:     return 4;
+        case TIFF_RATIONAL: return 8;
+        default:            return 1;
+    }
+}
+
+
+static void
+put16(std::vector<uint8_t>& v, uint16_t value) {
+    v.push_back(uint8_t(value));
+    v.push_back(uint8_t(value >> 8));
+}
+
+
+static void
+put32(std::vector<uint8_t>& v, uint32_t value) {
+    put16(v, uint16_t(value));
+    put16(v, uint16_t(value >> 16));
+}
+
+
+ExifWriter::ExifWriter(const char *cameraName)
+    : analogGain(1.0f)
+    , digitalGain(1.0f)
+    , pan(0.0)
+    , tilt(0.0)
+{
+    strncpy(this->cameraName, cameraName, sizeof(this->cameraName));
+    this->cameraName[sizeof(this->cameraName)-1] = 0;
+    segment.reserve(512);
+}
+
+
+void
+ExifWriter::setGains(float analogGain, float digitalGain) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->analogGain  = analogGain;
+    this->digitalGain = digitalGain;
+}
+
+
+void
+ExifWriter::setPanTilt(double pan, double tilt) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->pan  = pan;
+    this->tilt = tilt;
+}
+
+
+void
+ExifWriter::addEntry(std::vector<EXIF_ENTRY_T>& ifd, uint16_t tag, uint16_t type, uint32_t count, const void *pValue) {
+    EXIF_ENTRY_T entry;
+    entry.tag   = tag;
+    entry.type  = type;
+    entry.count = count;
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(pValue);
+    entry.value.assign(p, p + count*typeSize(type));
+    ifd.push_back(entry);
+}
+
+
+void
+ExifWriter::addAscii(std::vector<EXIF_ENTRY_T>& ifd, uint16_t tag, const char *value) {
+    addEntry(ifd, tag, TIFF_ASCII, uint32_t(strlen(value)+1), value);
+}
+
+
+/**
+ * Append an IFD (and its out of line values) to the segment
+ * @param ifd       The entries (sorted here)
+ * @param ifdOffset Offset of the IFD from the TIFF header
+ */
+void
+ExifWriter::writeIfd(std::vector<EXIF_ENTRY_T>& ifd, uint32_t ifdOffset) {
+    std::sort(ifd.begin(), ifd.end(),
+              [](const EXIF_ENTRY_T& a, const EXIF_ENTRY_T& b) { return a.tag < b.tag; });
+    uint32_t dataOffset = ifdOffset + 2 + uint32_t(ifd.size())*TIFF_ENTRY_SIZE + 4;
+    std::vector<uint8_t> data;
+    put16(segment, uint16_t(ifd.size()));
+    for(const auto& entry : ifd) {
+        put16(segment, entry.tag);
+        put16(segment, entry.type);
+        put32(segment, entry.count);
+        if(entry.value.size() <= 4) {
+            std::vector<uint8_t> inlineValue(entry.value);
+            inlineValue.resize(4, 0);
+            segment.insert(segment.end(), inlineValue.begin(), inlineValue.end());
+        }
+        else {
+            put32(segment, dataOffset + uint32_t(data.size()));
+            data.insert(data.end(), entry.value.begin(), entry.value.end());
+            if(data.size() & 1)
+                data.push_back(0);
+        }
+    }
+    put32(segment, 0); // No next IFD
+    segment.insert(segment.end(), data.begin(), data.end());
+}
+
+
+/**
+ * Build the APP1 segment of a frame (little endian host assumed)
+ * @param frameNumber Frame index in the run (-1 if not known)
+ * @param exposureUs  Exposure time (0 if unknown: no tag)
+ * @return the segment, from the APP1 marker on
+ */
+const std::vector<uint8_t>&
+ExifWriter::build(int frameNumber, uint32_t exposureUs) {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    struct tm local;
+    localtime_r(&now.tv_sec, &local);
+    char dateTime[20];
+    strftime(dateTime, sizeof(dateTime), "%Y:%m:%d %H:%M:%S", &local);
+    char subSec[4];
+    snprintf(subSec, sizeof(subSec), "%03d", int(now.tv_usec/1000));
+    char description[128];
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        snprintf(description, sizeof(description),
+                 "frame %d pan %.0f tilt %.0f again %.2f dgain %.2f",
+                 frameNumber, pan, tilt, double(analogGain), double(digitalGain));
+    }
+
+    std::vector<EXIF_ENTRY_T> exifIfd;
+    if(exposureUs) {
+        uint32_t exposure[2] = {exposureUs, 1000000};
+        addEntry(exifIfd, 0x829A, TIFF_RATIONAL, 1, exposure); // ExposureTime
+    }
+    addEntry(exifIfd, 0x9000, TIFF_UNDEFINED, 4, "0230");      // ExifVersion
+    addAscii(exifIfd, 0x9003, dateTime);                       // DateTimeOriginal
+    addAscii(exifIfd, 0x9291, subSec);                         // SubSecTimeOriginal
+
+    std::vector<EXIF_ENTRY_T> ifd0;
+    addAscii(ifd0, 0x010E, description);                       // ImageDescription
+    addAscii(ifd0, 0x010F, "RaspberryPi");                     // Make
+    addAscii(ifd0, 0x0110, cameraName);                        // Model
+    addAscii(ifd0, 0x0131, "slowMotion");                      // Software
+    addAscii(ifd0, 0x0132, dateTime);                          // DateTime
+    uint32_t placeholder = 0;
+    addEntry(ifd0, 0x8769, TIFF_LONG, 1, &placeholder);        // ExifIFDPointer, patched below
+
+    segment.clear();
+    segment.push_back(0xFF);
+    segment.push_back(0xE1);
+    put16(segment, 0); // Length, patched below
+    const char exifId[6] = {'E', 'x', 'i', 'f', 0, 0};
+    segment.insert(segment.end(), exifId, exifId+6);
+    const size_t tiffStart = segment.size();
+    segment.push_back('I');
+    segment.push_back('I');
+    put16(segment, 42);
+    put32(segment, 8);
+    writeIfd(ifd0, 8);
+    // Point the ExifIFDPointer entry to the Exif IFD that follows
+    uint32_t exifOffset = uint32_t(segment.size() - tiffStart);
+    if(exifOffset & 1) {
+        segment.push_back(0);
+        exifOffset++;
+    }
+    size_t pointerEntry = tiffStart + 8 + 2 + (ifd0.size()-1)*TIFF_ENTRY_SIZE;
+    for(int i=0; i<4; i++)
+        segment[pointerEntry + 8 + size_t(i)] = uint8_t(exifOffset >> (8*i));
+    writeIfd(exifIfd, exifOffset);
+    // The length is big endian and does not include the marker
+    uint16_t length = uint16_t(segment.size() - 2);
+    segment[2] = uint8_t(length >> 8);
+    segment[3] = uint8_t(length);
+    return segment;
+}
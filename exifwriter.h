@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+
+// Builds the APP1/EXIF segment spliced after the SOI marker of every
+// JPEG by the encoder callback (see PiCamera::capture()).
+// The values that do not change with every frame are set from the
+// GUI thread, build() is called by the capturing thread.
+class ExifWriter
+{
+public:
+    ExifWriter(const char *cameraName);
+
+public:
+    void setGains(float analogGain, float digitalGain);
+    void setPanTilt(double pan, double tilt);
+    const std::vector<uint8_t>& build(int frameNumber, uint32_t exposureUs);
+
+protected:
+    typedef struct {
+        uint16_t tag;
+        uint16_t type;
+        uint32_t count;
+        std::vector<uint8_t> value;
+    } EXIF_ENTRY_T;
+
+    void addEntry(std::vector<EXIF_ENTRY_T>& ifd, uint16_t tag, uint16_t type, uint32_t count, const void *pValue);
+    void addAscii(std::vector<EXIF_ENTRY_T>& ifd, uint16_t tag, const char *value);
+    void writeIfd(std::vector<EXIF_ENTRY_T>& ifd, uint32_t ifdOffset);
+
+private:
+    char cameraName[32];
+    float analogGain;
+    float digitalGain;
+    double pan;
+    double tilt;
+    std::mutex mutex;
+    std::vector<uint8_t> segment;
+};
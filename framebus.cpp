@@ -0,0 +1,164 @@
+#include "framebus.h"
+
+#include <QDebug>
+#include <QFileInfo>
+
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+#define SLOT_ALIGNMENT 4096
+
+
+static_assert(sizeof(FrameBus::BUS_HEADER_T)  == 64,  "The bus header is part of the shared layout");
+static_assert(sizeof(FrameBus::SLOT_HEADER_T) == 128, "The slot header is part of the shared layout");
+
+
+/**
+ * Create the shared memory ring (replacing a stale one)
+ * @param sName         Shared memory object, e.g. "/slowMotion.stills"
+ * @param nSlots        Frames kept for the readers
+ * @param maxFrameBytes Largest frame: larger ones are dropped (and counted)
+ */
+FrameBus::FrameBus(QString sName, uint32_t nSlots, uint32_t maxFrameBytes)
+    : sShmName(sName)
+    , fd(-1)
+    , pMap(nullptr)
+    , mapSize(0)
+    , pHeader(nullptr)
+    , slotSize(0)
+    , seq(0)
+    , pSlot(nullptr)
+    , bOverflow(false)
+{
+    slotSize = (uint32_t(sizeof(SLOT_HEADER_T)) + maxFrameBytes + SLOT_ALIGNMENT-1) & ~uint32_t(SLOT_ALIGNMENT-1);
+    mapSize  = SLOT_ALIGNMENT + size_t(nSlots)*slotSize;
+    shm_unlink(sShmName.toLatin1().constData());
+    fd = shm_open(sShmName.toLatin1().constData(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0 || ftruncate(fd, off_t(mapSize)) != 0) {
+        qDebug() << QString("%1: Unable to create %2").arg(__func__).arg(sShmName);
+        return;
+    }
+    void *p = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) {
+        qDebug() << QString("%1: Unable to map %2").arg(__func__).arg(sShmName);
+        return;
+    }
+    pMap    = static_cast<uint8_t*>(p);
+    pHeader = reinterpret_cast<BUS_HEADER_T*>(pMap);
+    memset(pHeader, 0, sizeof(BUS_HEADER_T));
+    pHeader->nSlots   = nSlots;
+    pHeader->slotSize = slotSize;
+    pHeader->version  = VERSION;
+    // Readers check the magic last
+    __atomic_store_n(&pHeader->magic, MAGIC, __ATOMIC_RELEASE);
+}
+
+
+FrameBus::~FrameBus() {
+    if(pMap)
+        munmap(pMap, mapSize);
+    if(fd >= 0) {
+        close(fd);
+        shm_unlink(sShmName.toLatin1().constData());
+    }
+}
+
+
+bool
+FrameBus::isValid() const {
+    return pHeader != nullptr;
+}
+
+
+/**
+ * Start publishing a frame: the oldest slot is taken over
+ * @param kind      A FrameBus::Kind
+ * @param width     Frame size (0 for the encoded frames)
+ * @param height
+ * @param sFileName Output file of the encoded frames
+ */
+void
+FrameBus::begin(int kind, int width, int height, QString sFileName) {
+    if(!pHeader)
+        return;
+    seq++;
+    if(seq > UINT32_MAX/2) // Keep 2n in range: head goes back to 1 (see the class comment)
+        seq = 1;
+    pSlot = reinterpret_cast<SLOT_HEADER_T*>(pMap + SLOT_ALIGNMENT + size_t(seq % pHeader->nSlots)*slotSize);
+    // Odd: the readers of the previous frame of this slot will notice
+    __atomic_store_n(&pSlot->seq, 2*seq-1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pSlot->kind   = uint32_t(kind);
+    pSlot->length = 0;
+    pSlot->width  = uint32_t(width);
+    pSlot->height = uint32_t(height);
+    pSlot->crc    = 0;
+    memset(pSlot->name, 0, sizeof(pSlot->name));
+    strncpy(pSlot->name, QFileInfo(sFileName).fileName().toLocal8Bit().constData(), sizeof(pSlot->name)-1);
+    bOverflow = false;
+}
+
+
+/// Add a chunk to the frame being published
+void
+FrameBus::append(const uint8_t *pData, uint32_t length) {
+    if(!pSlot || bOverflow)
+        return;
+    if(length > slotSize - sizeof(SLOT_HEADER_T) - pSlot->length) {
+        bOverflow = true;
+        return;
+    }
+    memcpy(reinterpret_cast<uint8_t*>(pSlot+1) + pSlot->length, pData, length);
+    pSlot->length += length;
+}
+
+
+/**
+ * Make the frame being published visible and wake up the readers
+ * @param crc CRC-32C of the frame (0 if unknown)
+ */
+void
+FrameBus::commit(uint32_t crc) {
+    if(!pSlot)
+        return;
+    if(bOverflow) {
+        __atomic_fetch_add(&pHeader->dropped, 1, __ATOMIC_RELAXED);
+        abort();
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pSlot->crc = crc;
+    pSlot->timestampUs = int64_t(now.tv_sec)*1000000 + now.tv_nsec/1000;
+    __atomic_store_n(&pSlot->seq, 2*seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&pHeader->head, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&pHeader->futex, seq, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &pHeader->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    pSlot = nullptr;
+}
+
+
+/// Give up the frame being published (its slot stays invalid)
+void
+FrameBus::abort() {
+    if(!pSlot)
+        return;
+    __atomic_store_n(&pSlot->seq, 0, __ATOMIC_RELEASE);
+    pSlot = nullptr;
+}
+
+
+/// Publish a whole frame at once
+void
+FrameBus::publish(int kind, int width, int height, const uint8_t *pData, uint32_t length) {
+    begin(kind, width, height, QString());
+    append(pData, length);
+    commit(0);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <QString>
+#include <stdint.h>
+
+
+// Publishes frames to other processes through a POSIX shared memory ring
+// (/dev/shm/<name>), so that they get the stills without polling the
+// output folder or reading the storage again.
+//
+// There is a single writer and any number of readers, and the writer
+// never waits for them: a slot is simply overwritten once the ring has
+// wrapped around. Every slot is guarded by a sequence lock. A reader:
+//  - waits on the futex word of the header (FUTEX_WAIT, shared) while
+//    it still holds the last sequence number seen,
+//  - takes n = head, the slot n % nSlots, and checks that its seq is 2n,
+//  - uses the data in place (no copy), then reads seq again:
+//    if it changed, the slot has been overwritten meanwhile and what
+//    was read must be discarded.
+// The sequence numbers wrap around to 1 after 2^31-1 frames (2n must fit
+// in seq), so head can go backwards: a reader tells a new frame by
+// head != last seen, never by head > last seen.
+class FrameBus
+{
+public:
+    enum Kind {
+        FRAME_ENCODED = 0, /// A still as written to the storage (JPEG, PNG, QOI...)
+        FRAME_I420    = 1  /// A raw YUV 4:2:0 frame of width x height (width is the stride)
+    };
+
+    typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nSlots;
+        uint32_t slotSize;    /// Bytes of a slot, its SLOT_HEADER_T included
+        uint32_t head;        /// Sequence number of the last published frame (0 = none, see above for the wrap)
+        uint32_t futex;       /// Equal to head, waited on by the readers
+        uint32_t dropped;     /// Frames too large for a slot
+        uint32_t reserved[9];
+    } BUS_HEADER_T;
+
+    typedef struct {
+        uint32_t seq;         /// 2n when frame n is complete, odd while it is written
+        uint32_t kind;        /// A FrameBus::Kind
+        uint32_t length;      /// Bytes of data following the slot header
+        uint32_t width;       /// 0 when in the encoded stream
+        uint32_t height;
+        uint32_t crc;         /// CRC-32C of the data (encoded frames only)
+        int64_t  timestampUs; /// Publication time, CLOCK_REALTIME
+        char     name[96];    /// Output file name (encoded frames only)
+    } SLOT_HEADER_T;
+
+public:
+    FrameBus(QString sName, uint32_t nSlots, uint32_t maxFrameBytes);
+    ~FrameBus();
+
+public:
+    bool isValid() const;
+    void begin(int kind, int width, int height, QString sFileName);
+    void append(const uint8_t *pData, uint32_t length);
+    void commit(uint32_t crc);
+    void abort();
+    void publish(int kind, int width, int height, const uint8_t *pData, uint32_t length);
+
+public:
+    static const uint32_t MAGIC   = 0x42464d53; // "SMFB"
+    static const uint32_t VERSION = 1;
+
+private:
+    QString sShmName;
+    int fd;
+    uint8_t *pMap;
+    size_t mapSize;
+    BUS_HEADER_T *pHeader;
+    uint32_t slotSize;
+    uint32_t seq;            /// Of the frame being written
+    SLOT_HEADER_T *pSlot;    /// Being written (nullptr = none)
+    bool bOverflow;          /// The frame being written does not fit
+};
@@ -0,0 +1,221 @@
+#include "framering.h"
+#include "utility.h"
+#include <QDebug>
+
+#include <string.h>
+
+
+FrameRing::FrameRing(size_t budget, uint32_t slotSize, int preRollMs, int postRollMs)
+    : slotSize(slotSize)
+    , nSlots(int(budget/slotSize))
+    , preRoll(preRollMs)
+    , postRoll(postRollMs)
+    , oldestSeq(0)
+    , nextSeq(0)
+    , partialLength(0)
+    , bDropping(false)
+    , pinSeq(0)
+    , bFlushing(false)
+    , bTriggered(false)
+    , depthMs(0)
+    , droppedFrames(0)
+    , bStop(false)
+{
+    if(nSlots < 2)
+        nSlots = 2;
+    // The whole budget is allocated (and touched) now: no allocations while capturing
+    arena.assign(size_t(nSlots)*slotSize, 0);
+    slotInfo.resize(size_t(nSlots));
+    writer = std::thread(&FrameRing::run, this);
+}
+
+
+/// Waits for a pending flush to complete, then stops the writer
+FrameRing::~FrameRing() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    cond.notify_all();
+    writer.join();
+    if(droppedFrames)
+        qDebug() << QString("%1 frames did not fit the ring").arg(droppedFrames);
+}
+
+
+int
+FrameRing::slotCount() const {
+    return nSlots;
+}
+
+
+/**
+ * Append a chunk of an encoded frame (called from the encoder callback)
+ * @param pData     Encoded data
+ * @param length    Length of the chunk
+ * @param bFrameEnd The chunk completes the frame
+ */
+void
+FrameRing::append(const uint8_t *pData, uint32_t length, bool bFrameEnd) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if(partialLength == 0 && !bDropping && nextSeq - oldestSeq == uint64_t(nSlots)) {
+        // The ring is full: the oldest frame goes, unless it is waiting to be written
+        if(bFlushing && oldestSeq >= pinSeq)
+            bDropping = true;
+        else
+            oldestSeq++;
+    }
+    if(!bDropping && partialLength + length > slotSize)
+        bDropping = true;
+    if(!bDropping) {
+        uint8_t *pSlot = arena.data() + size_t(nextSeq % uint64_t(nSlots))*slotSize;
+        memcpy(pSlot + partialLength, pData, length);
+        partialLength += length;
+    }
+    if(!bFrameEnd)
+        return;
+    if(bDropping) {
+        droppedFrames++;
+    }
+    else {
+        SLOT_T& slot = slotInfo[size_t(nextSeq % uint64_t(nSlots))];
+        slot.length = partialLength;
+        slot.time   = Clock::now();
+        nextSeq++;
+    }
+    partialLength = 0;
+    bDropping = false;
+    lock.unlock();
+    cond.notify_all();
+}
+
+
+/**
+ * Start writing the pre-roll frames and the frames of the next postRoll ms
+ * @param sPathName The MJPEG file to write
+ * @return false if a flush is already in progress
+ */
+bool
+FrameRing::trigger(QString sPathName) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(bFlushing || bTriggered)
+        return false;
+    triggerTime = Clock::now();
+    // Pin the frames received in the last preRoll ms
+    pinSeq = nextSeq;
+    while(pinSeq > oldestSeq &&
+          triggerTime - slotInfo[size_t((pinSeq-1) % uint64_t(nSlots))].time <= preRoll)
+        pinSeq--;
+    depthMs = 0;
+    if(pinSeq < nextSeq)
+        depthMs = int(std::chrono::duration_cast<std::chrono::milliseconds>
+                      (triggerTime - slotInfo[size_t(pinSeq % uint64_t(nSlots))].time).count());
+    sFlushPath = sPathName;
+    bFlushing  = true;
+    bTriggered = true;
+    cond.notify_all();
+    return true;
+}
+
+
+/**
+ * Trigger on a GPIO edge (a pigpiod_if2 callback, run in its own thread)
+ * @param userdata A FrameRing::TRIGGER_T
+ */
+void
+FrameRing::edgeCallback(int pi, unsigned gpio, unsigned level, uint32_t tick, void *userdata) {
+    Q_UNUSED(pi)
+    Q_UNUSED(gpio)
+    Q_UNUSED(level)
+    Q_UNUSED(tick)
+    TRIGGER_T *pTrigger = reinterpret_cast<TRIGGER_T *>(userdata);
+    std::lock_guard<std::mutex> lock(pTrigger->mutex);
+    if(!pTrigger->pRing) // Edge received while stopping
+        return;
+    QString sFileName = QString("%1%2.mjpeg")
+            .arg(pTrigger->sEventBase)
+            .arg(pTrigger->eventNum, 4, 10, QLatin1Char('0'));
+    if(pTrigger->pRing->trigger(sFileName)) {
+        qDebug() << QString("Trigger: %1 ms of pre-roll to %2")
+                    .arg(pTrigger->pRing->preRollDepth())
+                    .arg(sFileName);
+        pTrigger->eventNum++;
+    }
+    else
+        qDebug() << "Trigger ignored: the previous event is still being written";
+}
+
+
+/// Pre-roll (in ms) that was actually available at the last trigger
+int
+FrameRing::preRollDepth() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return depthMs;
+}
+
+
+void
+FrameRing::run() {
+    for(;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return bStop || bTriggered; });
+            if(!bTriggered)
+                return;
+            bTriggered = false;
+        }
+        flush();
+    }
+}
+
+
+/// Write the pinned frames, then the post-trigger ones as they arrive
+void
+FrameRing::flush() {
+    QString sPathName;
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sPathName = sFlushPath;
+        seq = pinSeq;
+    }
+    FILE *file = fopen(sPathName.toLatin1(), "wb");
+    if(!file)
+        qDebug() << QString("%1: Error opening output file: %2").arg(__func__).arg(sPathName);
+    int nWritten = 0;
+    for(;;) {
+        const uint8_t *pSlot;
+        uint32_t length;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // The writer holds the stop until the post-roll is complete
+            bool bTimeout = !cond.wait_until(lock, triggerTime + postRoll + std::chrono::seconds(1),
+                                             [this, seq] { return seq < nextSeq; });
+            if(bTimeout || seq < oldestSeq)
+                break;
+            const SLOT_T& slot = slotInfo[size_t(seq % uint64_t(nSlots))];
+            if(slot.time - triggerTime > postRoll)
+                break;
+            pSlot  = arena.data() + size_t(seq % uint64_t(nSlots))*slotSize;
+            length = slot.length;
+        }
+        // The slot is pinned: it can be written without holding the lock
+        if(file && fwrite(pSlot, 1, length, file) != length) {
+            qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(sPathName);
+            fclose(file);
+            file = nullptr;
+        }
+        nWritten++;
+        std::lock_guard<std::mutex> lock(mutex);
+        pinSeq = ++seq;
+    }
+    if(file)
+        fclose(file);
+    std::lock_guard<std::mutex> lock(mutex);
+    bFlushing = false;
+    if(verbose)
+        qDebug() << QString("Written %1 frames (%2 ms pre-roll) to %3")
+                    .arg(nWritten)
+                    .arg(depthMs)
+                    .arg(sPathName);
+}
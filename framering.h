@@ -0,0 +1,72 @@
+#pragma once
+
+#include <QString>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+
+// Keeps the last encoded video frames in a preallocated arena of
+// fixed size slots. On trigger() the frames of the last preRoll
+// milliseconds are pinned (no longer overwritten) and written to disk,
+// followed by the frames arriving in the next postRoll milliseconds.
+// edgeCallback() triggers it from the pigpiod_if2 callback thread.
+class FrameRing
+{
+public:
+    // Shared between the owner of the ring and the pigpiod_if2 callback thread
+    typedef struct {
+        std::mutex mutex;
+        FrameRing *pRing;     /// nullptr: the edges are ignored (stopping)
+        QString sEventBase;   /// The events go to <sEventBase>NNNN.mjpeg
+        int eventNum;         /// Next event
+    } TRIGGER_T;
+
+public:
+    FrameRing(size_t budget, uint32_t slotSize, int preRollMs, int postRollMs);
+    ~FrameRing();
+
+public:
+    void append(const uint8_t *pData, uint32_t length, bool bFrameEnd);
+    bool trigger(QString sPathName);
+    int preRollDepth() const;
+    int slotCount() const;
+    static void edgeCallback(int pi, unsigned gpio, unsigned level, uint32_t tick, void *userdata);
+
+protected:
+    void run();
+    void flush();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    typedef struct {
+        uint32_t length;
+        Clock::time_point time; /// Arrival of the frame end
+    } SLOT_T;
+
+    uint32_t slotSize;
+    int nSlots;
+    std::chrono::milliseconds preRoll;
+    std::chrono::milliseconds postRoll;
+    std::vector<uint8_t> arena;
+    std::vector<SLOT_T> slotInfo;
+    uint64_t oldestSeq;          /// Oldest frame still in the ring
+    uint64_t nextSeq;            /// Frame being received
+    uint32_t partialLength;      /// Bytes received of the frame nextSeq
+    bool bDropping;              /// The frame being received does not fit
+    uint64_t pinSeq;             /// Frames from here on are not overwritten while flushing
+    bool bFlushing;
+    bool bTriggered;
+    Clock::time_point triggerTime;
+    QString sFlushPath;
+    int depthMs;                 /// Pre-roll actually available at the last trigger
+    uint64_t droppedFrames;
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    bool bStop;
+    std::thread writer;
+};
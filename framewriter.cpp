@@ -0,0 +1,333 @@
+#include "framewriter.h"
+#include "utility.h"
+#include "crc32c.h"
+#include <QDebug>
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+
+#define RESERVE_FILE ".slowMotion.reserve"
+#define FREE_SPACE_MARGIN (64ull*1024*1024) // Left free for the system
+
+
+FrameWriter::FrameWriter()
+    : pStaging(nullptr)
+    , staged(0)
+    , fd(-1)
+    , frameIndex(-1)
+    , fileBytes(0)
+    , fileCrc(0)
+    , bWriteError(false)
+    , dirFd(-1)
+    , reserveFd(-1)
+    , reserved(0)
+    , frameEstimate(0)
+    , policy(FLUSH_EVERY_N)
+    , flushEvery(1)
+    , unsynced(0)
+    , totalBytes(0)
+    , nFrames(0)
+    , pBus(nullptr)
+    , pSink(nullptr)
+    , pJournal(nullptr)
+{
+    if(posix_memalign(reinterpret_cast<void**>(&pStaging), ALIGNMENT, STAGING_SIZE) != 0) {
+        qDebug() << QString("%1: Unable to allocate the staging buffer").arg(__func__);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+FrameWriter::~FrameWriter() {
+    end();
+    free(pStaging);
+}
+
+
+/**
+ * Prepare a run: check the free space and reserve it
+ * @param sDir          Output directory
+ * @param expectedBytes Expected size of the whole run (0 if unknown)
+ * @param frameEstimate Space to preallocate for every still
+ * @param policy        When the stills are flushed to the storage
+ * @param flushEvery    Stills between flushes (FLUSH_EVERY_N only)
+ * @return false if the run does not fit the free space
+ */
+bool
+FrameWriter::begin(QString sDir, uint64_t expectedBytes, uint32_t frameEstimate,
+                   FlushPolicy policy, int flushEvery) {
+    end();
+    this->frameEstimate = frameEstimate;
+    this->policy        = policy;
+    this->flushEvery    = flushEvery > 0 ? flushEvery : 1;
+    unsynced   = 0;
+    totalBytes = 0;
+    nFrames    = 0;
+    struct statvfs fsStat;
+    if(statvfs(sDir.toLatin1(), &fsStat) == 0) {
+        uint64_t available = uint64_t(fsStat.f_bavail)*fsStat.f_frsize;
+        if(expectedBytes + FREE_SPACE_MARGIN > available) {
+            qDebug() << QString("%1: The run needs %2 MB, only %3 MB available")
+                        .arg(__func__)
+                        .arg(expectedBytes >> 20)
+                        .arg(available >> 20);
+            return false;
+        }
+    }
+    dirFd = ::open(sDir.toLatin1(), O_RDONLY | O_DIRECTORY);
+    if(expectedBytes == 0)
+        return true;
+    sReservePath = QString("%1/%2").arg(sDir).arg(RESERVE_FILE);
+    reserveFd = ::open(sReservePath.toLatin1(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(reserveFd < 0 || fallocate(reserveFd, 0, 0, off_t(expectedBytes)) != 0) {
+        // Not supported by the file system (or no space after all): go on unreserved
+        if(errno == ENOSPC) {
+            qDebug() << QString("%1: Unable to reserve %2 MB").arg(__func__).arg(expectedBytes >> 20);
+            end();
+            return false;
+        }
+        if(reserveFd >= 0) {
+            ::close(reserveFd);
+            unlink(sReservePath.toLatin1());
+        }
+        reserveFd = -1;
+        return true;
+    }
+    reserved = expectedBytes;
+    return true;
+}
+
+
+/// End the run: flush what the policy left pending and free the unused reserve
+void
+FrameWriter::end() {
+    // Waits for the still another thread may be writing
+    std::lock_guard<std::mutex> lock(stillMutex);
+    if(dirFd >= 0) {
+        // Also retries the stills a failed sync has left pending
+        if((unsynced || !pending.empty()) && syncfs(dirFd) != 0)
+            qDebug() << QString("%1: Unable to sync the stills: %2 not journaled")
+                        .arg(__func__)
+                        .arg(pending.size());
+        else
+            journalPending();
+        ::close(dirFd);
+    }
+    dirFd = -1;
+    pending.clear();
+    unsynced = 0;
+    if(reserveFd >= 0) {
+        ::close(reserveFd);
+        unlink(sReservePath.toLatin1());
+    }
+    reserveFd = -1;
+    reserved  = 0;
+}
+
+
+/// Journal the stills the last sync has made durable
+void
+FrameWriter::journalPending() {
+    if(pJournal) {
+        for(const PENDING_T& still : pending)
+            pJournal->append(uint32_t(still.frameIndex), still.sFilePath, still.size, still.crc);
+    }
+    pending.clear();
+}
+
+
+/// Give bytes of the reserve back to the file system
+void
+FrameWriter::releaseReserve(uint64_t bytes) {
+    if(reserveFd < 0)
+        return;
+    reserved = bytes < reserved ? reserved - bytes : 0;
+    if(ftruncate(reserveFd, off_t(reserved)) != 0)
+        qDebug() << QString("%1: Unable to shrink the reserve").arg(__func__);
+}
+
+
+/**
+ * Start a new still, waiting for the still of another thread to be closed
+ * (every successful open() must be followed by a close() from the same thread)
+ * @param sPathName  The output file
+ * @param frameIndex Index of the still in the run, to journal it (-1 = a file not journaled)
+ * @return false if the file cannot be created
+ */
+bool
+FrameWriter::open(QString sPathName, int frameIndex) {
+    stillMutex.lock();
+    fd = ::open(sPathName.toLatin1(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        stillMutex.unlock();
+        return false;
+    }
+    sFilePath = sPathName;
+    this->frameIndex = frameIndex;
+    // Preallocate the expected size in one extent, taking it from the reserve
+    // (close() truncates the file to the bytes actually written)
+    if(frameEstimate) {
+        releaseReserve(frameEstimate);
+        fallocate(fd, 0, 0, off_t(frameEstimate));
+    }
+    staged      = 0;
+    fileBytes   = 0;
+    fileCrc     = 0;
+    bWriteError = false;
+    // The stills of the run only (as the stream): not their companions (DNG, reduced copies)
+    if(pBus && frameIndex >= 0)
+        pBus->begin(FrameBus::FRAME_ENCODED, 0, 0, sPathName);
+    return true;
+}
+
+
+/// Write the first length staged bytes
+bool
+FrameWriter::writeStaged(uint32_t length) {
+    uint32_t done = 0;
+    while(done < length) {
+        ssize_t result = ::write(fd, pStaging+done, length-done);
+        if(result < 0) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        done += uint32_t(result);
+    }
+    return true;
+}
+
+
+/**
+ * Append a chunk of the current still (called from the encoder callback)
+ * @return the number of bytes accepted
+ */
+uint32_t
+FrameWriter::write(const uint8_t *pData, uint32_t length) {
+    if(fd < 0 || bWriteError)
+        return 0;
+    // Checksummed on the way, while the data is still in the cache
+    fileCrc = crc32c(fileCrc, pData, length);
+    if(pBus && frameIndex >= 0)
+        pBus->append(pData, length);
+    if(pSink && frameIndex >= 0)
+        pSink->append(pData, length);
+    uint32_t accepted = 0;
+    while(accepted < length) {
+        uint32_t chunk = std::min(length-accepted, STAGING_SIZE-staged);
+        memcpy(pStaging+staged, pData+accepted, chunk);
+        staged   += chunk;
+        accepted += chunk;
+        if(staged == STAGING_SIZE) {
+            if(!writeStaged(STAGING_SIZE)) {
+                bWriteError = true;
+                return accepted - chunk;
+            }
+            staged = 0;
+        }
+    }
+    fileBytes += length;
+    return length;
+}
+
+
+/**
+ * Complete the current still and apply the flush policy
+ * (a still that failed or was cancelled is removed: no truncated file is left)
+ * @return false if any write failed
+ */
+bool
+FrameWriter::close() {
+    if(fd < 0)
+        return false;
+    bool bOk = !bWriteError && writeStaged(staged);
+    staged = 0;
+    // Give back the preallocated space not used
+    if(ftruncate(fd, off_t(fileBytes)) != 0)
+        bOk = false;
+    unsynced++;
+    // Whether this still, and the ones written before it, are on the storage
+    bool bSynced = false;
+    if(policy == FLUSH_EVERY_FRAME) {
+        bSynced = fdatasync(fd) == 0;
+        if(!bSynced)
+            bOk = false;
+        unsynced = 0;
+    }
+    else if(policy == FLUSH_EVERY_N && unsynced >= flushEvery) {
+        bSynced = syncfs(fd) == 0;
+        if(!bSynced)
+            bOk = false;
+        unsynced = 0;
+    }
+    if(::close(fd) != 0)
+        bOk = false;
+    fd = -1;
+    if(bOk) {
+        totalBytes += fileBytes;
+        nFrames++;
+    }
+    else
+        unlink(sFilePath.toLatin1());
+    // A still is journaled once the sync that covers it has succeeded
+    // (the next ones, or end(), for the stills the policy leaves unsynced)
+    if(bOk && pJournal && frameIndex >= 0)
+        pending.push_back({frameIndex, sFilePath, uint32_t(fileBytes), fileCrc});
+    if(bSynced)
+        journalPending();
+    if(pBus && frameIndex >= 0) {
+        if(bOk)
+            pBus->commit(fileCrc);
+        else
+            pBus->abort();
+    }
+    if(pSink && frameIndex >= 0) {
+        if(bOk)
+            pSink->endFrame();
+        else
+            pSink->discard();
+    }
+    stillMutex.unlock();
+    return bOk;
+}
+
+
+/// Mark the current still as incomplete: close() will fail
+void
+FrameWriter::cancel() {
+    bWriteError = true;
+}
+
+
+/// Publish the next stills opened with an index on a frame bus as well (nullptr = stop publishing)
+void
+FrameWriter::setBus(FrameBus *pFrameBus) {
+    pBus = pFrameBus;
+}
+
+
+/// Stream the next stills opened with an index to a sink as well (nullptr = stop streaming)
+void
+FrameWriter::setSink(StreamSink *pStreamSink) {
+    pSink = pStreamSink;
+}
+
+
+/// Journal the next stills opened with an index (nullptr = stop journaling)
+void
+FrameWriter::setJournal(RunJournal *pRunJournal) {
+    pJournal = pRunJournal;
+}
+
+
+/// Average size of the stills written in the run (0 if none)
+uint32_t
+FrameWriter::averageFrameSize() const {
+    return nFrames ? uint32_t(totalBytes/nFrames) : 0;
+}
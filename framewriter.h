@@ -0,0 +1,92 @@
+#pragma once
+
+#include "framebus.h"
+#include "streamsink.h"
+#include "runjournal.h"
+
+#include <QString>
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+
+// Output layer for the encoded stills.
+// At the start of a run the expected size of the whole run is checked
+// against the free space and reserved with fallocate(), so the run fails
+// fast instead of stalling (or fragmenting the card) when it is almost full.
+// The stills are staged in an aligned buffer and written in large, block
+// aligned chunks; when they reach the storage is a matter of FlushPolicy.
+// Every still is checksummed (CRC-32C) as it streams through, and can be
+// published to the other processes on a FrameBus, or streamed to a
+// StreamSink, at the same time. The stills of the run are journaled
+// (see RunJournal) only once the sync that covers them has succeeded.
+// It is the single sink of the stills of a run: the capture thread and the
+// workers (fusion, raw, pyramid...) write through the same FrameWriter, one
+// still at a time (open() waits until the still of another thread is closed).
+class FrameWriter
+{
+public:
+    enum FlushPolicy {
+        FLUSH_EVERY_FRAME = 0, /// fdatasync() every still
+        FLUSH_EVERY_N     = 1, /// syncfs() every flushEvery stills
+        FLUSH_ON_STOP     = 2  /// syncfs() at the end of the run only
+    };
+
+    FrameWriter();
+    ~FrameWriter();
+
+public:
+    bool begin(QString sDir, uint64_t expectedBytes, uint32_t frameEstimate,
+               FlushPolicy policy, int flushEvery);
+    void end();
+    bool open(QString sPathName, int frameIndex=-1);
+    uint32_t write(const uint8_t *pData, uint32_t length);
+    bool close();
+    void cancel();
+    uint32_t averageFrameSize() const;
+    void setBus(FrameBus *pFrameBus);
+    void setSink(StreamSink *pStreamSink);
+    void setJournal(RunJournal *pRunJournal);
+
+protected:
+    bool writeStaged(uint32_t length);
+    void releaseReserve(uint64_t bytes);
+    void journalPending();
+
+private:
+    typedef struct {
+        int frameIndex;
+        QString sFilePath;
+        uint32_t size;
+        uint32_t crc;
+    } PENDING_T;
+
+public:
+    static const uint32_t ALIGNMENT    = 4096;    /// Writes are multiples of this (the FS block)
+    static const uint32_t STAGING_SIZE = 1 << 20; /// Bytes written at once
+
+private:
+    uint8_t *pStaging;
+    uint32_t staged;          /// Bytes waiting in the staging buffer
+    int fd;                   /// The still being written
+    QString sFilePath;
+    int frameIndex;           /// Of the current still in the run (-1 = not journaled)
+    uint64_t fileBytes;       /// Bytes of the current still
+    uint32_t fileCrc;         /// CRC-32C of the current still so far
+    bool bWriteError;
+    int dirFd;                /// Output directory, for syncfs()
+    int reserveFd;            /// File holding the space reserved for the run
+    QString sReservePath;
+    uint64_t reserved;        /// Bytes still reserved
+    uint32_t frameEstimate;   /// Space preallocated for every still
+    FlushPolicy policy;
+    int flushEvery;
+    int unsynced;             /// Stills written since the last sync
+    uint64_t totalBytes;      /// Bytes written in the run
+    uint32_t nFrames;         /// Stills written in the run
+    FrameBus *pBus;           /// Also publishes the stills (nullptr = none)
+    StreamSink *pSink;        /// Also streams the stills (nullptr = none)
+    RunJournal *pJournal;     /// Journals the stills of the run (nullptr = none)
+    std::vector<PENDING_T> pending; /// Complete stills waiting for a sync to be journaled
+    std::mutex stillMutex;    /// Held from open() to close() by the writing thread
+};
@@ -0,0 +1,261 @@
+#include "hdrfusion.h"
+#include "utility.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HDR_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HDR_USE_SSE2
+#endif
+
+
+#define SAMPLE_STEP 2           // Quality measures are sampled every SAMPLE_STEP pixels
+#define WELL_EXPOSED_SIGMA 0.2f // Width of the well-exposedness gaussian (normalized intensity)
+
+
+/**
+ * Weighted sum of one line of bytes coming from nFrames images.
+ * For every byte the weights must add up to HdrFusion::WEIGHT_ONE (256)
+ * so that the accumulator never exceeds 16 bits.
+ *
+ * @param pSrc    Source lines, one per frame
+ * @param pWeight Fixed point weights, one line per frame, one weight per byte
+ * @param nFrames Number of frames
+ * @param pDst    Destination line
+ * @param n       Number of bytes in the line
+ */
+static void
+blendLine(const uint8_t * const *pSrc, const uint16_t * const *pWeight,
+          int nFrames, uint8_t *pDst, int n)
+{
+    int i = 0;
+#if defined(HDR_USE_NEON)
+    for(; i+16<=n; i+=16) {
+        uint16x8_t accLo = vdupq_n_u16(0);
+        uint16x8_t accHi = vdupq_n_u16(0);
+        for(int k=0; k<nFrames; k++) {
+            uint8x16_t v = vld1q_u8(pSrc[k]+i);
+            accLo = vmlaq_u16(accLo, vmovl_u8(vget_low_u8(v)),  vld1q_u16(pWeight[k]+i));
+            accHi = vmlaq_u16(accHi, vmovl_u8(vget_high_u8(v)), vld1q_u16(pWeight[k]+i+8));
+        }
+        vst1q_u8(pDst+i, vcombine_u8(vrshrn_n_u16(accLo, 8), vrshrn_n_u16(accHi, 8)));
+    }
+#elif defined(HDR_USE_SSE2)
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    for(; i+16<=n; i+=16) {
+        __m128i accLo = round;
+        __m128i accHi = round;
+        for(int k=0; k<nFrames; k++) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc[k]+i));
+            __m128i wLo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pWeight[k]+i));
+            __m128i wHi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pWeight[k]+i+8));
+            accLo = _mm_add_epi16(accLo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), wLo));
+            accHi = _mm_add_epi16(accHi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), wHi));
+        }
+        accLo = _mm_srli_epi16(accLo, 8);
+        accHi = _mm_srli_epi16(accHi, 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst+i), _mm_packus_epi16(accLo, accHi));
+    }
+#endif
+    for(; i<n; i++) {
+        uint32_t acc = 128;
+        for(int k=0; k<nFrames; k++)
+            acc += uint32_t(pSrc[k][i]) * pWeight[k][i];
+        pDst[i] = uint8_t(acc >> 8);
+    }
+}
+
+
+HdrFusion::HdrFusion(int width, int height, uint32_t stride)
+    : width(width)
+    , height(height)
+    , stride(stride)
+{
+    blocksX = (width  + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    blocksY = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for(int i=0; i<256; i++) {
+        float d = i/255.0f - 0.5f;
+        exposednessLut[i] = expf(-d*d / (2.0f*WELL_EXPOSED_SIGMA*WELL_EXPOSED_SIGMA));
+    }
+}
+
+
+/**
+ * Fuse a bracket of RGB24 (or BGR24) frames into a single frame
+ * @param frames The bracket: all the frames share width, height and stride
+ * @param pOut   Destination buffer (same geometry of the source frames)
+ */
+void
+HdrFusion::fuse(const std::vector<const uint8_t*>& frames, uint8_t *pOut) {
+    const int nFrames = int(frames.size());
+    if(nFrames == 0)
+        return;
+    if(nFrames == 1) {
+        memcpy(pOut, frames[0], size_t(stride)*size_t(height));
+        return;
+    }
+    const int nBlocks = blocksX*blocksY;
+    weights.resize(size_t(nFrames)*size_t(nBlocks));
+    normWeights.resize(weights.size());
+    // Quality measures: every band of block rows is an independent job
+    for(int k=0; k<nFrames; k++) {
+        float *pWeights = weights.data() + size_t(k)*size_t(nBlocks);
+        runParallel(blocksY, [this, &frames, k, pWeights](int first, int last) {
+            computeWeights(frames[size_t(k)], pWeights, first, last);
+        });
+    }
+    runParallel(nBlocks, [this, nFrames](int first, int last) {
+        normalizeWeights(nFrames, first, last);
+    });
+    runParallel(height, [this, &frames, pOut](int first, int last) {
+        blendRows(frames, pOut, first, last);
+    });
+}
+
+
+/**
+ * Evaluate the Mertens quality measures on the blocks of a single frame
+ * @param pFrame        Source frame
+ * @param pWeights      Destination block weights of this frame
+ * @param firstBlockRow First block row to process
+ * @param lastBlockRow  One past the last block row to process
+ */
+void
+HdrFusion::computeWeights(const uint8_t *pFrame, float *pWeights, int firstBlockRow, int lastBlockRow) {
+    const float eps = 1.0f/255.0f;
+    for(int by=firstBlockRow; by<lastBlockRow; by++) {
+        const int y0 = by*BLOCK_SIZE;
+        const int y1 = std::min(y0+BLOCK_SIZE, height);
+        for(int bx=0; bx<blocksX; bx++) {
+            const int x0 = bx*BLOCK_SIZE;
+            const int x1 = std::min(x0+BLOCK_SIZE, width);
+            float sum = 0.0f;
+            int   nSamples = 0;
+            for(int y=y0; y<y1; y+=SAMPLE_STEP) {
+                const uint8_t *pRow  = pFrame + size_t(y)*stride;
+                const uint8_t *pUp   = pFrame + size_t(y > 0 ? y-1 : y)*stride;
+                const uint8_t *pDown = pFrame + size_t(y < height-1 ? y+1 : y)*stride;
+                for(int x=x0; x<x1; x+=SAMPLE_STEP) {
+                    const uint8_t *p = pRow + 3*x;
+                    const int xl = 3*(x > 0 ? x-1 : x);
+                    const int xr = 3*(x < width-1 ? x+1 : x);
+                    // Contrast: absolute value of the Laplacian of the luma
+                    int g  = p[0] + 2*p[1] + p[2];
+                    int gl = pRow[xl] + 2*pRow[xl+1] + pRow[xl+2];
+                    int gr = pRow[xr] + 2*pRow[xr+1] + pRow[xr+2];
+                    int gu = pUp[3*x] + 2*pUp[3*x+1] + pUp[3*x+2];
+                    int gd = pDown[3*x] + 2*pDown[3*x+1] + pDown[3*x+2];
+                    float contrast = abs(4*g - gl - gr - gu - gd) / (4.0f*4.0f*255.0f);
+                    // Saturation: standard deviation of the color channels
+                    float mu = (p[0] + p[1] + p[2]) / 3.0f;
+                    float dr = p[0]-mu, dg = p[1]-mu, db = p[2]-mu;
+                    float saturation = sqrtf((dr*dr + dg*dg + db*db) / 3.0f) / 255.0f;
+                    // Well-exposedness: gaussian around mid-gray of every channel
+                    float exposedness = exposednessLut[p[0]] *
+                                        exposednessLut[p[1]] *
+                                        exposednessLut[p[2]];
+                    sum += (contrast + eps) * (saturation + eps) * exposedness;
+                    nSamples++;
+                }
+            }
+            pWeights[by*blocksX+bx] = nSamples ? sum/nSamples : 0.0f;
+        }
+    }
+}
+
+
+/**
+ * Normalize the block weights so that, for each block, they sum to WEIGHT_ONE
+ * @param nFrames    Number of frames in the bracket
+ * @param firstBlock First block to process
+ * @param lastBlock  One past the last block to process
+ */
+void
+HdrFusion::normalizeWeights(int nFrames, int firstBlock, int lastBlock) {
+    const size_t nBlocks = size_t(blocksX)*size_t(blocksY);
+    for(int b=firstBlock; b<lastBlock; b++) {
+        float sum = 0.0f;
+        for(int k=0; k<nFrames; k++)
+            sum += weights[k*nBlocks+size_t(b)];
+        for(int k=0; k<nFrames; k++) {
+            // Completely flat blocks (e.g. saturated in every frame) are simply averaged
+            if(sum > 1.0e-12f)
+                normWeights[k*nBlocks+size_t(b)] = WEIGHT_ONE * weights[k*nBlocks+size_t(b)] / sum;
+            else
+                normWeights[k*nBlocks+size_t(b)] = float(WEIGHT_ONE) / nFrames;
+        }
+    }
+}
+
+
+/**
+ * Blend a band of rows using the bilinearly interpolated block weights
+ * @param frames   The bracket
+ * @param pOut     Destination frame
+ * @param firstRow First row to blend
+ * @param lastRow  One past the last row to blend
+ */
+void
+HdrFusion::blendRows(const std::vector<const uint8_t*>& frames, uint8_t *pOut, int firstRow, int lastRow) {
+    const int nFrames = int(frames.size());
+    const size_t nBlocks = size_t(blocksX)*size_t(blocksY);
+    const int lineBytes = 3*width;
+    // Horizontal interpolation coordinates do not change from row to row
+    std::vector<int>   xBlock(static_cast<size_t>(width));
+    std::vector<float> xFrac(static_cast<size_t>(width));
+    for(int x=0; x<width; x++) {
+        float fx = std::max((x + 0.5f)/BLOCK_SIZE - 0.5f, 0.0f);
+        xBlock[size_t(x)] = std::min(int(fx), blocksX-1);
+        xFrac[size_t(x)]  = xBlock[size_t(x)] < blocksX-1 ? fx - xBlock[size_t(x)] : 0.0f;
+    }
+    std::vector<float>    rowWeights(size_t(nFrames)*size_t(blocksX));
+    std::vector<uint16_t> lineWeights(size_t(nFrames)*size_t(lineBytes));
+    std::vector<const uint8_t*>  pSrc(static_cast<size_t>(nFrames));
+    std::vector<const uint16_t*> pWeight(static_cast<size_t>(nFrames));
+    for(int k=0; k<nFrames; k++)
+        pWeight[size_t(k)] = lineWeights.data() + size_t(k)*size_t(lineBytes);
+
+    for(int y=firstRow; y<lastRow; y++) {
+        float fy = std::max((y + 0.5f)/BLOCK_SIZE - 0.5f, 0.0f);
+        int by0 = std::min(int(fy), blocksY-1);
+        int by1 = std::min(by0+1, blocksY-1);
+        float ty = by0 < blocksY-1 ? fy - by0 : 0.0f;
+        for(int k=0; k<nFrames; k++) {
+            const float *pW0 = normWeights.data() + k*nBlocks + size_t(by0*blocksX);
+            const float *pW1 = normWeights.data() + k*nBlocks + size_t(by1*blocksX);
+            float *pRowW = rowWeights.data() + size_t(k*blocksX);
+            for(int bx=0; bx<blocksX; bx++)
+                pRowW[bx] = pW0[bx] + ty*(pW1[bx]-pW0[bx]);
+        }
+        for(int x=0; x<width; x++) {
+            const int bx0 = xBlock[size_t(x)];
+            const int bx1 = std::min(bx0+1, blocksX-1);
+            const float tx = xFrac[size_t(x)];
+            int remaining = WEIGHT_ONE;
+            for(int k=0; k<nFrames; k++) {
+                uint16_t w;
+                if(k < nFrames-1) {
+                    const float *pRowW = rowWeights.data() + size_t(k*blocksX);
+                    w = uint16_t(std::min(float(remaining), pRowW[bx0] + tx*(pRowW[bx1]-pRowW[bx0])));
+                    remaining -= w;
+                }
+                else {
+                    // The last frame takes what is left so that the weights sum exactly to WEIGHT_ONE
+                    w = uint16_t(remaining);
+                }
+                uint16_t *pLine = lineWeights.data() + size_t(k)*size_t(lineBytes) + 3*x;
+                pLine[0] = pLine[1] = pLine[2] = w;
+            }
+        }
+        for(int k=0; k<nFrames; k++)
+            pSrc[size_t(k)] = frames[size_t(k)] + size_t(y)*stride;
+        blendLine(pSrc.data(), pWeight.data(), nFrames, pOut + size_t(y)*stride, lineBytes);
+    }
+}
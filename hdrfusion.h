@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+
+// Mertens-style exposure fusion of an RGB24 bracket.
+// Quality measures (contrast, saturation, well-exposedness) are evaluated
+// on BLOCK_SIZE x BLOCK_SIZE tiles and bilinearly interpolated while blending.
+// The interpolation takes the place of the Laplacian pyramid of the original
+// algorithm: it avoids the seams of per-pixel weights at a fraction of the cost.
+class HdrFusion
+{
+public:
+    HdrFusion(int width, int height, uint32_t stride);
+
+public:
+    void fuse(const std::vector<const uint8_t*>& frames, uint8_t *pOut);
+
+protected:
+    void computeWeights(const uint8_t *pFrame, float *pWeights, int firstBlockRow, int lastBlockRow);
+    void normalizeWeights(int nFrames, int firstBlock, int lastBlock);
+    void blendRows(const std::vector<const uint8_t*>& frames, uint8_t *pOut, int firstRow, int lastRow);
+
+public:
+    static const int BLOCK_SIZE = 16;   /// Side of the tiles where the weights are evaluated
+    static const int WEIGHT_ONE = 256;  /// Fixed point weights of a pixel sum up to this value
+
+private:
+    int width;
+    int height;
+    uint32_t stride;
+    int blocksX;
+    int blocksY;
+    float exposednessLut[256];
+    std::vector<float> weights;      /// Per-frame block weights
+    std::vector<float> normWeights;  /// Block weights normalized to WEIGHT_ONE
+};
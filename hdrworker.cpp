@@ -0,0 +1,101 @@
+#include "hdrworker.h"
+#include "utility.h"
+#include <QDebug>
+
+
+HdrWorker::HdrWorker(JpegEncoder *pEncoder, FrameWriter *pWriter, int nFrames,
+                     int width, int height, uint32_t stride, uint32_t frameSize)
+    : pEncoder(pEncoder)
+    , pWriter(pWriter)
+    , fusion(width, height, stride)
+    , nFrames(nFrames)
+    , frameSize(frameSize)
+    , bStop(false)
+{
+    frames.resize(size_t(N_BRACKETS*nFrames));
+    for(auto& buffer : frames)
+        buffer.resize(frameSize);
+    fused.resize(frameSize);
+    for(int i=0; i<N_BRACKETS; i++)
+        freeBrackets.push_back(i);
+    worker = std::thread(&HdrWorker::run, this);
+}
+
+
+/// Waits for the pending brackets to be written, then stops the worker
+HdrWorker::~HdrWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    cond.notify_all();
+    worker.join();
+}
+
+
+/**
+ * Get a free bracket to capture into.
+ * Blocks if all the brackets are still waiting to be fused.
+ * @return the bracket index
+ */
+int
+HdrWorker::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !freeBrackets.empty(); });
+    int bracket = freeBrackets.back();
+    freeBrackets.pop_back();
+    return bracket;
+}
+
+
+uint8_t*
+HdrWorker::frame(int bracket, int index) {
+    return frames[size_t(bracket*nFrames+index)].data();
+}
+
+
+/// Queue a completely captured bracket for fusion (frameIndex: of the still in the run)
+void
+HdrWorker::submit(int bracket, QString sPathName, int frameIndex) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(HDR_JOB_T{bracket, sPathName, frameIndex});
+    }
+    cond.notify_all();
+}
+
+
+/// Give back a bracket without fusing it (e.g. the capture failed)
+void
+HdrWorker::release(int bracket) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeBrackets.push_back(bracket);
+    }
+    cond.notify_all();
+}
+
+
+void
+HdrWorker::run() {
+    std::vector<const uint8_t*> bracketFrames(static_cast<size_t>(nFrames));
+    for(;;) {
+        HDR_JOB_T job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return bStop || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        for(int i=0; i<nFrames; i++)
+            bracketFrames[size_t(i)] = frame(job.bracket, i);
+        fusion.fuse(bracketFrames, fused.data());
+        release(job.bracket);
+        if(pEncoder->encode(fused.data(), frameSize, pWriter, job.sPathName, nullptr, job.frameIndex) != MMAL_SUCCESS)
+            qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(job.sPathName);
+        else if(verbose)
+            qDebug() << "Written" << job.sPathName;
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "hdrfusion.h"
+#include "jpegencoder.h"
+
+#include <QString>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Fuses and encodes the exposure brackets away from the capture thread.
+// A small set of bracket buffers is preallocated: the capture side fills
+// a free one while the previous bracket is being fused and encoded.
+class HdrWorker
+{
+public:
+    HdrWorker(JpegEncoder *pEncoder, FrameWriter *pWriter, int nFrames,
+              int width, int height, uint32_t stride, uint32_t frameSize);
+    ~HdrWorker();
+
+public:
+    int acquire();
+    uint8_t *frame(int bracket, int index);
+    void submit(int bracket, QString sPathName, int frameIndex);
+    void release(int bracket);
+
+protected:
+    void run();
+
+public:
+    static const int N_BRACKETS = 2; /// Brackets in flight (capturing + fusing)
+
+private:
+    typedef struct {
+        int bracket;
+        QString sPathName;
+        int frameIndex;
+    } HDR_JOB_T;
+
+    JpegEncoder *pEncoder;
+    FrameWriter *pWriter;   /// Output layer of the run
+    HdrFusion fusion;
+    int nFrames;
+    uint32_t frameSize;
+    std::vector<std::vector<uint8_t>> frames; /// N_BRACKETS * nFrames frame buffers
+    std::vector<uint8_t> fused;               /// Fusion result
+    std::vector<int> freeBrackets;
+    std::deque<HDR_JOB_T> jobs;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool bStop;
+    std::thread worker;
+};
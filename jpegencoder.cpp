@@ -6,25 +6,134 @@
 #include "interface/mmal/mmal_buffer.h"
 #include "interface/mmal/util/mmal_util.h"
 #include "interface/mmal/util/mmal_util_params.h"
+#include "interface/vcos/vcos.h"
+
+#include <algorithm>
+
+
+// Encodings supported by the image encoder and their file extensions
+static const struct {
+    const char *format;
+    MMAL_FOURCC_T encoding;
+} encoding_xref[] = {
+    {"jpg", MMAL_ENCODING_JPEG},
+    {"bmp", MMAL_ENCODING_BMP},
+    {"gif", MMAL_ENCODING_GIF},
+    {"png", MMAL_ENCODING_PNG},
+    {"ppm", MMAL_ENCODING_PPM},
+    {"tga", MMAL_ENCODING_TGA}
+};
+
+
+/**
+ *  buffer header callback function for the encoder input port
+ *
+ *  The frame has been consumed: just give the buffer back to its pool
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void
+encoderInputCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    Q_UNUSED(port)
+    mmal_buffer_header_release(buffer);
+}
+
+
+/**
+ *  buffer header callback function for the encoder output port
+ *  when frames are sent from the ARM side
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void
+encoderOutputCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    int complete = 0;
+    JpegEncoder::DIRECT_USERDATA *pData = reinterpret_cast<JpegEncoder::DIRECT_USERDATA *>(port->userdata);
+    if(buffer->length && pData->pWriter) {
+        mmal_buffer_header_mem_lock(buffer);
+        const uint8_t *pChunk = buffer->data;
+        uint32_t length = buffer->length;
+        bool bOk = true;
+        if(pData->pExif && pData->bFrameStart && length >= 2 &&
+           pChunk[0] == 0xFF && pChunk[1] == 0xD8) {
+            // Splice the EXIF segment right after the SOI marker
+            uint32_t exifLength = uint32_t(pData->pExif->size());
+            bOk = pData->pWriter->write(pChunk, 2) == 2 &&
+                  pData->pWriter->write(pData->pExif->data(), exifLength) == exifLength;
+            pChunk += 2;
+            length -= 2;
+        }
+        // On error the writer fails the still at close(): wait for the frame end anyway
+        if(!bOk || pData->pWriter->write(pChunk, length) != length)
+            qDebug() << QString("Unable to write buffer to file");
+        mmal_buffer_header_mem_unlock(buffer);
+    }
+    pData->encodedBytes += buffer->length;
+    if(buffer->length)
+        pData->bFrameStart = false;
+    if(buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END |
+                        MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
+        complete = 1;
+    mmal_buffer_header_release(buffer);
+    if(port->is_enabled) {
+        MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pData->pEncoder->pool->queue);
+        if(!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            qDebug() << QString("Unable to return a buffer to the encoder port");
+    }
+    if(complete)
+        vcos_semaphore_post(&(pData->complete_semaphore));
+}
 
 
 JpegEncoder::JpegEncoder()
     : pComponent(nullptr)
     , pool(nullptr)
+    , inputPool(nullptr)
+    , outputBufferNum(0)
+    , outputBufferSize(0)
+    , encodeTimeoutMs(0)
+    , outputCallback(nullptr)
+    , bExifDisabled(false)
+    , bOutputStale(false)
+    , nRebuilds(0)
 {
     quality = 100;
     restartInterval = 0;
     encoding = MMAL_ENCODING_JPEG;
     if(createComponent() != MMAL_SUCCESS)
         exit(EXIT_FAILURE);
-    createBufferPool();
+    pool = selectPool();
+    if(!pool)
+        exit(EXIT_FAILURE);
+}
+
+
+/// Encoding of the files with the given extension (0 if not supported)
+MMAL_FOURCC_T
+JpegEncoder::encodingFromExtension(QString sExtension) {
+    for(size_t i=0; i<sizeof(encoding_xref)/sizeof(encoding_xref[0]); i++) {
+        if(sExtension.compare(encoding_xref[i].format, Qt::CaseInsensitive) == 0)
+            return encoding_xref[i].encoding;
+    }
+    return 0;
+}
+
+
+/// File extension of the given encoding
+QString
+JpegEncoder::extension(MMAL_FOURCC_T encoding) {
+    for(size_t i=0; i<sizeof(encoding_xref)/sizeof(encoding_xref[0]); i++) {
+        if(encoding_xref[i].encoding == encoding)
+            return QString(encoding_xref[i].format);
+    }
+    return QString("jpg");
 }
 
 
 MMAL_STATUS_T
 JpegEncoder::createComponent() {
-   MMAL_PORT_T *encoder_input = nullptr;
-   MMAL_PORT_T *encoder_output = nullptr;
    MMAL_STATUS_T status;
 
    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &pComponent);
@@ -44,21 +153,52 @@ JpegEncoder::createComponent() {
       return status;
    }
 
-   encoder_input = pComponent->input[0];
-   encoder_output = pComponent->output[0];
-
    // We want same format on input and output
-   mmal_format_copy(encoder_output->format, encoder_input->format);
+   mmal_format_copy(pComponent->output[0]->format, pComponent->input[0]->format);
+
+   status = commitOutputFormat();
+   if(status != MMAL_SUCCESS) {
+      if (pComponent)
+         mmal_component_destroy(pComponent);
+      return status;
+   }
+//  Enable component
+   status = mmal_component_enable(pComponent);
+   if(status  != MMAL_SUCCESS) {
+      qDebug() << QString("Unable to enable video encoder component");
+      if (pComponent)
+         mmal_component_destroy(pComponent);
+      return status;
+   }
+
+   if(verbose)
+      fprintf(stderr, "Encoder component done\n");
+
+   return status;
+}
+
+
+/**
+ * Commit the current encoding on the (disabled) output port
+ * and set the JPEG parameters again (a commit may reset them)
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+JpegEncoder::commitOutputFormat() {
+   MMAL_PORT_T *encoder_output = pComponent->output[0];
+   MMAL_STATUS_T status;
 
    // Specify out output format
    encoder_output->format->encoding = encoding;
 
-   encoder_output->buffer_size = encoder_output->buffer_size_recommended;
+   // Never below what the encoder asks for the encoding
+   encoder_output->buffer_size = std::max(outputBufferSize, encoder_output->buffer_size_recommended);
 
    if(encoder_output->buffer_size < encoder_output->buffer_size_min)
       encoder_output->buffer_size = encoder_output->buffer_size_min;
 
-   encoder_output->buffer_num = encoder_output->buffer_num_recommended;
+   encoder_output->buffer_num = outputBufferNum ? outputBufferNum
+                                                : encoder_output->buffer_num_recommended;
 
    if(encoder_output->buffer_num < encoder_output->buffer_num_min)
       encoder_output->buffer_num = encoder_output->buffer_num_min;
@@ -67,11 +207,13 @@ JpegEncoder::createComponent() {
    status = mmal_port_format_commit(encoder_output);
 
    if(status != MMAL_SUCCESS) {
-      qDebug() << QString("Unable to set format on video encoder output port");
-      if (pComponent)
-         mmal_component_destroy(pComponent);
+      qDebug() << QString("Unable to set format %1 on encoder output port")
+                  .arg(extension(encoding));
       return status;
    }
+   bOutputStale = false;
+   if(encoding != MMAL_ENCODING_JPEG)
+      return status;
 
 // Set the JPEG quality level
    status = mmal_port_parameter_set_uint32(encoder_output, MMAL_PARAMETER_JPEG_Q_FACTOR, quality);
@@ -80,64 +222,414 @@ JpegEncoder::createComponent() {
       mmal_status_to_int(status);
       qDebug() << QString("Unable to set JPEG quality %1")
                   .arg(quality);
-      if (pComponent)
-         mmal_component_destroy(pComponent);
       return status;
    }
 // Set the JPEG restart interval
    status = mmal_port_parameter_set_uint32(encoder_output, MMAL_PARAMETER_JPEG_RESTART_INTERVAL, restartInterval);
    if(restartInterval && status != MMAL_SUCCESS) {
       qDebug() << QString("Unable to set JPEG restart interval");
-      if (pComponent)
-         mmal_component_destroy(pComponent);
-      return status;
-   }
-//  Enable component
-   status = mmal_component_enable(pComponent);
-   if(status  != MMAL_SUCCESS) {
-      qDebug() << QString("Unable to enable video encoder component");
-      if (pComponent)
-         mmal_component_destroy(pComponent);
       return status;
    }
-// Create pool of buffer headers for the output port to consume
-   pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
-   if(!pool) {
-      qDebug() << QString("Failed to create buffer header pool for encoder output port %1")
-                  .arg(encoder_output->name);
-   }
-
-   if(verbose)
-      fprintf(stderr, "Encoder component done\n");
-
-   return status;
+   return MMAL_SUCCESS;
 }
 
 
-void
-JpegEncoder::createBufferPool() {
-    // Create pool of buffer headers for the output port to consume
+/**
+ * Pool of output buffers of the current encoding.
+ * Every encoding keeps its own pool, created the first time it is used
+ * and reused afterwards: it is replaced only when the committed format
+ * needs more or bigger buffers. The output port must be disabled.
+ * @return the pool (nullptr on failure)
+ */
+MMAL_POOL_T*
+JpegEncoder::selectPool() {
     MMAL_PORT_T *outputPort = pComponent->output[0];
+    for(auto& entry : pools) {
+        if(entry.encoding != encoding)
+            continue;
+        if(entry.bufferSize >= outputPort->buffer_size &&
+           entry.bufferNum  >= outputPort->buffer_num)
+            return entry.pool;
+        mmal_port_pool_destroy(outputPort, entry.pool);
+        entry.pool = mmal_port_pool_create(outputPort, outputPort->buffer_num, outputPort->buffer_size);
+        entry.bufferSize = outputPort->buffer_size;
+        entry.bufferNum  = outputPort->buffer_num;
+        if(!entry.pool)
+            qDebug() << QString("Failed to create buffer header pool for encoder output port %1")
+                        .arg(outputPort->name);
+        return entry.pool;
+    }
     if(verbose) {
         qDebug() << "Encoder out Port buffer size  :" << outputPort->buffer_size;
         qDebug() << "Encoder out Port buffer number:" << outputPort->buffer_num;
     }
     // Create pool of buffer headers for the output port to consume
-    pool = mmal_port_pool_create(outputPort, outputPort->buffer_num, outputPort->buffer_size);
-    if(!pool) {
+    ENCODER_POOL_T entry;
+    entry.encoding   = encoding;
+    entry.bufferSize = outputPort->buffer_size;
+    entry.bufferNum  = outputPort->buffer_num;
+    entry.pool = mmal_port_pool_create(outputPort, outputPort->buffer_num, outputPort->buffer_size);
+    if(!entry.pool) {
         qDebug() << QString("Failed to create buffer header pool for encoder output port %1")
                     .arg(outputPort->name);
-        exit(EXIT_FAILURE);
+        return nullptr;
+    }
+    pools.push_back(entry);
+    return entry.pool;
+}
+
+
+/**
+ * Enable the output port and send it all the buffers of the current pool
+ * @param callback Receives the encoded data (kept for setEncoding())
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+JpegEncoder::enableOutput(MMAL_PORT_BH_CB_T callback) {
+    MMAL_PORT_T *outputPort = pComponent->output[0];
+    outputCallback = callback;
+    MMAL_STATUS_T status = mmal_port_enable(outputPort, callback);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to enable encoder output port");
+        return status;
+    }
+    // Send all the buffers to the encoder output port
+    uint32_t num = mmal_queue_length(pool->queue);
+    for(uint32_t q=0; q<num; q++) {
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(pool->queue);
+        if(!buffer)
+            qDebug() << QString("Unable to get a required buffer %1 from pool queue")
+                        .arg(q);
+        status = mmal_port_send_buffer(outputPort, buffer);
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("%1: Unable to send a buffer to encoder output port (%2)")
+                        .arg(__func__)
+                        .arg(q);
+            return status;
+        }
+    }
+    return status;
+}
+
+
+/**
+ * Prepare the encoder to receive frames from the ARM side
+ * (i.e. not tunnelled from the camera still port)
+ * @param pInputFormat Format of the frames that will be sent
+ * @param frameSize    Size in bytes of a single frame
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+JpegEncoder::startDirect(MMAL_ES_FORMAT_T *pInputFormat, uint32_t frameSize) {
+    MMAL_STATUS_T status;
+    MMAL_PORT_T *inputPort  = pComponent->input[0];
+    MMAL_PORT_T *outputPort = pComponent->output[0];
+
+    if(vcos_semaphore_create(&directData.complete_semaphore, "Encoder-sem", 0) != VCOS_SUCCESS)
+        return MMAL_ENOSPC;
+    // The whole frame fits in a single input buffer
+    mmal_format_copy(inputPort->format, pInputFormat);
+    inputPort->buffer_num = inputPort->buffer_num_min;
+    inputPort->buffer_size = frameSize;
+    if(inputPort->buffer_size < inputPort->buffer_size_min)
+        inputPort->buffer_size = inputPort->buffer_size_min;
+    status = mmal_port_format_commit(inputPort);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to set format on encoder input port");
+        return status;
+    }
+    // The output follows the new input geometry
+    mmal_format_copy(outputPort->format, inputPort->format);
+    status = commitOutputFormat();
+    if(status != MMAL_SUCCESS)
+        return status;
+    pool = selectPool();
+    if(!pool)
+        return MMAL_ENOMEM;
+    inputPool = mmal_port_pool_create(inputPort, inputPort->buffer_num, inputPort->buffer_size);
+    if(!inputPool) {
+        qDebug() << QString("Failed to create buffer header pool for encoder input port %1")
+                    .arg(inputPort->name);
+        return MMAL_ENOMEM;
+    }
+    directData.pWriter      = nullptr;
+    directData.pExif        = nullptr;
+    directData.bFrameStart  = true;
+    directData.encodedBytes = 0;
+    directData.pEncoder     = this;
+    inputPort->userdata  = reinterpret_cast<struct MMAL_PORT_USERDATA_T *>(&directData);
+    outputPort->userdata = reinterpret_cast<struct MMAL_PORT_USERDATA_T *>(&directData);
+    status = mmal_port_enable(inputPort, encoderInputCallback);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to enable encoder input port");
+        return status;
+    }
+    return enableOutput(encoderOutputCallback);
+}
+
+
+void
+JpegEncoder::stopDirect() {
+    MMAL_PORT_T *inputPort  = pComponent->input[0];
+    MMAL_PORT_T *outputPort = pComponent->output[0];
+    if(inputPort->is_enabled)
+        mmal_port_disable(inputPort);
+    if(outputPort->is_enabled)
+        mmal_port_disable(outputPort);
+    if(inputPool) {
+        mmal_port_pool_destroy(inputPort, inputPool);
+        inputPool = nullptr;
+    }
+    vcos_semaphore_delete(&directData.complete_semaphore);
+}
+
+
+/**
+ * Change the JPEG quality between two frames.
+ * The output port stays enabled: the encoder picks up the new
+ * quantization tables with the next frame it receives.
+ * With other encodings the value is kept for the next switch to JPEG.
+ * @param newQuality  Quality factor (1-100)
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+JpegEncoder::setQuality(uint32_t newQuality) {
+    if(newQuality == quality)
+        return MMAL_SUCCESS;
+    if(pComponent && encoding == MMAL_ENCODING_JPEG) {
+        MMAL_STATUS_T status;
+        status = mmal_port_parameter_set_uint32(pComponent->output[0],
+                                                MMAL_PARAMETER_JPEG_Q_FACTOR,
+                                                newQuality);
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("Unable to set JPEG quality %1")
+                        .arg(newQuality);
+            return status;
+        }
+    }
+    quality = newQuality;
+    return MMAL_SUCCESS;
+}
+
+
+/**
+ * Change the JPEG restart interval between two frames (as setQuality())
+ * @param newInterval MCUs between restart markers (0 = none)
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+JpegEncoder::setRestartInterval(uint32_t newInterval) {
+    if(newInterval == restartInterval)
+        return MMAL_SUCCESS;
+    if(pComponent && encoding == MMAL_ENCODING_JPEG) {
+        MMAL_STATUS_T status;
+        status = mmal_port_parameter_set_uint32(pComponent->output[0],
+                                                MMAL_PARAMETER_JPEG_RESTART_INTERVAL,
+                                                newInterval);
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("Unable to set JPEG restart interval %1")
+                        .arg(newInterval);
+            return status;
+        }
     }
+    restartInterval = newInterval;
+    return MMAL_SUCCESS;
+}
+
+
+/**
+ * Change the output encoding between two frames.
+ * Only the output port is involved: it is disabled, committed with the
+ * new format and enabled again with the pool of that format. The
+ * component, its input and the tunnel from the camera are untouched.
+ * No frame may be in flight.
+ * @param newEncoding One of the encodings of encoding_xref
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+JpegEncoder::setEncoding(MMAL_FOURCC_T newEncoding) {
+    if(newEncoding == encoding && !bOutputStale)
+        return MMAL_SUCCESS;
+    MMAL_PORT_T *outputPort = pComponent->output[0];
+    MMAL_STATUS_T status;
+    bool bEnabled = outputPort->is_enabled;
+    if(bEnabled) {
+        status = mmal_port_disable(outputPort);
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("Unable to disable encoder output port");
+            return status;
+        }
+    }
+    MMAL_FOURCC_T oldEncoding = encoding;
+    encoding = newEncoding;
+    status = commitOutputFormat();
+    if(status != MMAL_SUCCESS) {
+        // Go back to the previous (working) format
+        encoding = oldEncoding;
+        commitOutputFormat();
+    }
+    MMAL_POOL_T *newPool = selectPool();
+    if(!newPool) {
+        encoding = oldEncoding;
+        commitOutputFormat();
+        status = MMAL_ENOMEM;
+    }
+    else
+        pool = newPool;
+    if(bEnabled) {
+        MMAL_STATUS_T enableStatus = enableOutput(outputCallback);
+        if(status == MMAL_SUCCESS)
+            status = enableStatus;
+    }
+    return status;
+}
+
+
+/**
+ * Size the output buffers of the next encodings: they are committed
+ * by the next setEncoding(), even if the encoding does not change
+ * @param num   Output buffers (0 = as recommended by the encoder)
+ * @param bytes Least size of an output buffer (0 = as recommended)
+ */
+void
+JpegEncoder::setOutputBuffers(uint32_t num, uint32_t bytes) {
+    if(num == outputBufferNum && bytes == outputBufferSize)
+        return;
+    outputBufferNum  = num;
+    outputBufferSize = bytes;
+    bOutputStale     = true;
+}
+
+
+/**
+ * Encode a frame produced on the ARM side and write it to a file.
+ * Blocks until the whole encoded frame has been written, or up to
+ * encodeTimeoutMs: then the frame is lost and the ports are rebuilt.
+ * @param pFrame     Frame data (in the format given to startDirect())
+ * @param frameSize  Size in bytes of the frame
+ * @param pWriter    Output layer of the run (see FrameWriter)
+ * @param sPathName  Output file
+ * @param pExif      Our own EXIF segment, replacing the encoder one (JPEG only, nullptr = none)
+ * @param frameIndex Index of the still in the run (-1 = not journaled, see FrameWriter::open())
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+JpegEncoder::encode(const uint8_t *pFrame, uint32_t frameSize, FrameWriter *pWriter, QString sPathName,
+                    const std::vector<uint8_t> *pExif, int frameIndex) {
+    MMAL_PORT_T *inputPort = pComponent->input[0];
+    if(encoding != MMAL_ENCODING_JPEG)
+        pExif = nullptr;
+    if(bool(pExif) != bExifDisabled &&
+       mmal_port_parameter_set_boolean(pComponent->output[0], MMAL_PARAMETER_EXIF_DISABLE,
+                                       pExif ? MMAL_TRUE : MMAL_FALSE) == MMAL_SUCCESS)
+        bExifDisabled = bool(pExif);
+    if(!pWriter->open(sPathName, frameIndex)) {
+        qDebug() << QString("%1: Error opening output file: %2")
+                    .arg(__func__)
+                    .arg(sPathName);
+        return MMAL_ENOENT;
+    }
+    directData.pWriter      = pWriter;
+    directData.pExif        = bExifDisabled ? pExif : nullptr;
+    directData.bFrameStart  = true;
+    directData.encodedBytes = 0;
+    MMAL_BUFFER_HEADER_T *buffer = encodeTimeoutMs ? mmal_queue_timedwait(inputPool->queue, encodeTimeoutMs)
+                                                   : mmal_queue_wait(inputPool->queue);
+    if(!buffer) { // The previous frame still holds the input buffer
+        directData.pWriter = nullptr;
+        directData.pExif   = nullptr;
+        pWriter->cancel();
+        pWriter->close();
+        rebuildDirect();
+        return MMAL_EAGAIN;
+    }
+    if(frameSize > buffer->alloc_size)
+        frameSize = buffer->alloc_size;
+    mmal_buffer_header_mem_lock(buffer);
+    memcpy(buffer->data, pFrame, frameSize);
+    mmal_buffer_header_mem_unlock(buffer);
+    buffer->offset = 0;
+    buffer->length = frameSize;
+    buffer->flags  = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+    MMAL_STATUS_T status = mmal_port_send_buffer(inputPort, buffer);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Unable to send a frame to the encoder").arg(__func__);
+        mmal_buffer_header_release(buffer);
+        pWriter->cancel();
+    }
+    else if(encodeTimeoutMs == 0) {
+        vcos_semaphore_wait(&directData.complete_semaphore);
+    }
+    else if(vcos_semaphore_wait_timeout(&directData.complete_semaphore, encodeTimeoutMs) != VCOS_SUCCESS) {
+        // No callback may write the dropped frame once the ports are disabled
+        rebuildDirect();
+        pWriter->cancel();
+        status = MMAL_EAGAIN;
+    }
+    directData.pWriter = nullptr;
+    directData.pExif   = nullptr;
+    if(!pWriter->close() && status == MMAL_SUCCESS)
+        status = MMAL_EIO;
+    return status;
+}
+
+
+/// Size of the encoder output of the last encode() (the EXIF segment we splice is not counted)
+uint32_t
+JpegEncoder::lastEncodedBytes() const {
+    return directData.encodedBytes;
+}
+
+
+/**
+ * As PiCamera::rebuildDirect() for the encoder: drop the half encoded
+ * frame and give both ports their buffers back after an encode() that
+ * never completed. Called by the encoding thread.
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+JpegEncoder::rebuildDirect() {
+    uint32_t startUs = vcos_getmicrosecs();
+    MMAL_PORT_T *inputPort  = pComponent->input[0];
+    MMAL_PORT_T *outputPort = pComponent->output[0];
+    if(inputPort->is_enabled)
+        mmal_port_disable(inputPort);
+    if(outputPort->is_enabled)
+        mmal_port_disable(outputPort);
+    mmal_component_disable(pComponent);
+    mmal_component_enable(pComponent);
+    // A completion arriving late must not end the next frame
+    while(vcos_semaphore_trywait(&directData.complete_semaphore) == VCOS_SUCCESS) {}
+    MMAL_STATUS_T status = mmal_port_enable(inputPort, encoderInputCallback);
+    if(status == MMAL_SUCCESS)
+        status = enableOutput(encoderOutputCallback);
+    nRebuilds++;
+    qDebug() << QString("%1: Encode timed out after %2 ms, encoder rebuilt in %3 ms (%4 so far)%5")
+                .arg(__func__)
+                .arg(encodeTimeoutMs)
+                .arg((vcos_getmicrosecs() - startUs)/1000.0, 0, 'f', 1)
+                .arg(nRebuilds)
+                .arg(status == MMAL_SUCCESS ? QString() : QString(": FAILED"));
+    return status;
+}
+
+
+/// Encoder rebuilds after lost frames since the encoder was created
+int
+JpegEncoder::rebuildCount() const {
+    return nRebuilds;
 }
 
 
 void
 JpegEncoder::destroy() {
    // Get rid of any port buffers first
-   if(pool) {
-      mmal_port_pool_destroy(pComponent->output[0], pool);
+   for(auto& entry : pools) {
+      if(entry.pool)
+         mmal_port_pool_destroy(pComponent->output[0], entry.pool);
    }
+   pools.clear();
+   pool = nullptr;
    if(pComponent) {
       mmal_component_destroy(pComponent);
       pComponent = nullptr;
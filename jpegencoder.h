@@ -2,6 +2,12 @@
 
 #include "interface/mmal/mmal.h"
 #include "interface/mmal/util/mmal_default_components.h"
+#include "interface/vcos/vcos.h"
+#include "framewriter.h"
+
+#include <QString>
+#include <vector>
+#include <atomic>
 
 
 class JpegEncoder
@@ -11,15 +17,60 @@ public:
 
 public:
     void destroy();
+    MMAL_STATUS_T startDirect(MMAL_ES_FORMAT_T *pInputFormat, uint32_t frameSize);
+    void stopDirect();
+    MMAL_STATUS_T encode(const uint8_t *pFrame, uint32_t frameSize, FrameWriter *pWriter, QString sPathName,
+                         const std::vector<uint8_t> *pExif=nullptr, int frameIndex=-1);
+    uint32_t lastEncodedBytes() const;
+    int rebuildCount() const;
+    MMAL_STATUS_T setQuality(uint32_t newQuality);
+    MMAL_STATUS_T setRestartInterval(uint32_t newInterval);
+    MMAL_STATUS_T setEncoding(MMAL_FOURCC_T newEncoding);
+    void setOutputBuffers(uint32_t num, uint32_t bytes);
+    MMAL_STATUS_T enableOutput(MMAL_PORT_BH_CB_T callback);
+    static MMAL_FOURCC_T encodingFromExtension(QString sExtension);
+    static QString extension(MMAL_FOURCC_T encoding);
 
 protected:
     MMAL_STATUS_T createComponent();
-    void createBufferPool();
+    MMAL_STATUS_T commitOutputFormat();
+    MMAL_POOL_T *selectPool();
+    MMAL_STATUS_T rebuildDirect();
 
 public:
     MMAL_COMPONENT_T *pComponent;
-    MMAL_POOL_T *pool;
+    MMAL_POOL_T *pool;      // Output pool of the current encoding
+    MMAL_POOL_T *inputPool; // Only used when frames are sent from the ARM side
     uint32_t quality;
     uint32_t restartInterval;
     MMAL_FOURCC_T encoding;
+    uint32_t outputBufferNum;  /// Output buffers (0 = as recommended by the encoder)
+    uint32_t outputBufferSize; /// Least bytes per output buffer (0 = as recommended)
+    uint32_t encodeTimeoutMs;  /// Deadline of a direct encode before the ports are rebuilt (0 = none)
+
+    // Passed to the callbacks when frames are sent to the encoder
+    // from the ARM side instead of through a tunnel
+    typedef struct {
+        FrameWriter *pWriter;                /// Output of the frame being encoded (nullptr = none)
+        const std::vector<uint8_t> *pExif;   /// APP1 segment to insert after the SOI marker (or nullptr)
+        bool bFrameStart;                    /// No data of the frame received yet
+        uint32_t encodedBytes;               /// Encoder output of the frame (the EXIF segment not counted)
+        VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame
+        JpegEncoder *pEncoder;               /// pointer to our encoder
+    } DIRECT_USERDATA;
+
+private:
+    typedef struct {
+        MMAL_FOURCC_T encoding;
+        MMAL_POOL_T *pool;
+        uint32_t bufferSize;
+        uint32_t bufferNum;
+    } ENCODER_POOL_T;
+
+    std::vector<ENCODER_POOL_T> pools; // One per encoding used so far
+    MMAL_PORT_BH_CB_T outputCallback;  // Set by enableOutput()
+    DIRECT_USERDATA directData;        // One per encoder: several may run in direct mode
+    bool bExifDisabled;                // The encoder leaves the EXIF to us (see encode())
+    bool bOutputStale;                 // The output buffers changed since the last commit
+    std::atomic<int> nRebuilds;        // See rebuildDirect()
 };
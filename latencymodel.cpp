@@ -0,0 +1,98 @@
+#include "latencymodel.h"
+
+#include <math.h>
+
+
+#define SMOOTHING  0.25 // Weight of the newest capture
+#define DEVIATIONS 3.0  // Margin on every stage, in standard deviations
+#define ROUNDING   10   // The interval is a multiple of this (in ms)
+#define PRIOR_MARGIN 1.5 // For the stages the calibration does not see (file, lamp)
+
+
+LatencyModel::LatencyModel()
+    : prior(0.0)
+{
+    reset();
+}
+
+
+/// Forget the measures (the capture path has changed): the prior is kept
+void
+LatencyModel::reset() {
+    for(int i=0; i<N_STAGES; i++) {
+        mean[i]     = 0.0;
+        variance[i] = 0.0;
+        samples[i]  = 0;
+    }
+    captures = 0;
+}
+
+
+/**
+ * Add the stage durations of a capture
+ * @param stageMs Duration of every stage in ms (negative = not measured)
+ */
+void
+LatencyModel::add(const double stageMs[N_STAGES]) {
+    for(int i=0; i<N_STAGES; i++) {
+        if(stageMs[i] < 0.0)
+            continue;
+        if(samples[i] == 0) {
+            mean[i] = stageMs[i];
+        }
+        else {
+            double delta = stageMs[i] - mean[i];
+            mean[i] += SMOOTHING*delta;
+            variance[i] = (1.0-SMOOTHING)*(variance[i] + SMOOTHING*delta*delta);
+        }
+        samples[i]++;
+    }
+    captures++;
+}
+
+
+/**
+ * Latency known before any capture: the one the sensor calibration
+ * measured for the sensor mode (exposure, mode switch and encoding)
+ * @param captureMs The calibrated latency in ms (0 = none)
+ */
+void
+LatencyModel::setPrior(double captureMs) {
+    prior = captureMs > 0.0 ? captureMs : 0.0;
+}
+
+
+bool
+LatencyModel::isReady() const {
+    return captures >= WARMUP_CAPTURES;
+}
+
+
+/// Mean duration of a stage (0 if never measured)
+double
+LatencyModel::stageMs(Stage stage) const {
+    return mean[stage];
+}
+
+
+/**
+ * The shortest interval between the stills
+ * @param exposureMs Total exposure time of a still (all the frames of a bracket or stack)
+ * @return the interval in ms (until warmed up: from the prior, or DEFAULT_INTERVAL)
+ */
+int
+LatencyModel::minInterval(double exposureMs) const {
+    double total = exposureMs;
+    if(!isReady()) {
+        if(prior <= 0.0)
+            return DEFAULT_INTERVAL;
+        total += PRIOR_MARGIN*prior;
+    }
+    else {
+        for(int i=0; i<N_STAGES; i++) {
+            if(samples[i] > 0)
+                total += mean[i] + DEVIATIONS*sqrt(variance[i]);
+        }
+    }
+    return (int(ceil(total)) + ROUNDING-1)/ROUNDING*ROUNDING;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Estimates the shortest interval the capture loop can sustain with the
+// current settings. Every capture is split in stages whose durations are
+// tracked as running mean and deviation; the exposure is not measured but
+// taken from the settings, so a new shutter speed is accounted at once.
+// Until enough captures are measured, the latency found by the sensor
+// calibration (if any) stands for the whole capture.
+class LatencyModel
+{
+public:
+    enum Stage {
+        STAGE_MODE_SWITCH = 0, /// Capture request to the first data, exposure excluded
+        STAGE_ENCODE      = 1, /// GPU encoding (and streaming to the file)
+        STAGE_WRITE       = 2, /// Closing and flushing the file
+        STAGE_PROCESS     = 3, /// CPU work of the direct captures (fusion, stacking, QOI...)
+        STAGE_LAMP        = 4, /// Switching the lamp and the delays around the capture
+        N_STAGES          = 5
+    };
+
+    LatencyModel();
+
+public:
+    void reset();
+    void setPrior(double captureMs);
+    void add(const double stageMs[N_STAGES]);
+    bool isReady() const;
+    int minInterval(double exposureMs) const;
+    double stageMs(Stage stage) const;
+
+public:
+    static const int WARMUP_CAPTURES = 3;    /// Captures before the model is trusted
+    static const int DEFAULT_INTERVAL = 1500; /// in ms, until then (without prior)
+
+private:
+    double mean[N_STAGES];     /// Exponentially weighted, in ms
+    double variance[N_STAGES];
+    int samples[N_STAGES];
+    int captures;
+    double prior;              /// Calibrated capture latency in ms (0 = unknown)
+};
@@ -1,8 +1,11 @@
 #include "maindialog.h"
 #include "utility.h"
+#include "benchmark.h"
+#include "sensorcalibration.h"
 #include "bcm_host.h"
 #include <QApplication>
 #include "utility.h"
+#include <string.h>
 
 
 int
@@ -10,7 +13,17 @@ main(int argc, char *argv[]) {
     bcm_host_init();
     if(verbose)
         checkConfiguration(128);
+    if(argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+        int width  = argc > 3 ? atoi(argv[2]) : 4056;
+        int height = argc > 3 ? atoi(argv[3]) : 3040;
+        return runLosslessBenchmark(width, height, 5);
+    }
     QApplication a(argc, argv);
+    if(argc > 1 && strcmp(argv[1], "--calibrate") == 0) {
+        int width  = argc > 3 ? atoi(argv[2]) : 0;
+        int height = argc > 3 ? atoi(argv[3]) : 0;
+        return runSensorCalibration(width, height);
+    }
     MainDialog w;
     w.show();
     return a.exec();
@@ -7,13 +7,36 @@
 #include <QMessageBox>
 #include <QStandardPaths>
 #include <QSettings>
+#include <QDateTime>
 #include <QDebug>
 #include <QDir>
+#include <QFile>
+#include <math.h>
+#include <algorithm>
 #include "utility.h"
 
 
-#define MIN_INTERVAL 1500 // in ms (depends on the image format: jpeg is HW accelerated !)
 #define IMAGE_QUALITY 100 // 100 is Best quality
+#define ANALYSIS_WIDTH  320       // Size of the motion detection stream
+#define ANALYSIS_HEIGHT 240
+#define MOTION_POLL_INTERVAL 100  // in ms
+#define PRETRIGGER_WIDTH  1280    // Size of the pre-trigger video
+#define PRETRIGGER_HEIGHT 720
+#define LAMP_ON_DELAY  10         // in ms, before the capture
+#define LAMP_OFF_DELAY 300        // in ms, after the capture
+#define REARM_MARGIN   1.25       // The camera is woken up this much earlier than measured
+#define CAPTURE_DEADLINE 3000     // in ms, shortest wait for a still before rebuilding the pipeline
+#define DEADLINE_FACTOR  3        // Longest wait as a multiple of the modelled capture latency
+#define STILL_BUS_NAME   "/slowMotion.stills"  // Shared memory of the frame buses
+#define PREVIEW_BUS_NAME "/slowMotion.preview"
+#define STREAM_STILLS    0        // What goes to the stream sink
+#define STREAM_VIDEO     1
+#define STREAM_MIN_FRAME (8 << 20) // Smallest frame size limit of the stream sink
+
+
+// Load of every ThermalGovernor::Level
+static const int thermalPreviewFps[]  = {0, 15, 5, 1}; // Preview frame rate cap (0 = none)
+static const int thermalDecimation[]  = {1, 2, 4, 8};  // Motion analysis of one frame out of n
 
 
 // ================================================
@@ -26,15 +49,38 @@
 #define LED_PIN  23 // BCM23 is Pin 16 in the 40 pin GPIO connector.
 #define PAN_PIN  14 // BCM14 is Pin  8 in the 40 pin GPIO connector.
 #define TILT_PIN 26 // BCM26 IS Pin 37 in the 40 pin GPIO connector.
+#define TRIGGER_PIN 24 // BCM24 is Pin 18 in the 40 pin GPIO connector (active low).
 
 
 MainDialog::MainDialog(QWidget *parent)
     : QDialog(parent)
     , pUi(new Ui::MainDialog)
+    , pHdrWorker(nullptr)
+    , pStacker(nullptr)
+    , pRawWorker(nullptr)
+    , pMotionDetector(nullptr)
+    , pVideoEncoder(nullptr)
+    , pFrameRing(nullptr)
+    , pTriggerCapture(nullptr)
+    , pExifWriter(nullptr)
+    , pStagingMover(nullptr)
+    , pRateController(nullptr)
+    , pQoiEncoder(nullptr)
+    , pPyramidWorker(nullptr)
+    , pAeConvergence(nullptr)
+    , pThermalGovernor(nullptr)
+    , pStillBus(nullptr)
+    , pPreviewBus(nullptr)
+    , pStreamSink(nullptr)
     , gpioLEDpin(LED_PIN)
     , panPin(PAN_PIN)
     , tiltPin(TILT_PIN)
+    , triggerPin(TRIGGER_PIN)
+    , triggerCallbackId(-1)
     , gpioHostHandle(-1)
+    , bLowPower(false)
+    , thermalLevel(ThermalGovernor::LEVEL_NORMAL)
+    , bLatencyWarned(false)
     , width(0)
     , height(0)
     , filename(nullptr)
@@ -71,6 +117,8 @@ MainDialog::MainDialog(QWidget *parent)
 
     analog_gain = 1.0;
     digital_gain = 1.0;
+    ringTrigger.pRing    = nullptr; // No ring before startPreTrigger()
+    ringTrigger.eventNum = 0;
 // Prepare for periodic image acquisition
     switchLampOn();
     intervalTimer.stop();// Probably non needed but...does'nt hurt
@@ -78,12 +126,44 @@ MainDialog::MainDialog(QWidget *parent)
             SIGNAL(timeout()),
             this,
             SLOT(onTimeToGetNewImage()));
+    rearmTimer.setSingleShot(true);
+    connect(&rearmTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(onTimeToRearm()));
 // Check for the presence of the Pi Camera
     getSensorDefaults(cameraNum, cameraName, &width, &height);
     if(verbose)
         dumpParameters();
+// Restore the settings needed to build the pipeline
+    restorePipelineSettings();
+    // The buffer depths of the pipeline. A pipeline that does not fit in
+    // memory is not brought up; whether the run keeps up is checked at start
+    if(!planBuffers() && !bufferPlan.bMemoryFits) {
+        qDebug() << "Configuration refused:" << bufferPlan.sReason;
+        QMessageBox::critical(this,
+                              QString("Configuration refused"),
+                              QString("The pipeline does not fit: %1.").arg(bufferPlan.sReason));
+        exit(EXIT_FAILURE);
+    }
 // Create the needed Components
     pCamera        = new PiCamera(cameraNum, sensorMode);
+    pCamera->videoBufferNum = uint32_t(bufferPlan.videoBuffers);
+    pCamera->rawCapture = rawCapture;
+    if(preTrigger) {
+        if(motionDetection)
+            qDebug() << "Pre-trigger ring enabled: motion detection ignored";
+        motionDetection = false;
+        pCamera->videoWidth     = PRETRIGGER_WIDTH;
+        pCamera->videoHeight    = PRETRIGGER_HEIGHT;
+        pCamera->videoFrameRate = preTriggerFps;
+        pCamera->videoEncoding  = MMAL_ENCODING_OPAQUE;
+        pVideoEncoder = new VideoEncoder();
+    }
+    if(motionDetection) {
+        pCamera->videoWidth  = ANALYSIS_WIDTH;
+        pCamera->videoHeight = ANALYSIS_HEIGHT;
+    }
     pPreview       = new Preview(videoSize.width(), videoSize.height());// Setup preview window defaults
     pJpegEncoder   = new JpegEncoder();
 // Set up the Camera Configuration
@@ -115,6 +195,32 @@ MainDialog::MainDialog(QWidget *parent)
     }
 // Restore Previous Dialog Values
     restoreSettings();
+    // Always fed: it also keeps the metered exposure (see PiCamera::exposureUs())
+    pAeConvergence = new AeConvergence(aeTolerance/100.0, aeStableFrames);
+    pCamera->pAeConvergence = pAeConvergence;
+    if(thermalGovernor) {
+        pThermalGovernor = new ThermalGovernor(thermalWarm, thermalHot, thermalCritical);
+        connect(&thermalTimer,
+                SIGNAL(timeout()),
+                this,
+                SLOT(onThermalCheck()));
+        thermalTimer.start(ThermalGovernor::POLL_INTERVAL);
+    }
+    if(frameBus) {
+        pStillBus = new FrameBus(STILL_BUS_NAME, uint32_t(frameBusSlots), frameBusSlotBytes);
+        if(motionDetection) {
+            MMAL_PORT_T *videoPort = pCamera->component->output[MMAL_CAMERA_VIDEO_PORT];
+            pPreviewBus = new FrameBus(PREVIEW_BUS_NAME,
+                                       uint32_t(frameBusSlots),
+                                       videoPort->format->es->video.width*ANALYSIS_HEIGHT*3/2);
+        }
+    }
+    if(!sStreamOutput.isEmpty())
+        pStreamSink = new StreamSink(sStreamOutput,
+                                     std::max(4*avgFrameSize, uint32_t(STREAM_MIN_FRAME)),
+                                     streamBackpressure,
+                                     streamFraming,
+                                     streamQueue);
 // Init User Interface with restored values
     pUi->pathEdit->setText(sBaseDir);
     pUi->nameEdit->setText(sOutFileName);
@@ -133,7 +239,12 @@ MainDialog::MainDialog(QWidget *parent)
         qDebug() << "Unable to Start Camera Preview. error:" << status;
         exit(EXIT_FAILURE);
     }
+// Measure the shortest interval of the current settings
+    warmUp();
+    if(msecInterval < latencyModel.minInterval(exposureMs()))
+        pUi->intervalEdit->setStyleSheet(sErrorStyle);
     imageNum = 0;
+    bResumePhase = false;
 }
 
 
@@ -179,6 +290,67 @@ MainDialog::closeEvent(QCloseEvent *event) {
     settings.setValue("DigitalGain", digital_gain);
     settings.setValue("panValue",  cameraPanValue);
     settings.setValue("tiltValue", cameraTiltValue);
+    settings.setValue("HdrFrames", hdrFrames);
+    settings.setValue("HdrEvStep", hdrEvStep);
+    settings.setValue("StackFrames", stackFrames);
+    settings.setValue("StackMode", stackMode);
+    settings.setValue("RawCapture", rawCapture);
+    settings.setValue("RawFormat", rawFormat);
+    settings.setValue("MotionDetection", motionDetection);
+    settings.setValue("MotionThreshold", motionThreshold);
+    settings.setValue("MotionMinInterval", motionMinInterval);
+    settings.setValue("PreTrigger", preTrigger);
+    settings.setValue("PreTriggerFps", preTriggerFps);
+    settings.setValue("RingBudgetMB", ringBudgetMB);
+    settings.setValue("PreRollSec", preRollSec);
+    settings.setValue("PostRollSec", postRollSec);
+    settings.setValue("TriggerPin", triggerPin);
+    settings.setValue("TriggerMode", triggerMode);
+    settings.setValue("TriggerDebounceUs", triggerDebounceUs);
+    settings.setValue("TriggerMinInterval", triggerMinInterval);
+    settings.setValue("ExifTags", exifTags);
+    settings.setValue("FlushPolicy", flushPolicy);
+    settings.setValue("FlushEvery", flushEvery);
+    settings.setValue("AvgFrameSize", avgFrameSize);
+    settings.setValue("WriteMBps", writeMBps);
+    settings.setValue("StagingDir", sStagingDir);
+    settings.setValue("StagingBudgetMB", stagingBudgetMB);
+    settings.setValue("RateControl", rateControl);
+    settings.setValue("TargetFrameKB", targetFrameKB);
+    settings.setValue("RunBudgetMB", runBudgetMB);
+    settings.setValue("MinQuality", minQuality);
+    settings.setValue("ImageFormat", sImageFormat);
+    settings.setValue("LosslessCapture", losslessCapture);
+    settings.setValue("PyramidOutput", pyramidOutput);
+    settings.setValue("OutputWidth", outputWidth);
+    settings.setValue("OutputHeight", outputHeight);
+    settings.setValue("AeConvergence", aeConvergence);
+    settings.setValue("AeTolerance", aeTolerance);
+    settings.setValue("AeStableFrames", aeStableFrames);
+    settings.setValue("AeTimeout", aeTimeout);
+    settings.setValue("LowPowerInterval", lowPowerInterval);
+    settings.setValue("RearmMs", rearmMs);
+    settings.setValue("ThermalGovernor", thermalGovernor);
+    settings.setValue("ThermalWarm", thermalWarm);
+    settings.setValue("ThermalHot", thermalHot);
+    settings.setValue("ThermalCritical", thermalCritical);
+    thermalTimer.stop();
+    delete pThermalGovernor;
+    pThermalGovernor = nullptr;
+    settings.setValue("FrameBus", frameBus);
+    settings.setValue("FrameBusSlots", frameBusSlots);
+    settings.setValue("FrameBusSlotKB", frameBusSlotKB);
+    delete pStillBus; // The readers see the shared memory disappear
+    pStillBus = nullptr;
+    delete pPreviewBus;
+    pPreviewBus = nullptr;
+    settings.setValue("StreamOutput", sStreamOutput);
+    settings.setValue("StreamSource", streamSource);
+    settings.setValue("StreamBackpressure", streamBackpressure);
+    settings.setValue("StreamFraming", streamFraming);
+    settings.setValue("StreamQueue", streamQueue);
+    delete pStreamSink; // Outputs the queued frames
+    pStreamSink = nullptr;
     // Free GPIO
     if(gpioHostHandle >= 0)
         pigpio_stop(gpioHostHandle);
@@ -210,12 +382,224 @@ MainDialog::restoreSettings() {
                                   QStandardPaths::writableLocation(QStandardPaths::PicturesLocation)).toString();
     sOutFileName = settings.value("FileName",
                                   QString("test")).toString();
-    msecInterval    = settings.value("Interval", 10000).toInt();
     secTotTime      = settings.value("TotalTime", 0).toInt();
     analog_gain     = settings.value("AnalogGain", 1).toFloat();
     digital_gain    = settings.value("DigitalGain", 1).toFloat();
     cameraPanValue  = settings.value("panValue",  cameraPanValue).toDouble();
     cameraTiltValue = settings.value("tiltValue", cameraTiltValue).toDouble();
+    motionThreshold   = settings.value("MotionThreshold", 0.02).toDouble();
+    // 0: as often as the pipeline allows (see LatencyModel::minInterval())
+    motionMinInterval = settings.value("MotionMinInterval", 0).toInt();
+    if(motionMinInterval < 0)
+        motionMinInterval = 0;
+    preRollSec   = settings.value("PreRollSec", 5).toInt();
+    postRollSec  = settings.value("PostRollSec", 5).toInt();
+    triggerPin   = settings.value("TriggerPin", TRIGGER_PIN).toUInt();
+    triggerDebounceUs  = settings.value("TriggerDebounceUs", 5000).toInt();
+    triggerMinInterval = settings.value("TriggerMinInterval", 0).toInt();
+    if(triggerMinInterval < 0)
+        triggerMinInterval = 0;
+    if(triggerDebounceUs < 0 || triggerDebounceUs > 300000) // pigpiod limit
+        triggerDebounceUs = 5000;
+    exifTags = settings.value("ExifTags", true).toBool();
+    flushPolicy  = settings.value("FlushPolicy", FrameWriter::FLUSH_EVERY_N).toInt();
+    flushEvery   = settings.value("FlushEvery", 10).toInt();
+    if(flushPolicy < FrameWriter::FLUSH_EVERY_FRAME || flushPolicy > FrameWriter::FLUSH_ON_STOP)
+        flushPolicy = FrameWriter::FLUSH_EVERY_N;
+    if(flushEvery < 1)
+        flushEvery = 1;
+    sStagingDir     = settings.value("StagingDir", QString()).toString();
+    stagingBudgetMB = settings.value("StagingBudgetMB", 64).toInt();
+    if(stagingBudgetMB < 1)
+        stagingBudgetMB = 1;
+    rateControl   = settings.value("RateControl", 0).toInt();
+    targetFrameKB = settings.value("TargetFrameKB", 1024).toInt();
+    runBudgetMB   = settings.value("RunBudgetMB", 1024).toInt();
+    minQuality    = settings.value("MinQuality", 50).toInt();
+    if(rateControl < 0 || rateControl > 2)
+        rateControl = 0;
+    if(minQuality < 1 || minQuality > IMAGE_QUALITY)
+        minQuality = 50;
+    aeConvergence   = settings.value("AeConvergence", true).toBool();
+    aeTolerance     = settings.value("AeTolerance", 5).toInt();
+    aeStableFrames  = settings.value("AeStableFrames", 3).toInt();
+    aeTimeout       = settings.value("AeTimeout", CAMERA_SETTLE_TIME).toInt();
+    if(aeTolerance < 1 || aeTolerance > 50)
+        aeTolerance = 5;
+    if(aeStableFrames < 1)
+        aeStableFrames = 3;
+    if(aeTimeout < 0)
+        aeTimeout = CAMERA_SETTLE_TIME;
+    lowPowerInterval = settings.value("LowPowerInterval", 60000).toInt();
+    rearmMs          = settings.value("RearmMs", 2*CAMERA_SETTLE_TIME).toDouble();
+    if(rearmMs <= 0.0)
+        rearmMs = 2*CAMERA_SETTLE_TIME;
+    sStreamOutput      = settings.value("StreamOutput", QString()).toString();
+    streamSource       = settings.value("StreamSource", STREAM_STILLS).toInt();
+    streamBackpressure = settings.value("StreamBackpressure", StreamSink::BACKPRESSURE_DROP).toInt();
+    streamFraming      = settings.value("StreamFraming", StreamSink::FRAMING_NONE).toInt();
+    streamQueue        = settings.value("StreamQueue", 4).toInt();
+    if(streamSource != STREAM_VIDEO)
+        streamSource = STREAM_STILLS;
+    if(streamBackpressure != StreamSink::BACKPRESSURE_BLOCK)
+        streamBackpressure = StreamSink::BACKPRESSURE_DROP;
+    if(streamFraming != StreamSink::FRAMING_HEADER)
+        streamFraming = StreamSink::FRAMING_NONE;
+    if(streamQueue < 1)
+        streamQueue = 4;
+    thermalGovernor = settings.value("ThermalGovernor", true).toBool();
+    thermalWarm     = settings.value("ThermalWarm", 70.0).toDouble();
+    thermalHot      = settings.value("ThermalHot", 76.0).toDouble();
+    thermalCritical = settings.value("ThermalCritical", 80.0).toDouble();
+    if(thermalWarm >= thermalHot || thermalHot >= thermalCritical) {
+        thermalWarm     = 70.0;
+        thermalHot      = 76.0;
+        thermalCritical = 80.0;
+    }
+}
+
+
+/// Settings that must be known before the camera components are created
+void
+MainDialog::restorePipelineSettings() {
+    QSettings settings;
+    rawCapture = settings.value("RawCapture", false).toBool();
+    rawFormat  = settings.value("RawFormat", RawWorker::RAW_DNG).toInt();
+    if(rawFormat != RawWorker::RAW_SEQUENCE)
+        rawFormat = RawWorker::RAW_DNG;
+    motionDetection = settings.value("MotionDetection", false).toBool();
+    preTrigger      = settings.value("PreTrigger", false).toBool();
+    preTriggerFps   = settings.value("PreTriggerFps", 30).toInt();
+    if(preTriggerFps < 1 || preTriggerFps > 30)
+        preTriggerFps = 30;
+    // Chosen by the last calibration (slowMotion --calibrate)
+    sensorMode = settings.value("SensorMode", sensorMode).toInt();
+    if(sensorMode < 0 || sensorMode > 7)
+        sensorMode = 3;
+    // Measured by the calibration too: the interval checks start from it
+    latencyModel.setPrior(settings.value(QString("Calibration/%1/Mode%2/LatencyMs")
+                                         .arg(cameraName)
+                                         .arg(sensorMode), 0.0).toDouble());
+    // Needed by the buffer planner
+    msecInterval = settings.value("Interval", 10000).toInt();
+    hdrFrames       = settings.value("HdrFrames", 1).toInt();
+    hdrEvStep       = settings.value("HdrEvStep", 2.0).toDouble();
+    if(hdrFrames < 1)
+        hdrFrames = 1;
+    stackFrames     = settings.value("StackFrames", 1).toInt();
+    stackMode       = settings.value("StackMode", StackAccumulator::STACK_MEAN).toInt();
+    if(stackFrames < 1)
+        stackFrames = 1;
+    if(stackMode < StackAccumulator::STACK_MEAN || stackMode > StackAccumulator::STACK_LIGHTEN)
+        stackMode = StackAccumulator::STACK_MEAN;
+    ringBudgetMB = settings.value("RingBudgetMB", 128).toInt();
+    if(ringBudgetMB < 8)
+        ringBudgetMB = 8;
+    triggerMode  = settings.value("TriggerMode", false).toBool();
+    // Both wait for the edges of triggerPin: only one of them can own it
+    if(preTrigger && triggerMode) {
+        qDebug() << "Pre-trigger ring enabled: trigger mode ignored";
+        triggerMode = false;
+    }
+    avgFrameSize = settings.value("AvgFrameSize", uint(width*height/2)).toUInt();
+    writeMBps    = settings.value("WriteMBps", 20.0).toDouble();
+    if(writeMBps <= 0.0)
+        writeMBps = 20.0;
+    frameBus       = settings.value("FrameBus", false).toBool();
+    frameBusSlots  = settings.value("FrameBusSlots", 4).toInt();
+    frameBusSlotKB = settings.value("FrameBusSlotKB", 0).toInt();
+    if(frameBusSlots < 2)
+        frameBusSlots = 4;
+    if(frameBusSlotKB < 0)
+        frameBusSlotKB = 0;
+    // By default, room for the larger stills
+    frameBusSlotBytes = frameBusSlotKB ? uint32_t(frameBusSlotKB) << 10 : 2*avgFrameSize;
+    sImageFormat = settings.value("ImageFormat", QString("jpg")).toString();
+    if(!JpegEncoder::encodingFromExtension(sImageFormat))
+        sImageFormat = QString("jpg");
+    losslessCapture = settings.value("LosslessCapture", false).toBool();
+    pyramidOutput   = settings.value("PyramidOutput", false).toBool();
+    outputWidth     = settings.value("OutputWidth", 0).toInt();
+    outputHeight    = settings.value("OutputHeight", 0).toInt();
+    if(outputWidth < 0 || outputHeight < 0)
+        outputWidth = outputHeight = 0;
+}
+
+
+/**
+ * Plan the GPU and ARM memory and the buffer depths of the configured
+ * pipeline: a pipeline that cannot fit in memory is not brought up, and
+ * a run the storage cannot keep up with is refused at start, instead of
+ * failing later in the middle of it
+ * @return true if the configuration fits (see bufferPlan.sReason otherwise)
+ */
+bool
+MainDialog::planBuffers() {
+    BufferPlanner::CONFIG_T config;
+    config.width          = width;
+    config.height         = height;
+    config.outputWidth    = outputWidth;
+    config.outputHeight   = outputHeight;
+    config.previewWidth   = width; // The preview port runs at the capture size
+    config.previewHeight  = height;
+    config.videoWidth     = 0;
+    config.videoHeight    = 0;
+    config.videoFps       = 0;
+    config.bVideoEncoder  = preTrigger;
+    config.ringBytes      = 0;
+    config.busBytes       = frameBus ? uint64_t(frameBusSlots)*frameBusSlotBytes : 0;
+    if(preTrigger) {
+        config.videoWidth  = PRETRIGGER_WIDTH;
+        config.videoHeight = PRETRIGGER_HEIGHT;
+        config.videoFps    = preTriggerFps;
+        config.ringBytes   = uint64_t(ringBudgetMB) << 20;
+    }
+    else if(motionDetection) {
+        config.videoWidth  = ANALYSIS_WIDTH;
+        config.videoHeight = ANALYSIS_HEIGHT;
+        config.videoFps    = 5; // PiCamera default
+    }
+    config.bRaw      = rawCapture;
+    config.bDirect   = false;
+    config.armFrames = 0;
+    if(!triggerMode && !rawCapture) {
+        config.bDirect = true;
+        if(hdrFrames > 1) // Brackets in flight and the fused frame
+            config.armFrames = hdrFrames*HdrWorker::N_BRACKETS + 1;
+        else if(stackFrames > 1) // 32 bit sums and the stacked frame
+            config.armFrames = 4 + 1;
+        else if(losslessCapture) // The frame and its QOI encoding
+            config.armFrames = 2;
+        else if(pyramidOutput)
+            config.armFrames = PyramidWorker::N_SLOTS + 1;
+        else
+            config.bDirect = false;
+    }
+    // The raw data and the trigger stills need JPEG
+    MMAL_FOURCC_T stillEncoding = MMAL_ENCODING_JPEG;
+    if(!triggerMode && !rawCapture)
+        stillEncoding = JpegEncoder::encodingFromExtension(sImageFormat);
+    config.stillRate      = 1000.0/std::max(msecInterval, 1);
+    config.stillBytes     = avgFrameSize;
+    // As the frame bus slots: room for the larger stills
+    config.maxStillBytes  = 2*avgFrameSize;
+    if(stillEncoding != MMAL_ENCODING_JPEG) { // The whole RGB24 image, whatever the compression
+        config.maxStillBytes = uint32_t(width)*uint32_t(height)*3 + 4096;
+        config.stillBytes    = config.maxStillBytes;
+    }
+    config.writeBandwidth = writeMBps*1024*1024;
+
+    bufferPlan = BufferPlanner::plan(config,
+                                     uint64_t(get_mem_gpu()) << 20,
+                                     BufferPlanner::armAvailable());
+    if(verbose) {
+        qDebug() << "Planned GPU memory (MB):" << (bufferPlan.gpuBytes >> 20);
+        qDebug() << "Planned ARM memory (MB):" << (bufferPlan.armBytes >> 20);
+        qDebug() << "Preview frames        :" << bufferPlan.previewFrames;
+        qDebug() << "Video buffers         :" << bufferPlan.videoBuffers;
+        qDebug() << "Encoder buffers       :" << bufferPlan.encoderBuffers;
+    }
+    return bufferPlan.bFeasible;
 }
 
 
@@ -352,17 +736,7 @@ MainDialog::setDefaultParameters() {
                                            annotate_x,
                                            annotate_y);
     result += pCameraControl->set_gains(analog_gain, digital_gain);
-    if(settings) {
-        MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request = {
-            {MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)},
-            MMAL_PARAMETER_CAMERA_SETTINGS, 1
-        };
-        MMAL_STATUS_T status = mmal_port_parameter_set(pCamera->component->control, &change_event_request.hdr);
-        if(status != MMAL_SUCCESS) {
-            qDebug() << QString("No camera settings events");
-        }
-        result += status;
-    }
+    // The camera settings events are requested by PiCamera (see AeConvergence)
     return result;
 }
 
@@ -447,7 +821,11 @@ MainDialog::setupCameraConfiguration() {
         camConfig.max_preview_video_w = uint32_t(pPreview->previewWindow.width);
         camConfig.max_preview_video_h = uint32_t(pPreview->previewWindow.height);
     }
-    camConfig.num_preview_video_frames = 3;
+    if(pCamera->videoWidth > int(camConfig.max_preview_video_w))
+        camConfig.max_preview_video_w = uint32_t(pCamera->videoWidth);
+    if(pCamera->videoHeight > int(camConfig.max_preview_video_h))
+        camConfig.max_preview_video_h = uint32_t(pCamera->videoHeight);
+    camConfig.num_preview_video_frames = uint32_t(bufferPlan.previewFrames);
     camConfig.stills_capture_circular_buffer_height = 0;// Sets the height of the circular buffer for stills capture
     camConfig.fast_preview_resume = 0;
     camConfig.use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC;
@@ -491,8 +869,9 @@ MainDialog::switchLampOff() {
 bool
 MainDialog::gpioInit() {
     int iResult;
-    gpioHostHandle = pigpio_start(QString("localhost").toLocal8Bit().data(),
-                                  QString("8888").toLocal8Bit().data());
+    // Null address and port: pigpiod_if2 takes them from PIGPIO_ADDR and
+    // PIGPIO_PORT, defaulting to localhost:8888 (this allows a stand-in daemon)
+    gpioHostHandle = pigpio_start(nullptr, nullptr);
     if(gpioHostHandle < 0) {
         QMessageBox::critical(this,
                               QString("pigpiod Error !"),
@@ -530,74 +909,573 @@ MainDialog::checkValues() {
 }
 
 
-void
-MainDialog::getSensorDefaults(int camera_num, char *camera_name, int *width, int *height) {
-   MMAL_COMPONENT_T *cameraInfo;
-   MMAL_STATUS_T status;
-   // Default to the OV5647 setup
-   strncpy(camera_name, "OV5647", MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN);
-   // Try to get the camera name and maximum supported resolution
-   status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &cameraInfo);
-   if(status == MMAL_SUCCESS) {
-      MMAL_PARAMETER_CAMERA_INFO_T param;
-      param.hdr.id = MMAL_PARAMETER_CAMERA_INFO;
-      param.hdr.size = sizeof(param)-4;  // Deliberately undersize to check firmware version
-      status = mmal_port_parameter_get(cameraInfo->control, &param.hdr);
-
-      if(status != MMAL_SUCCESS) {// Running on newer firmware
-         param.hdr.size = sizeof(param);
-         status = mmal_port_parameter_get(cameraInfo->control, &param.hdr);
-         if(status == MMAL_SUCCESS && param.num_cameras > uint32_t(camera_num)) {
-            // Take the parameters from the first camera listed.
-            if(*width == 0)
-               *width = int32_t(param.cameras[camera_num].max_width);
-            if(*height == 0)
-               *height = int32_t(param.cameras[camera_num].max_height);
-            strncpy(camera_name, param.cameras[camera_num].camera_name, MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN);
-            camera_name[MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN-1] = 0;
-         }
-         else
-            qDebug() << QString("Cannot read camera info, keeping the defaults for OV5647");
-      }
-      else {
-         // Older firmware
-         // Nothing to do here, keep the defaults for OV5647
-      }
-      mmal_component_destroy(cameraInfo);
-   }
-   else {
-      qDebug() << QString("Failed to create camera_info component");
-   }
-   // default to OV5647 if nothing detected..
-   if(*width == 0)
-      *width = 2592;
-   if(*height == 0)
-      *height = 1944;
-}
-
-
 void
 MainDialog::on_startButton_clicked() {
     if(!checkValues()) {
         pUi->statusBar->setText((QString("Error: Check Values !")));
         return;
     }
+    // In auto exposure the bracket is centered on the metered exposure
+    if(!triggerMode && !rawCapture && hdrFrames > 1 && pCamera->exposureUs() == 0) {
+        QMessageBox::critical(this,
+                              QString("HDR"),
+                              QString("The camera reports no exposure to bracket around: set a shutter speed."));
+        pUi->statusBar->setText((QString("Error: No Metered Exposure !")));
+        return;
+    }
+    // The interval and the format may have changed since the last plan
+    if(!planBuffers()) {
+        QMessageBox::critical(this,
+                              QString("Configuration refused"),
+                              QString("The run does not fit: %1.").arg(bufferPlan.sReason));
+        pUi->statusBar->setText((QString("Error: Configuration Refused !")));
+        return;
+    }
+    if(!beginOutput()) {
+        pUi->statusBar->setText((QString("Error: Not Enough Free Space !")));
+        return;
+    }
+    // Continue after the last still of an interrupted run instead of overwriting it
+    if(!runJournal.open(QString("%1/%2_journal.bin").arg(sBaseDir).arg(sOutFileName)))
+        qDebug() << "Unable to open the run journal: the stills are not journaled";
+    else {
+        if(runJournal.hasLast() && int(runJournal.last().index) >= imageNum) {
+            imageNum = int(runJournal.last().index) + 1;
+            qDebug() << QString("Resuming %1 from still %2").arg(sOutFileName).arg(imageNum);
+        }
+        // The final files only: not the ones in the staging area
+        outputWriter()->setJournal(&runJournal);
+    }
+    if(pThermalGovernor &&
+       !pThermalGovernor->startLog(QString("%1/%2_telemetry.csv").arg(sBaseDir).arg(sOutFileName)))
+        qDebug() << "Unable to create the telemetry log";
     switchLampOff();
-    intervalTimer.start(msecInterval);
+    runRebuilds = rebuildCount();
+    updateCaptureDeadline();
+    if(pStillBus && pStillBus->isValid())
+        outputWriter()->setBus(pStillBus); // The final files, as the journal
+    if(pStreamSink) {
+        if(streamSource == STREAM_STILLS)
+            outputWriter()->setSink(pStreamSink);
+        else if(pVideoEncoder)
+            pVideoEncoder->pSink = pStreamSink;
+        else
+            qDebug() << "No pre-trigger video: nothing to stream";
+    }
 
     QList<QWidget *> widgets = findChildren<QWidget *>();
     for(int i=0; i<widgets.size(); i++) {
         widgets[i]->setDisabled(true);
     }
     pUi->stopButton->setEnabled(true);
-    pCamera->start(pJpegEncoder);
+    // The controls are disabled while running: the tags are constant
+    if(exifTags) {
+        if(!pExifWriter)
+            pExifWriter = new ExifWriter(cameraName);
+        pExifWriter->setGains(analog_gain, digital_gain);
+        pExifWriter->setPanTilt(cameraPanValue, cameraTiltValue);
+    }
+    pCamera->pExifWriter = exifTags ? pExifWriter : nullptr;
+    pCamera->outputWidth  = outputWidth;
+    pCamera->outputHeight = outputHeight;
+    pJpegEncoder->setOutputBuffers(uint32_t(bufferPlan.encoderBuffers), bufferPlan.encoderBufferSize);
+    // The raw data and the trigger stills need JPEG
+    if(triggerMode || pCamera->rawCapture)
+        pJpegEncoder->setEncoding(MMAL_ENCODING_JPEG);
+    else if(pJpegEncoder->setEncoding(JpegEncoder::encodingFromExtension(sImageFormat)) != MMAL_SUCCESS)
+        qDebug() << "Unable to encode" << sImageFormat << ": using" << JpegEncoder::extension(pJpegEncoder->encoding);
+    if(triggerMode) {
+        // The stills are taken by the trigger thread on the tunnelled path
+        if(hdrFrames > 1 || stackFrames > 1)
+            qDebug() << "Trigger mode enabled: HDR and stacking ignored";
+        pCamera->start(pJpegEncoder);
+        pTriggerCapture = new TriggerCapture(pCamera,
+                                             gpioHostHandle,
+                                             triggerPin,
+                                             triggerDebounceUs,
+                                             std::max(triggerMinInterval,
+                                                      latencyModel.minInterval(exposureMs())),
+                                             QString("%1/%2_trig").arg(sBaseDir).arg(sOutFileName),
+                                             QString("%1/%2_latency.csv").arg(sBaseDir).arg(sOutFileName),
+                                             imageNum); // After the journaled stills
+        if(!pTriggerCapture->start()) {
+            qDebug() << "Unable to start the trigger capture";
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(pCamera->rawCapture) {
+        // The raw data is appended by the encoder: only the tunnelled path carries it
+        if(hdrFrames > 1 || stackFrames > 1)
+            qDebug() << "Raw capture enabled: HDR and stacking ignored";
+        pCamera->start(pJpegEncoder);
+        QString sSequence = QString("%1/%2.raws").arg(sBaseDir).arg(sOutFileName);
+        pRawWorker = new RawWorker(outputWriter(),
+                                   RawWorker::rawBlockSize(cameraName) + pCamera->frameSize/2,
+                                   rawFormat,
+                                   sSequence,
+                                   cameraName);
+    }
+    else if(hdrFrames > 1) {
+        // The bracket is fused on the CPU before being encoded
+        if(!startDirectCapture()) {
+            qDebug() << "Unable to start the HDR capture";
+            exit(EXIT_FAILURE);
+        }
+        pHdrWorker = new HdrWorker(pJpegEncoder,
+                                   outputWriter(),
+                                   hdrFrames,
+                                   pCamera->frameWidth,
+                                   pCamera->frameHeight,
+                                   pCamera->frameStride,
+                                   pCamera->frameSize);
+    }
+    else if(stackFrames > 1) {
+        // The exposures are stacked on the CPU before being encoded
+        if(!startDirectCapture()) {
+            qDebug() << "Unable to start the stacked capture";
+            exit(EXIT_FAILURE);
+        }
+        pStacker = new StackAccumulator(StackAccumulator::StackMode(stackMode),
+                                        pCamera->frameSize);
+        stackedFrame.resize(pCamera->frameSize);
+    }
+    else if(losslessCapture) {
+        // The frames are encoded on the CPU: the image encoder is not used
+        if(pCamera->startDirect() != MMAL_SUCCESS) {
+            qDebug() << "Unable to start the lossless capture";
+            exit(EXIT_FAILURE);
+        }
+        pQoiEncoder = new QoiEncoder(pCamera->frameWidth,
+                                     pCamera->frameHeight,
+                                     pCamera->frameStride);
+        directFrame.resize(pCamera->frameSize);
+    }
+    else if(pyramidOutput) {
+        // The full frame goes through the ARM side to feed the pyramid,
+        // then to the encoder as the tunnelled stills would
+        if(!startDirectCapture()) {
+            qDebug() << "Unable to start the direct capture";
+            exit(EXIT_FAILURE);
+        }
+        pJpegEncoder->setQuality(IMAGE_QUALITY);
+        startRateControl();
+        directFrame.resize(pCamera->frameSize);
+    }
+    else {
+        pJpegEncoder->setQuality(IMAGE_QUALITY);
+        startRateControl();
+        pCamera->start(pJpegEncoder);
+    }
+    if(pyramidOutput) {
+        if(pStacker || pQoiEncoder || !directFrame.empty()) {
+            pPyramidWorker = new PyramidWorker(outputWriter(),
+                                               pCamera->frameWidth,
+                                               pCamera->frameHeight,
+                                               pCamera->frameStride,
+                                               pJpegEncoder->encodeTimeoutMs);
+            if(!pPyramidWorker->isValid()) {
+                qDebug() << "Unable to start the pyramid encoders";
+                exit(EXIT_FAILURE);
+            }
+        }
+        else
+            qDebug() << "Trigger, raw and HDR captures: no pyramid";
+    }
+    // The warm-up measured the tunnelled path: the direct ones start over
+    if(pRawWorker || pHdrWorker || pStacker || pQoiEncoder || pPyramidWorker)
+        latencyModel.reset();
+    bLatencyWarned = false;
+    if(preTrigger && !startPreTrigger()) {
+        qDebug() << "Unable to start the pre-trigger ring";
+        exit(EXIT_FAILURE);
+    }
+    if(motionDetection && !triggerMode) {
+        // Poll the detector: the stills are taken on changes, or every msecInterval
+        MMAL_PORT_T *videoPort = pCamera->component->output[MMAL_CAMERA_VIDEO_PORT];
+        pMotionDetector = new MotionDetector(ANALYSIS_WIDTH,
+                                             ANALYSIS_HEIGHT,
+                                             videoPort->format->es->video.width,
+                                             motionThreshold);
+        pMotionDetector->setDecimation(thermalDecimation[thermalLevel]);
+        if(pPreviewBus && pPreviewBus->isValid())
+            pMotionDetector->setPreviewBus(pPreviewBus);
+        if(pCamera->startAnalysis(pMotionDetector) != MMAL_SUCCESS) {
+            qDebug() << "Unable to start the motion detection";
+            exit(EXIT_FAILURE);
+        }
+        lastCaptureTime.start();
+        intervalTimer.start(MOTION_POLL_INTERVAL);
+    }
+    else if(!triggerMode) {
+        // Keep the schedule of the journaled run
+        int firstDelay = msecInterval;
+        if(runJournal.hasLast()) {
+            qint64 sinceLast = QDateTime::currentMSecsSinceEpoch() - runJournal.last().timestampMs;
+            if(sinceLast >= 0)
+                firstDelay = msecInterval - int(sinceLast % msecInterval);
+        }
+        bResumePhase = firstDelay != msecInterval;
+        intervalTimer.start(firstDelay);
+        // Long intervals on the tunnelled path: the camera sleeps between the stills
+        bLowPower = lowPowerInterval > 0 &&
+                    msecInterval >= lowPowerInterval &&
+                    !preTrigger &&
+                    !pHdrWorker && !pStacker && !pQoiEncoder && !pPyramidWorker;
+        if(bLowPower)
+            suspendCamera();
+    }
+}
+
+
+/**
+ * Create the rate controller of the tunnelled captures (if enabled).
+ * The run budget needs the number of stills: without a total time
+ * (or with motion detection) the per still target is used instead.
+ */
+void
+MainDialog::startRateControl() {
+    if(rateControl == 0 || pJpegEncoder->encoding != MMAL_ENCODING_JPEG)
+        return;
+    pRateController = new RateController(IMAGE_QUALITY, uint32_t(minQuality), IMAGE_QUALITY);
+    if(rateControl == 2 && secTotTime > 0 && !motionDetection) {
+        uint32_t nFrames = uint32_t(uint64_t(secTotTime)*1000/uint64_t(msecInterval) + 1);
+        pRateController->setRunBudget(uint64_t(runBudgetMB) << 20, nFrames);
+    }
+    else {
+        if(rateControl == 2)
+            qDebug() << "Unknown number of stills: using the per still target";
+        pRateController->setFrameTarget(uint32_t(targetFrameKB) << 10);
+    }
+}
+
+
+/// Deadline of the next capture: a still that has not arrived by then
+/// is lost and the pipeline rebuilt (see PiCamera::rebuild())
+void
+MainDialog::updateCaptureDeadline() {
+    double deadline = exposureMs() + std::max(double(CAPTURE_DEADLINE),
+                                              DEADLINE_FACTOR*double(latencyModel.minInterval(exposureMs())));
+    pCamera->captureTimeoutMs = uint32_t(deadline);
+    pJpegEncoder->encodeTimeoutMs = uint32_t(deadline);
+}
+
+
+/// Rebuilds after lost frames of the camera and of the encoders of the stills
+int
+MainDialog::rebuildCount() {
+    int rebuilds = pCamera->rebuildCount() + pJpegEncoder->rebuildCount();
+    if(pPyramidWorker)
+        rebuilds += pPyramidWorker->rebuildCount();
+    return rebuilds;
+}
+
+
+/**
+ * Time a few stills on the tunnelled path, written to the temporary folder
+ * and removed, so that the interval can be checked before the first run
+ * (the model keeps learning from the stills of the runs, on their storage).
+ */
+void
+MainDialog::warmUp() {
+    if(pCamera->start(pJpegEncoder) != MMAL_SUCCESS) {
+        qDebug() << "Unable to start the warm-up captures";
+        return;
+    }
+    waitForExposure(CAMERA_SETTLE_TIME);
+    // Nothing is left among the stills, even if the program is killed meanwhile
+    QString sFileName = QString("%1/slowMotion_warmup.%2")
+            .arg(QDir::tempPath())
+            .arg(JpegEncoder::extension(pJpegEncoder->encoding));
+    pCamera->frameWriter.begin(QDir::tempPath(), 0, 0, FrameWriter::FlushPolicy(flushPolicy), flushEvery);
+    updateCaptureDeadline();
+    for(int i=0; i<LatencyModel::WARMUP_CAPTURES; i++) {
+        if(pCamera->capture(sFileName))
+            recordLatency(true, 0.0, LAMP_ON_DELAY+LAMP_OFF_DELAY);
+    }
+    pCamera->frameWriter.end();
+    QFile::remove(sFileName);
+    pCamera->stop(pJpegEncoder);
+    qDebug() << QString("Minimum interval: %1 ms").arg(latencyModel.minInterval(exposureMs()));
+}
+
+
+/**
+ * Wait for the exposure to adapt to the scene (the lamp has just been
+ * switched on, or the camera started): as soon as the camera settings
+ * have settled, or after a fixed delay without convergence detection
+ * @param msecDelay The fixed delay
+ */
+void
+MainDialog::waitForExposure(int msecDelay) {
+    if(!aeConvergence) {
+        QThread::msleep(ulong(msecDelay));
+        return;
+    }
+    pAeConvergence->restart();
+    if(!pAeConvergence->wait(aeTimeout))
+        qDebug() << QString("Exposure not settled after %1 ms").arg(aeTimeout);
+}
+
+
+/// Total exposure of a still with the current settings (every frame of a bracket or stack)
+double
+MainDialog::exposureMs() {
+    double speed = pCamera->exposureUs(); // The metered one in auto exposure
+    if(triggerMode || rawCapture)
+        return speed/1000.0;
+    if(hdrFrames > 1) {
+        double total = 0.0;
+        for(int i=0; i<hdrFrames; i++)
+            total += speed*pow(2.0, hdrEvStep*(i - 0.5*(hdrFrames-1)));
+        return total/1000.0;
+    }
+    return speed*stackFrames/1000.0;
+}
+
+
+/**
+ * Feed the latency model with the stages of the last still
+ * @param bTunnel   The still went through PiCamera::capture() (the camera has the split)
+ * @param captureMs Whole capture otherwise
+ * @param lampMs    Lamp switching and delays
+ */
+void
+MainDialog::recordLatency(bool bTunnel, double captureMs, double lampMs) {
+    double stageMs[LatencyModel::N_STAGES];
+    double exposure = exposureMs();
+    for(int i=0; i<LatencyModel::N_STAGES; i++)
+        stageMs[i] = -1.0;
+    stageMs[LatencyModel::STAGE_LAMP] = lampMs;
+    if(bTunnel) {
+        PiCamera::CAPTURE_TIMING_T timing = pCamera->lastCaptureTiming();
+        stageMs[LatencyModel::STAGE_MODE_SWITCH] = std::max(0.0, timing.startUs/1000.0 - exposure);
+        stageMs[LatencyModel::STAGE_ENCODE]      = timing.encodeUs/1000.0;
+        stageMs[LatencyModel::STAGE_WRITE]       = timing.writeUs/1000.0;
+    }
+    else
+        stageMs[LatencyModel::STAGE_PROCESS] = std::max(0.0, captureMs - exposure);
+    latencyModel.add(stageMs);
+    int minInterval = latencyModel.minInterval(exposure);
+    if(intervalTimer.isActive() && !pMotionDetector && !bLatencyWarned && minInterval > msecInterval) {
+        qDebug() << QString("The stills need %1 ms: the %2 ms interval will not be kept")
+                    .arg(minInterval)
+                    .arg(msecInterval);
+        bLatencyWarned = true;
+    }
+}
+
+
+/**
+ * Check that the whole run fits the free space and reserve it.
+ * The size is estimated from the average still of the previous runs.
+ * @return false if the run does not fit
+ */
+bool
+MainDialog::beginOutput() {
+    uint64_t expected = 0;
+    // With a trigger the number of stills is unknown: only check the free space
+    if(secTotTime > 0 && !triggerMode) {
+        uint64_t nFrames = uint64_t(secTotTime)*1000/uint64_t(msecInterval) + 1;
+        expected = nFrames*avgFrameSize*5/4;
+    }
+    if(!sStagingDir.isEmpty() && !triggerMode) {
+        // The stills go to RAM first, the mover writes the final files
+        if(!QDir(sStagingDir).exists() && !QDir().mkpath(sStagingDir))
+            return false;
+        pStagingMover = new StagingMover(sStagingDir, uint64_t(stagingBudgetMB)*1024*1024);
+        if(!pStagingMover->target.begin(sBaseDir,
+                                        expected,
+                                        avgFrameSize*3/2,
+                                        FrameWriter::FlushPolicy(flushPolicy),
+                                        flushEvery)) {
+            delete pStagingMover;
+            pStagingMover = nullptr;
+            return false;
+        }
+        return pCamera->frameWriter.begin(sStagingDir, 0, 0, FrameWriter::FLUSH_ON_STOP, 1);
+    }
+    return pCamera->frameWriter.begin(sBaseDir,
+                                      expected,
+                                      avgFrameSize*3/2,
+                                      FrameWriter::FlushPolicy(flushPolicy),
+                                      flushEvery);
+}
+
+
+/**
+ * The output layer of the final files: the mover's in staging mode.
+ * The stills written by the workers (fused, raw, the reduced copies...)
+ * go through it: they are already off the capture thread.
+ */
+FrameWriter*
+MainDialog::outputWriter() {
+    return pStagingMover ? &pStagingMover->target : &pCamera->frameWriter;
+}
+
+
+/// Where this thread writes a still: the staging area in staging mode (see StagingMover)
+QString
+MainDialog::stagedPath(QString sFileName) {
+    return pStagingMover ? pStagingMover->stagingPath(sFileName) : sFileName;
+}
+
+
+/// Route the still frames to ARM memory and the encoder input to the ARM side
+bool
+MainDialog::startDirectCapture() {
+    MMAL_PORT_T *stillPort = pCamera->component->output[MMAL_CAMERA_CAPTURE_PORT];
+    if(pCamera->startDirect() != MMAL_SUCCESS)
+        return false;
+    return pJpegEncoder->startDirect(stillPort->format, pCamera->frameSize) == MMAL_SUCCESS;
+}
+
+
+void
+MainDialog::stopDirectCapture() {
+    pCamera->stopDirect();
+    pJpegEncoder->stopDirect();
+}
+
+
+/// Start filling the frame ring and wait for edges on the trigger GPIO
+bool
+MainDialog::startPreTrigger() {
+    // Slots sized for 4 times the mean MJPEG frame
+    uint32_t slotSize = 4*(pVideoEncoder->bitrate/8)/uint32_t(preTriggerFps);
+    pFrameRing = new FrameRing(size_t(ringBudgetMB)*1024*1024,
+                               slotSize,
+                               preRollSec*1000,
+                               postRollSec*1000);
+    if(pFrameRing->slotCount() < preRollSec*preTriggerFps)
+        qDebug() << QString("The ring holds %1 frames: less than %2 s of pre-roll")
+                    .arg(pFrameRing->slotCount())
+                    .arg(preRollSec);
+    if(pVideoEncoder->start(pFrameRing) != MMAL_SUCCESS)
+        return false;
+    if(pCamera->startVideo(pVideoEncoder) != MMAL_SUCCESS)
+        return false;
+    {
+        // What FrameRing::edgeCallback() needs, out of reach of the GUI thread
+        std::lock_guard<std::mutex> lock(ringTrigger.mutex);
+        ringTrigger.pRing      = pFrameRing;
+        ringTrigger.sEventBase = QString("%1/%2_event_").arg(sBaseDir).arg(sOutFileName);
+        ringTrigger.eventNum   = 0;
+    }
+    if(set_mode(gpioHostHandle, triggerPin, PI_INPUT) < 0 ||
+       set_pull_up_down(gpioHostHandle, triggerPin, PI_PUD_UP) < 0) {
+        qDebug() << QString("Unable to initialize GPIO%1 as trigger input").arg(triggerPin);
+        return false;
+    }
+    triggerCallbackId = callback_ex(gpioHostHandle, triggerPin, FALLING_EDGE, FrameRing::edgeCallback, &ringTrigger);
+    if(triggerCallbackId < 0) {
+        qDebug() << QString("Unable to watch GPIO%1").arg(triggerPin);
+        return false;
+    }
+    return true;
+}
+
+
+void
+MainDialog::stopPreTrigger() {
+    if(triggerCallbackId >= 0)
+        callback_cancel(unsigned(triggerCallbackId));
+    triggerCallbackId = -1;
+    pCamera->stopVideo();
+    pVideoEncoder->stop();
+    {
+        // callback_cancel() does not wait for a callback already running:
+        // it holds the lock, and the ones still to come find no ring
+        std::lock_guard<std::mutex> lock(ringTrigger.mutex);
+        ringTrigger.pRing = nullptr;
+    }
+    delete pFrameRing; // Waits for the flush in progress
+    pFrameRing = nullptr;
 }
 
 
 void
 MainDialog::on_stopButton_clicked() {
     intervalTimer.stop();
-    pCamera->stop(pJpegEncoder);
+    rearmTimer.stop();
+    if(rebuildCount() != runRebuilds)
+        qDebug() << QString("Pipeline rebuilt %1 times during the run")
+                    .arg(rebuildCount()-runRebuilds);
+    bResumePhase = false;
+    if(pCamera->isSuspended())
+        pCamera->resume(pJpegEncoder);
+    bLowPower = false;
+    if(pFrameRing)
+        stopPreTrigger();
+    if(pVideoEncoder)
+        pVideoEncoder->pSink = nullptr;
+    if(pMotionDetector) {
+        pCamera->stopAnalysis();
+        delete pMotionDetector;
+        pMotionDetector = nullptr;
+    }
+    if(pTriggerCapture) {
+        pTriggerCapture->stop(); // Waits for the capture in progress
+        imageNum = pTriggerCapture->nextFrame(); // The next run continues the numbering
+        delete pTriggerCapture;
+        pTriggerCapture = nullptr;
+        pCamera->stop(pJpegEncoder);
+    }
+    else if(pRawWorker) {
+        delete pRawWorker; // Waits for the pending frames
+        pRawWorker = nullptr;
+        pCamera->stop(pJpegEncoder);
+    }
+    else if(pHdrWorker) {
+        delete pHdrWorker; // Waits for the pending brackets
+        pHdrWorker = nullptr;
+        stopDirectCapture();
+    }
+    else if(pStacker) {
+        delete pStacker;
+        pStacker = nullptr;
+        stackedFrame.clear();
+        stackedFrame.shrink_to_fit();
+        stopDirectCapture();
+    }
+    else if(pQoiEncoder) {
+        delete pQoiEncoder;
+        pQoiEncoder = nullptr;
+        directFrame.clear();
+        directFrame.shrink_to_fit();
+        pCamera->stopDirect();
+    }
+    else if(pPyramidWorker) {
+        directFrame.clear();
+        directFrame.shrink_to_fit();
+        stopDirectCapture();
+    }
+    else
+        pCamera->stop(pJpegEncoder);
+    if(pPyramidWorker) {
+        delete pPyramidWorker; // Waits for the pending copies
+        pPyramidWorker = nullptr;
+    }
+    if(pRateController) {
+        delete pRateController;
+        pRateController = nullptr;
+        pJpegEncoder->setQuality(IMAGE_QUALITY);
+    }
+    pCamera->frameWriter.end();
+    if(pThermalGovernor)
+        pThermalGovernor->stopLog();
+    if(pStagingMover) {
+        delete pStagingMover; // Waits for the staged stills to be moved
+        pStagingMover = nullptr;
+    }
+    // Every still written by the workers and the mover is journaled, published and streamed by now
+    pCamera->frameWriter.setJournal(nullptr);
+    pCamera->frameWriter.setBus(nullptr);
+    pCamera->frameWriter.setSink(nullptr);
+    if(pStreamSink && pStreamSink->dropped())
+        qDebug() << QString("%1 frames dropped from the stream so far").arg(pStreamSink->dropped());
+    runJournal.close();
+    if(pCamera->frameWriter.averageFrameSize())
+        avgFrameSize = pCamera->frameWriter.averageFrameSize();
     switchLampOff();
     QList<QWidget *> widgets = findChildren<QWidget *>();
     for(int i=0; i<widgets.size(); i++) {
@@ -609,7 +1487,7 @@ MainDialog::on_stopButton_clicked() {
 
 void
 MainDialog::on_intervalEdit_textEdited(const QString &arg1) {
-    if(arg1.toInt() < MIN_INTERVAL) {
+    if(arg1.toInt() < latencyModel.minInterval(exposureMs())) {
         pUi->intervalEdit->setStyleSheet(sErrorStyle);
     } else {
         msecInterval = arg1.toInt();
@@ -672,16 +1550,283 @@ MainDialog::on_nameEdit_textChanged(const QString &arg1) {
 //////////////////////////////////////////////////////////////
 void
 MainDialog::onTimeToGetNewImage() {
+    if(bResumePhase) { // Back in phase with the interrupted run
+        bResumePhase = false;
+        intervalTimer.setInterval(msecInterval);
+    }
+    if(pMotionDetector) {
+        qint64 elapsed = lastCaptureTime.elapsed();
+        if(elapsed < std::max(motionMinInterval, latencyModel.minInterval(exposureMs())))
+            return;
+        if(!pMotionDetector->takeMotion() && elapsed < msecInterval)
+            return;
+        if(verbose)
+            qDebug() << "Changed blocks:" << pMotionDetector->changedFraction();
+        lastCaptureTime.restart();
+    }
+    // The stills written by this thread go through the staging area,
+    // the workers write theirs to the storage directly
+    bool bStaged = pStagingMover && !pRawWorker && !pHdrWorker;
+    // Backpressure: wait for the mover if the staging area is full
+    if(bStaged && !pStagingMover->waitForRoom(avgFrameSize*3/2)) {
+        qDebug() << QString("Frame %1 skipped: the staging area is full of stills that could not be moved")
+                    .arg(imageNum);
+        return;
+    }
+    if(pCamera->isSuspended()) { // Woken up too late
+        rearmTimer.stop();
+        onTimeToRearm();
+    }
+    QElapsedTimer stageTimer;
+    stageTimer.start();
     switchLampOn();
-    QThread::msleep(10);
-    QString sFileName = QString("%1/%2_%3.jpg")
+    waitForExposure(LAMP_ON_DELAY);
+    double lampMs = stageTimer.nsecsElapsed()/1.0e6;
+    stageTimer.restart();
+    bool bTunnel = false;
+    int rebuilds = rebuildCount();
+    updateCaptureDeadline();
+    QString sFileName = QString("%1/%2_%3.%4")
             .arg(sBaseDir)
             .arg(sOutFileName)
-            .arg(imageNum, 4, 10, QLatin1Char('0'));
-    pCamera->capture(sFileName);
-    QThread::msleep(300);
+            .arg(imageNum, 4, 10, QLatin1Char('0'))
+            .arg(pQoiEncoder ? QString("qoi") : JpegEncoder::extension(pJpegEncoder->encoding));
+    bool bCaptured = false;
+    if(pRawWorker)
+        captureRaw(sFileName);
+    else if(pHdrWorker)
+        captureBracket(sFileName);
+    else if(pStacker)
+        bCaptured = captureStack(sFileName);
+    else if(pQoiEncoder)
+        bCaptured = captureLossless(sFileName);
+    else if(pPyramidWorker)
+        bCaptured = captureDirect(sFileName);
+    else {
+        bCaptured = pCamera->capture(stagedPath(sFileName), imageNum);
+        bTunnel = true;
+    }
+    if(bStaged && bCaptured)
+        pStagingMover->submit(stagedPath(sFileName), sFileName, imageNum);
+    if(pRateController && bCaptured) // The new quality is used from the next still
+        pJpegEncoder->setQuality(pRateController->update(bTunnel ? pCamera->lastCaptureBytes()
+                                                                 : pJpegEncoder->lastEncodedBytes()));
+    double captureMs = stageTimer.nsecsElapsed()/1.0e6;
+    stageTimer.restart();
+    QThread::msleep(LAMP_OFF_DELAY);
     switchLampOff();
+    // A lost frame says nothing about the latency of the pipeline
+    // The workers rebuild their encoders on their own threads: counted in the run total only
+    // (the stills are journaled by the output writer, when they are on the storage)
+    if(rebuildCount() != rebuilds)
+        qDebug() << QString("Frame %1 lost: pipeline rebuilt").arg(imageNum);
+    else
+        recordLatency(bTunnel, captureMs, lampMs + stageTimer.nsecsElapsed()/1.0e6);
+    if(pMotionDetector) // The lamp is not a change in the scene
+        pMotionDetector->resync();
+    if(pThermalGovernor)
+        pThermalGovernor->markFrame(imageNum);
     imageNum++;
+    if(bLowPower)
+        suspendCamera();
+}
+
+
+/**
+ * Low power mode: stop the camera until it is time to wake it up
+ * for the next still (rearmMs before the deadline, with a margin)
+ */
+void
+MainDialog::suspendCamera() {
+    if(pCamera->suspend(pJpegEncoder) != MMAL_SUCCESS) {
+        qDebug() << "Unable to stop the camera: low power mode disabled";
+        pCamera->resume(pJpegEncoder);
+        bLowPower = false;
+        return;
+    }
+    rearmTimer.start(std::max(0, intervalTimer.remainingTime() - int(rearmMs*REARM_MARGIN)));
+}
+
+
+/// Apply the load of the thermal level when it changes
+void
+MainDialog::onThermalCheck() {
+    int level = pThermalGovernor->level();
+    if(level == thermalLevel)
+        return;
+    thermalLevel = level;
+    if(pCamera->limitPreviewFrameRate(thermalPreviewFps[level]) != MMAL_SUCCESS)
+        qDebug() << "Unable to change the preview frame rate";
+    if(pMotionDetector)
+        pMotionDetector->setDecimation(thermalDecimation[level]);
+}
+
+
+/**
+ * Exposures of a burst (stack) at the current thermal level
+ * @param nFrames The configured depth
+ * @return the depth to use
+ */
+int
+MainDialog::burstDepth(int nFrames) {
+    if(thermalLevel == ThermalGovernor::LEVEL_CRITICAL)
+        return 1;
+    if(thermalLevel == ThermalGovernor::LEVEL_HOT)
+        return (nFrames+1)/2;
+    return nFrames;
+}
+
+
+/// Enable the camera again and let the exposure settle (the time taken is measured)
+void
+MainDialog::onTimeToRearm() {
+    QElapsedTimer rearmTime;
+    rearmTime.start();
+    if(pCamera->resume(pJpegEncoder) != MMAL_SUCCESS) {
+        qDebug() << "Unable to enable the camera again";
+        exit(EXIT_FAILURE);
+    }
+    waitForExposure(CAMERA_SETTLE_TIME);
+    double measured = rearmTime.nsecsElapsed()/1.0e6;
+    // Follow the slower re-arms at once, the faster ones slowly
+    if(measured > rearmMs)
+        rearmMs = measured;
+    else
+        rearmMs += 0.25*(measured - rearmMs);
+    if(verbose)
+        qDebug() << QString("Camera re-armed in %1 ms").arg(measured, 0, 'f', 0);
+}
+
+
+/**
+ * Capture hdrFrames exposures centered on the current shutter speed
+ * and hand them over to the HDR worker for fusion and encoding
+ * @param sFileName Output file of the fused frame
+ */
+void
+MainDialog::captureBracket(QString sFileName) {
+    CameraControl* pCameraControl = pCamera->pControl;
+    // In auto exposure: bracket around the exposure the camera has metered
+    int baseSpeed = int(pCamera->exposureUs());
+    if(baseSpeed == 0) {
+        qDebug() << QString("%1: No metered exposure to bracket around, frame skipped").arg(__func__);
+        return;
+    }
+    int bracket = pHdrWorker->acquire();
+    for(int i=0; i<hdrFrames; i++) {
+        double ev = hdrEvStep*(i - 0.5*(hdrFrames-1));
+        pCameraControl->set_shutter_speed(int(baseSpeed*pow(2.0, ev)));
+        if(!pCamera->captureFrame(pHdrWorker->frame(bracket, i), pCamera->frameSize)) {
+            qDebug() << QString("%1: Incomplete bracket, frame discarded").arg(__func__);
+            pHdrWorker->release(bracket);
+            pCameraControl->set_shutter_speed(shutter_speed);
+            return;
+        }
+    }
+    pCameraControl->set_shutter_speed(shutter_speed);
+    pHdrWorker->submit(bracket, sFileName, imageNum);
+}
+
+
+/**
+ * Capture stackFrames exposures, folding each one into the
+ * accumulator as it arrives, then encode the stacked frame
+ * @param sFileName Output file of the stacked frame
+ * @return true if written (to the staging area in staging mode)
+ */
+bool
+MainDialog::captureStack(QString sFileName) {
+    pStacker->reset();
+    int nFrames = burstDepth(stackFrames);
+    for(int i=0; i<nFrames; i++) {
+        if(!pCamera->captureFrame(pStacker)) {
+            qDebug() << QString("%1: Incomplete exposure %2, stack discarded")
+                        .arg(__func__)
+                        .arg(i);
+            return false;
+        }
+    }
+    pStacker->result(stackedFrame.data());
+    if(pPyramidWorker)
+        pPyramidWorker->submit(stackedFrame.data(), sFileName);
+    if(pJpegEncoder->encode(stackedFrame.data(), pCamera->frameSize,
+                            &pCamera->frameWriter, stagedPath(sFileName), nullptr, imageNum) != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(sFileName);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Capture an RGB24 frame and encode it losslessly on the CPU
+ * @param sFileName Output QOI file
+ * @return true if written (to the staging area in staging mode)
+ */
+bool
+MainDialog::captureLossless(QString sFileName) {
+    if(!pCamera->captureFrame(directFrame.data(), pCamera->frameSize)) {
+        qDebug() << QString("%1: Incomplete frame, discarded").arg(__func__);
+        return false;
+    }
+    if(pPyramidWorker)
+        pPyramidWorker->submit(directFrame.data(), sFileName);
+    const std::vector<uint8_t>& encoded = pQoiEncoder->encode(directFrame.data());
+    FrameWriter& writer = pCamera->frameWriter;
+    if(!writer.open(stagedPath(sFileName), imageNum)) {
+        qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(sFileName);
+        return false;
+    }
+    if(writer.write(encoded.data(), uint32_t(encoded.size())) != encoded.size())
+        writer.cancel();
+    if(!writer.close()) {
+        qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(sFileName);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Capture an RGB24 frame, queue its reduced copies
+ * and encode it at full resolution
+ * @param sFileName Output file of the full frame
+ * @return true if written (to the staging area in staging mode)
+ */
+bool
+MainDialog::captureDirect(QString sFileName) {
+    if(!pCamera->captureFrame(directFrame.data(), pCamera->frameSize)) {
+        qDebug() << QString("%1: Incomplete frame, discarded").arg(__func__);
+        return false;
+    }
+    pPyramidWorker->submit(directFrame.data(), sFileName);
+    const std::vector<uint8_t> *pExif = nullptr;
+    if(pCamera->pExifWriter)
+        pExif = &pCamera->pExifWriter->build(imageNum, pCamera->exposureUs());
+    if(pJpegEncoder->encode(directFrame.data(), pCamera->frameSize,
+                            &pCamera->frameWriter, stagedPath(sFileName), pExif, imageNum) != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(sFileName);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Capture a JPEG with the raw Bayer data appended and hand it
+ * over to the raw worker for splitting, unpacking and writing
+ * @param sFileName Output JPEG file
+ */
+void
+MainDialog::captureRaw(QString sFileName) {
+    int index = pRawWorker->acquire();
+    uint32_t length = pCamera->captureEncoded(pRawWorker->buffer(index), pRawWorker->bufferSize(), imageNum);
+    if(length == 0) {
+        qDebug() << QString("%1: Capture failed, frame discarded").arg(__func__);
+        pRawWorker->release(index);
+        return;
+    }
+    pRawWorker->submit(index, length, imageNum, sFileName);
 }
 
 
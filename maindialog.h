@@ -2,11 +2,27 @@
 
 #include <QDialog>
 #include <QTimer>
+#include <QElapsedTimer>
 #include <sys/types.h>
 
 #include "picamera.h"
 #include "preview.h"
 #include "jpegencoder.h"
+#include "hdrworker.h"
+#include "stackaccumulator.h"
+#include "rawworker.h"
+#include "motiondetector.h"
+#include "videoencoder.h"
+#include "framering.h"
+#include "triggercapture.h"
+#include "stagingmover.h"
+#include "ratecontrol.h"
+#include "qoiencoder.h"
+#include "pyramidworker.h"
+#include "latencymodel.h"
+#include "thermalgovernor.h"
+#include "bufferplanner.h"
+#include "runjournal.h"
 
 
 namespace Ui {
@@ -26,6 +42,8 @@ protected:
     void closeEvent(QCloseEvent *event) Q_DECL_OVERRIDE;
     void moveEvent(QMoveEvent *event) Q_DECL_OVERRIDE;
     void restoreSettings();
+    void restorePipelineSettings();
+    bool planBuffers();
     void dumpParameters();
     void switchLampOn();
     void switchLampOff();
@@ -34,10 +52,30 @@ protected:
     bool panTiltInit();
     bool setPan(double cameraPanValue);
     bool setTilt(double cameraTiltValue);
-    void getSensorDefaults(int camera_num, char *camera_name, int *width, int *height);
     MMAL_STATUS_T setupCameraConfiguration();
     void initDefaults();
     int setDefaultParameters();
+    bool startDirectCapture();
+    void stopDirectCapture();
+    void captureBracket(QString sFileName);
+    bool captureStack(QString sFileName);
+    void captureRaw(QString sFileName);
+    bool captureLossless(QString sFileName);
+    bool captureDirect(QString sFileName);
+    bool startPreTrigger();
+    void stopPreTrigger();
+    bool beginOutput();
+    FrameWriter *outputWriter();
+    QString stagedPath(QString sFileName);
+    void startRateControl();
+    void warmUp();
+    void updateCaptureDeadline();
+    int rebuildCount();
+    double exposureMs();
+    void recordLatency(bool bTunnel, double captureMs, double lampMs);
+    void waitForExposure(int msecDelay);
+    void suspendCamera();
+    int burstDepth(int nFrames);
 
 private slots:
     void on_startButton_clicked();
@@ -47,6 +85,8 @@ private slots:
     void on_tTimeEdit_textEdited(const QString &arg1);
     void on_tTimeEdit_editingFinished();
     void onTimeToGetNewImage();
+    void onTimeToRearm();
+    void onThermalCheck();
     void on_pathEdit_textChanged(const QString &arg1);
     void on_pathEdit_editingFinished();
     void on_nameEdit_textChanged(const QString &arg1);
@@ -62,10 +102,29 @@ private:
     PiCamera*       pCamera;
     Preview*        pPreview;
     JpegEncoder*    pJpegEncoder;
+    HdrWorker*      pHdrWorker;
+    StackAccumulator* pStacker;
+    RawWorker*      pRawWorker;
+    MotionDetector* pMotionDetector;
+    VideoEncoder*   pVideoEncoder;
+    FrameRing*      pFrameRing;
+    TriggerCapture* pTriggerCapture;
+    ExifWriter*     pExifWriter;
+    StagingMover*   pStagingMover;
+    RateController* pRateController;
+    QoiEncoder*     pQoiEncoder;
+    PyramidWorker*  pPyramidWorker;
+    AeConvergence*  pAeConvergence;
+    ThermalGovernor* pThermalGovernor;
+    FrameBus*       pStillBus;
+    FrameBus*       pPreviewBus;
+    StreamSink*     pStreamSink;
 
     uint   gpioLEDpin;
     uint   panPin;
     uint   tiltPin;
+    uint   triggerPin;
+    int    triggerCallbackId;
     double cameraPanValue;
     double cameraTiltValue;
     uint   PWMfrequency;     // in Hz
@@ -76,6 +135,67 @@ private:
     int    msecInterval;
     int    secTotTime;
     int    imageNum;
+    int    hdrFrames;        // Exposures per interval (1 = no HDR)
+    double hdrEvStep;        // EV distance between bracketed exposures
+    int    stackFrames;      // Exposures stacked in every frame (1 = no stacking)
+    int    stackMode;        // A StackAccumulator::StackMode
+    std::vector<uint8_t> stackedFrame;
+    bool   rawCapture;       // Keep the Bayer data of every frame
+    int    rawFormat;        // A RawWorker::RawFormat
+    bool   motionDetection;  // Capture on scene changes (msecInterval becomes the max interval)
+    double motionThreshold;  // Fraction of changed blocks that triggers a capture
+    int    motionMinInterval;// in ms, above the LatencyModel one (0 = that one)
+    bool   preTrigger;       // Keep a video ring and flush it on the trigger GPIO
+    int    preTriggerFps;
+    int    ringBudgetMB;     // Memory of the frame ring
+    int    preRollSec;       // Seconds written before the trigger
+    int    postRollSec;      // Seconds written after the trigger
+    FrameRing::TRIGGER_T ringTrigger; // Between the GUI and the pigpiod callback thread
+    bool   triggerMode;      // Capture on the trigger GPIO instead of the interval timer
+    int    triggerDebounceUs;
+    int    triggerMinInterval;// in ms, above the LatencyModel one (0 = that one)
+    bool   exifTags;         // Tag the stills with our own EXIF segment
+    int    flushPolicy;      // A FrameWriter::FlushPolicy
+    int    flushEvery;       // Stills between flushes (FLUSH_EVERY_N)
+    uint   avgFrameSize;     // Measured in the previous runs, in bytes
+    QString sStagingDir;     // RAM staging area (empty = write directly)
+    int    stagingBudgetMB;
+    int    rateControl;      // 0 = fixed quality, 1 = per still target, 2 = run budget
+    int    targetFrameKB;    // Per still target
+    int    runBudgetMB;      // Storage for the whole run (needs a total time)
+    int    minQuality;       // Lowest JPEG quality the rate control may use
+    QString sImageFormat;    // File extension of the stills (jpg, png, bmp, gif, ppm, tga)
+    bool   losslessCapture;  // Encode the stills as QOI on the CPU
+    std::vector<uint8_t> directFrame; // RGB24 still captured on the ARM side
+    bool   pyramidOutput;    // Write web and thumbnail copies next to every still
+    int    outputWidth;      // Size of the tunnelled stills, scaled by the ISP
+    int    outputHeight;     // (0 = sensor frame size)
+    bool   aeConvergence;    // Capture when the exposure has settled instead of after a fixed delay
+    int    aeTolerance;      // Change (in %) of the exposure and AWB gains still considered settled
+    int    aeStableFrames;   // Settled frames in a row before capturing
+    int    aeTimeout;        // Longest wait for the exposure, in ms
+    int    lowPowerInterval; // in ms: longer intervals stop the camera between the stills (0 = never)
+    bool   bLowPower;        // The camera is stopped between the stills of this run
+    double rearmMs;          // Measured time to enable the camera again and settle the exposure
+    bool   thermalGovernor;  // Shed load when the SoC gets hot or throttled
+    double thermalWarm;      // Temperatures of the ThermalGovernor levels, in degrees C
+    double thermalHot;
+    double thermalCritical;
+    int    thermalLevel;     // The ThermalGovernor::Level applied
+    double writeMBps;        // Sustained throughput of the output storage, in MB/s
+    BufferPlanner::PLAN_T bufferPlan; // Memory and buffer depths of the pipeline
+    int    runRebuilds;      // rebuildCount() when the run started
+    RunJournal runJournal;    // Stills of the current run, to resume after a crash
+    bool   bResumePhase;     // The first interval of a resumed run is shortened to its phase
+    bool   frameBus;         // Publish the stills (and the analysed frames) in shared memory
+    int    frameBusSlots;    // Frames kept on every bus
+    int    frameBusSlotKB;   // Largest still published (0 = twice the average still)
+    uint32_t frameBusSlotBytes;
+    QString sStreamOutput;   // Stream the frames to stdout ("-") or a FIFO (empty = no stream)
+    int    streamSource;     // STREAM_STILLS or STREAM_VIDEO (the pre-trigger MJPEG)
+    int    streamBackpressure; // A StreamSink::Backpressure
+    int    streamFraming;    // A StreamSink::Framing
+    int    streamQueue;      // Frames waiting for the consumer
 
     QString sNormalStyle;
     QString sErrorStyle;
@@ -87,6 +207,11 @@ private:
     QString sOutFileName;
 
     QTimer intervalTimer;
+    QTimer rearmTimer;       // Wakes the camera up before the next still (low power mode)
+    QTimer thermalTimer;
+    QElapsedTimer lastCaptureTime;
+    LatencyModel latencyModel;
+    bool bLatencyWarned;     // The run interval is below the measured minimum (reported once)
 
     QPoint dialogPos;
     QPoint videoPos;
@@ -0,0 +1,143 @@
+#include "motiondetector.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+MotionDetector::MotionDetector(int width, int height, uint32_t stride, double areaThreshold)
+    : width(width)
+    , height(height)
+    , stride(stride)
+    , blocksX(width/BLOCK_SIZE)
+    , blocksY(height/BLOCK_SIZE)
+    , areaThreshold(areaThreshold)
+    , bHaveReference(false)
+    , bResync(false)
+    , bMotion(false)
+    , lastChanged(0)
+    , decimation(1)
+    , frameCount(0)
+    , pPreviewBus(nullptr)
+{
+    reference.resize(size_t(stride)*size_t(height));
+}
+
+
+/**
+ * Sum of the absolute differences of a block
+ * @param pA      First block
+ * @param pB      Second block
+ * @param stride  Bytes per row of both the blocks
+ * @return the SAD of the BLOCK_SIZE x BLOCK_SIZE block
+ */
+static uint32_t
+blockSad(const uint8_t *pA, const uint8_t *pB, uint32_t stride) {
+    const int n = MotionDetector::BLOCK_SIZE;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint16x8_t acc = vdupq_n_u16(0);
+    for(int y=0; y<n; y++, pA+=stride, pB+=stride)
+        acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(pA), vld1q_u8(pB)));
+    uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+    return uint32_t(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for(int y=0; y<n; y++, pA+=stride, pB+=stride)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pA)),
+                                              _mm_loadu_si128(reinterpret_cast<const __m128i*>(pB))));
+    return uint32_t(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#else
+    uint32_t sad = 0;
+    for(int y=0; y<n; y++, pA+=stride, pB+=stride)
+        for(int x=0; x<n; x++)
+            sad += uint32_t(abs(pA[x] - pB[x]));
+    return sad;
+#endif
+}
+
+
+/// Number of blocks that differ from the reference frame
+int
+MotionDetector::changedBlocks(const uint8_t *pLuma) {
+    const uint32_t blockThreshold = PIXEL_THRESHOLD*BLOCK_SIZE*BLOCK_SIZE;
+    int nChanged = 0;
+    for(int by=0; by<blocksY; by++) {
+        const size_t rowOffset = size_t(by*BLOCK_SIZE)*stride;
+        for(int bx=0; bx<blocksX; bx++) {
+            const size_t offset = rowOffset + size_t(bx*BLOCK_SIZE);
+            if(blockSad(pLuma+offset, reference.data()+offset, stride) > blockThreshold)
+                nChanged++;
+        }
+    }
+    return nChanged;
+}
+
+
+/// Called from the video port callback with a whole I420 frame
+void
+MotionDetector::consume(const uint8_t *pData, uint32_t offset, uint32_t length) {
+    const size_t lumaSize = reference.size();
+    if(offset != 0 || length < lumaSize)
+        return; // Only complete frames are analysed
+    if(++frameCount % decimation)
+        return;
+    if(bResync.exchange(false))
+        bHaveReference = false;
+    if(bHaveReference) {
+        int nChanged = changedBlocks(pData);
+        lastChanged = nChanged;
+        if(nChanged > areaThreshold*blocksX*blocksY)
+            bMotion = true;
+    }
+    // Compare with the previous frame: slow light changes are not motion
+    memcpy(reference.data(), pData, lumaSize);
+    bHaveReference = true;
+    if(pPreviewBus)
+        pPreviewBus->publish(FrameBus::FRAME_I420,
+                             int(stride),
+                             height,
+                             pData,
+                             std::min(length, uint32_t(lumaSize*3/2)));
+}
+
+
+/// Analyse one frame out of n only (less CPU load, slower detection)
+void
+MotionDetector::setDecimation(int n) {
+    decimation = n > 0 ? n : 1;
+}
+
+
+/// Publish the analysed frames to the other processes (set before the analysis starts)
+void
+MotionDetector::setPreviewBus(FrameBus *pBus) {
+    pPreviewBus = pBus;
+}
+
+
+/// Return whether the scene changed since the last call
+bool
+MotionDetector::takeMotion() {
+    return bMotion.exchange(false);
+}
+
+
+/// Forget the pending motion and take the next frame as the new reference
+/// (the scene changed on purpose, e.g. the lamp has been switched)
+void
+MotionDetector::resync() {
+    bResync = true;
+    bMotion = false;
+}
+
+
+double
+MotionDetector::changedFraction() const {
+    return double(lastChanged)/(blocksX*blocksY);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "picamera.h"
+#include "framebus.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+
+// Detects changes in the scene on the small YUV frames of the camera
+// video port. The luma plane is split in BLOCK_SIZE x BLOCK_SIZE blocks:
+// a block changed when its mean absolute difference from the previous
+// frame exceeds PIXEL_THRESHOLD, the scene changed when the fraction
+// of changed blocks exceeds the area threshold.
+class MotionDetector : public FrameConsumer
+{
+public:
+    MotionDetector(int width, int height, uint32_t stride, double areaThreshold);
+
+public:
+    void consume(const uint8_t *pData, uint32_t offset, uint32_t length) Q_DECL_OVERRIDE;
+    bool takeMotion();
+    void resync();
+    double changedFraction() const;
+    void setDecimation(int n);
+    void setPreviewBus(FrameBus *pBus);
+
+protected:
+    int changedBlocks(const uint8_t *pLuma);
+
+public:
+    static const int BLOCK_SIZE      = 16; /// Side of the compared blocks
+    static const int PIXEL_THRESHOLD = 12; /// Mean absolute luma difference of a changed block
+
+private:
+    int width;
+    int height;
+    uint32_t stride;
+    int blocksX;
+    int blocksY;
+    double areaThreshold;              /// Fraction of changed blocks that triggers a capture
+    std::vector<uint8_t> reference;    /// Luma of the previous analysed frame
+    bool bHaveReference;
+    std::atomic<bool> bResync;         /// Restart from the next frame (set outside the camera callback)
+    std::atomic<bool> bMotion;         /// Set by the camera callback, cleared by takeMotion()
+    std::atomic<int> lastChanged;      /// Changed blocks in the last frame
+    std::atomic<int> decimation;       /// Only one frame out of decimation is analysed
+    int frameCount;                    /// Frames received (camera callback only)
+    FrameBus *pPreviewBus;             /// Publishes the analysed frames (nullptr = none)
+};
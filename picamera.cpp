@@ -10,13 +10,43 @@
 
 // Struct used to pass information in camera still port userdata to callback
 typedef struct {
-    FILE *file_handle;                   /// File handle to write buffer data to.
+    FrameWriter *pWriter;                /// Writes the buffer data to the output file (nullptr = discard)
     VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
     void *pSource;                       /// pointer to our camera in case required in callback
+    uint8_t *pFrame;                     /// Frame buffer to copy the still data to (direct capture only)
+    uint32_t frameSize;                  /// Size of the frame buffer
+    uint32_t frameBytes;                 /// Bytes copied so far in the frame buffer
+    FrameConsumer *pConsumer;            /// Processes the frame in place of the copy (direct capture only)
+    int64_t pts;                         /// Camera timestamp of the frame (MMAL_TIME_UNKNOWN if none)
+    const uint8_t *pExif;                /// APP1 segment to insert after the SOI marker (or nullptr)
+    uint32_t exifLength;                 /// Length of the APP1 segment
+    bool bFrameStart;                    /// No data of the frame received yet
+    uint32_t encodedBytes;               /// Size of the encoded stream received so far (EXIF excluded)
+    uint32_t firstDataUs;                /// vcos_getmicrosecs() at the first encoded data of the frame
 } PORT_USERDATA;
 
 
 static PORT_USERDATA callbackData;
+static PORT_USERDATA stillData;
+static PORT_USERDATA videoData;
+
+
+/**
+ * Write a chunk of the encoded stream to the output file
+ * or to the memory buffer (see PiCamera::captureEncoded())
+ * @return the number of bytes written
+ */
+static uint32_t
+writeEncoded(PORT_USERDATA *pData, const uint8_t *pChunk, uint32_t length) {
+   if(pData->pFrame) {
+      if(length > pData->frameSize - pData->frameBytes)
+         length = pData->frameSize - pData->frameBytes;
+      memcpy(pData->pFrame + pData->frameBytes, pChunk, length);
+      pData->frameBytes += length;
+      return length;
+   }
+   return pData->pWriter->write(pChunk, length);
+}
 
 
 /**
@@ -33,17 +63,36 @@ encoderBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
    // We pass our file handle and other stuff in via the userdata field.
    PORT_USERDATA *pData = reinterpret_cast<PORT_USERDATA *>(port->userdata);
    if(pData) {
+      if(pData->pts == MMAL_TIME_UNKNOWN)
+         pData->pts = buffer->pts;
       uint32_t bytes_written = buffer->length;
-      if(buffer->length && pData->file_handle) {
+      uint32_t bytes_expected = buffer->length;
+      if(buffer->length && (pData->pFrame || pData->pWriter)) {
          mmal_buffer_header_mem_lock(buffer);
-         bytes_written = fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+         const uint8_t *pChunk = buffer->data;
+         uint32_t length = buffer->length;
+         bytes_written = 0;
+         if(pData->pExif && pData->bFrameStart && length >= 2 &&
+            pChunk[0] == 0xFF && pChunk[1] == 0xD8) {
+            // Splice the EXIF segment right after the SOI marker
+            bytes_written += writeEncoded(pData, pChunk, 2);
+            bytes_written += writeEncoded(pData, pData->pExif, pData->exifLength);
+            bytes_expected += pData->exifLength;
+            pChunk += 2;
+            length -= 2;
+         }
+         bytes_written += writeEncoded(pData, pChunk, length);
          mmal_buffer_header_mem_unlock(buffer);
       }
+      if(buffer->length && pData->bFrameStart)
+         pData->firstDataUs = vcos_getmicrosecs();
+      if(buffer->length)
+         pData->bFrameStart = false;
+      pData->encodedBytes += buffer->length;
       // We need to check we wrote what we wanted - it's possible we have run out of storage.
-      if(bytes_written != buffer->length) {
-         qDebug() << QString("Unable to write buffer to file - aborting");
-         complete = 1;
-      }
+      // The writer fails the still at close(): wait for the frame end anyway
+      if(bytes_written != bytes_expected)
+         qDebug() << QString("Unable to write buffer to file");
       // Now flag if we have completed
       if(buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END |
                           MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
@@ -70,10 +119,142 @@ encoderBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
 }
 
 
+/**
+ *  buffer header callback function for the camera still port
+ *  when it is not tunnelled to the encoder
+ *
+ *  Callback will copy buffer data to the frame buffer
+ *  or hand it over to the frame consumer
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+void
+stillBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    int complete = 0;
+    PORT_USERDATA *pData = reinterpret_cast<PORT_USERDATA *>(port->userdata);
+    if(buffer->length && pData->pConsumer) {
+        mmal_buffer_header_mem_lock(buffer);
+        pData->pConsumer->consume(buffer->data, pData->frameBytes, buffer->length);
+        mmal_buffer_header_mem_unlock(buffer);
+        pData->frameBytes += buffer->length;
+    }
+    else if(buffer->length && pData->pFrame) {
+        uint32_t bytes = buffer->length;
+        if(bytes > pData->frameSize - pData->frameBytes)
+            bytes = pData->frameSize - pData->frameBytes;
+        mmal_buffer_header_mem_lock(buffer);
+        memcpy(pData->pFrame + pData->frameBytes, buffer->data, bytes);
+        mmal_buffer_header_mem_unlock(buffer);
+        pData->frameBytes += bytes;
+    }
+    if(buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END |
+                        MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
+        complete = 1;
+    mmal_buffer_header_release(buffer);
+    if(port->is_enabled) {
+        PiCamera* pCamera = reinterpret_cast<PiCamera*>(pData->pSource);
+        MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pCamera->pool->queue);
+        if(!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            qDebug() << QString("Unable to return a buffer to the still port");
+    }
+    if(complete)
+        vcos_semaphore_post(&(pData->complete_semaphore));
+}
+
+
+/**
+ *  buffer header callback function for the camera video port
+ *
+ *  Every buffer holds a whole low resolution YUV frame:
+ *  hand it over to the frame consumer
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+void
+videoBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    PORT_USERDATA *pData = reinterpret_cast<PORT_USERDATA *>(port->userdata);
+    if(buffer->length && pData->pConsumer) {
+        mmal_buffer_header_mem_lock(buffer);
+        pData->pConsumer->consume(buffer->data, 0, buffer->length);
+        mmal_buffer_header_mem_unlock(buffer);
+    }
+    mmal_buffer_header_release(buffer);
+    if(port->is_enabled) {
+        PiCamera* pCamera = reinterpret_cast<PiCamera*>(pData->pSource);
+        MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pCamera->videoPool->queue);
+        if(!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            qDebug() << QString("Unable to return a buffer to the video port");
+    }
+}
+
+
+static double
+rationalValue(MMAL_RATIONAL_T value) {
+    return value.den ? double(value.num)/double(value.den) : 0.0;
+}
+
+
+/**
+ *  Callback function for the camera control port
+ *
+ *  The camera settings reported with every frame are
+ *  passed to the exposure convergence detector
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+void
+cameraControlCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    PiCamera* pCamera = reinterpret_cast<PiCamera*>(port->userdata);
+    if(buffer->cmd == MMAL_EVENT_PARAMETER_CHANGED) {
+        MMAL_EVENT_PARAMETER_CHANGED_T *pEvent = reinterpret_cast<MMAL_EVENT_PARAMETER_CHANGED_T *>(buffer->data);
+        if(pEvent->hdr.id == MMAL_PARAMETER_CAMERA_SETTINGS && pCamera->pAeConvergence) {
+            MMAL_PARAMETER_CAMERA_SETTINGS_T *pSettings = reinterpret_cast<MMAL_PARAMETER_CAMERA_SETTINGS_T *>(pEvent);
+            pCamera->pAeConvergence->update(pSettings->exposure,
+                                            rationalValue(pSettings->analog_gain),
+                                            rationalValue(pSettings->digital_gain),
+                                            rationalValue(pSettings->awb_red_gain),
+                                            rationalValue(pSettings->awb_blue_gain));
+        }
+    }
+    else if(buffer->cmd == MMAL_EVENT_ERROR) {
+        qDebug() << QString("Camera control error: %1").arg(*reinterpret_cast<MMAL_STATUS_T *>(buffer->data));
+    }
+    mmal_buffer_header_release(buffer);
+}
+
+
 PiCamera::PiCamera(int cameraNum, int sensorMode)
     : component(nullptr)
     , pool(nullptr)
+    , videoPool(nullptr)
+    , frameWidth(0)
+    , frameHeight(0)
+    , frameStride(0)
+    , frameSize(0)
+    , rawCapture(false)
+    , videoWidth(0)
+    , videoHeight(0)
+    , videoFrameRate(5)
+    , videoBufferNum(0)
+    , videoEncoding(MMAL_ENCODING_I420)
+    , pExifWriter(nullptr)
+    , pAeConvergence(nullptr)
+    , outputWidth(0)
+    , outputHeight(0)
+    , captureTimeoutMs(0)
     , previewConnection(nullptr)
+    , encoderConnection(nullptr)
+    , videoConnection(nullptr)
+    , resizer(nullptr)
+    , resizerConnection(nullptr)
+    , timing({ 0, 0, 0 })
+    , bSuspended(false)
+    , pStartedEncoder(nullptr)
+    , nRebuilds(0)
+    , rebuildUs(0)
 {
     if(createComponent(cameraNum, sensorMode) != MMAL_SUCCESS)
         exit(EXIT_FAILURE);
@@ -81,6 +262,9 @@ PiCamera::PiCamera(int cameraNum, int sensorMode)
     VCOS_STATUS_T vcos_status = vcos_semaphore_create(&callbackData.complete_semaphore, "RaspiStill-sem", 0);
     if(vcos_status != VCOS_SUCCESS)
         exit(EXIT_FAILURE);
+    vcos_status = vcos_semaphore_create(&stillData.complete_semaphore, "RaspiStill-direct-sem", 0);
+    if(vcos_status != VCOS_SUCCESS)
+        exit(EXIT_FAILURE);
 }
 
 
@@ -128,8 +312,24 @@ PiCamera::createComponent(int cameraNum, int sensorMode) {
             mmal_component_destroy(component);
             component = nullptr;
         }
+        return status;
     }
-    return status;
+    // The settings of every frame are reported on the control port (see pAeConvergence)
+    component->control->userdata = reinterpret_cast<struct MMAL_PORT_USERDATA_T *>(this);
+    status = mmal_port_enable(component->control, cameraControlCallback);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to enable control port : error %1").arg(status);
+        mmal_component_destroy(component);
+        component = nullptr;
+        return status;
+    }
+    MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request = {
+        {MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)},
+        MMAL_PARAMETER_CAMERA_SETTINGS, 1
+    };
+    if(mmal_port_parameter_set(component->control, &change_event_request.hdr) != MMAL_SUCCESS)
+        qDebug() << QString("No camera settings events");
+    return MMAL_SUCCESS;
 }
 
 
@@ -144,10 +344,13 @@ PiCamera::destroyComponent() {
         MMAL_PORT_T *still_port = component->output[MMAL_CAMERA_CAPTURE_PORT];
         if(pool)
             mmal_port_pool_destroy(still_port, pool);
+        if(videoPool)
+            mmal_port_pool_destroy(component->output[MMAL_CAMERA_VIDEO_PORT], videoPool);
         mmal_component_destroy(component);
     }
     component = nullptr;
     pool = nullptr;
+    videoPool = nullptr;
 }
 
 
@@ -211,6 +414,43 @@ PiCamera::setPortFormats(bool fullResPreview,
         mmal_component_destroy(component);
         return status;
     }
+// The Video Port carries the analysis or the pre-trigger stream (if any)
+    if(videoWidth > 0 && videoHeight > 0) {
+        MMAL_PORT_T *videoPort = component->output[MMAL_CAMERA_VIDEO_PORT];
+        format = videoPort->format;
+        format->encoding = videoEncoding;
+        format->encoding_variant = MMAL_ENCODING_I420;
+        if(pControl->get_shutter_speed() > 6000000) {
+            MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
+                                                    { 50, 1000 },
+                                                    {166, 1000}
+                                                   };
+            mmal_port_parameter_set(videoPort, &fps_range.hdr);
+        }
+        else if(pControl->get_shutter_speed() > 1000000) {
+            MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
+                                                    { 166, 1000 },
+                                                    {999, 1000}
+                                                   };
+            mmal_port_parameter_set(videoPort, &fps_range.hdr);
+        }
+        format->es->video.width = uint32_t(MY_VCOS_ALIGN_UP(videoWidth, 32));
+        format->es->video.height = uint32_t(MY_VCOS_ALIGN_UP(videoHeight, 16));
+        format->es->video.crop = MMAL_RECT_T {0, 0, videoWidth, videoHeight};
+        format->es->video.frame_rate.num = videoFrameRate;
+        format->es->video.frame_rate.den = 1;
+        status = mmal_port_format_commit(videoPort);
+        if(status != MMAL_SUCCESS ) {
+            qDebug() << QString("camera video format couldn't be set");
+            mmal_component_destroy(component);
+            return status;
+        }
+        videoPort->buffer_size = videoPort->buffer_size_recommended;
+        videoPort->buffer_num = videoBufferNum ? videoBufferNum
+                                               : videoPort->buffer_num_recommended;
+        if(videoPort->buffer_num < videoPort->buffer_num_min)
+            videoPort->buffer_num = videoPort->buffer_num_min;
+    }
 // Now set up the Still Port
     format = stillPort->format;
     if(pControl->get_shutter_speed() > 6000000) {
@@ -227,8 +467,13 @@ PiCamera::setPortFormats(bool fullResPreview,
         mmal_port_parameter_set(stillPort, &fps_range.hdr);
     }
 // Set our format on the Stills Port
-    encoding = MMAL_ENCODING_RGB24;
-    if(encoding) {
+    // The raw Bayer data travels attached to the opaque image handles
+    encoding = rawCapture ? MMAL_ENCODING_OPAQUE : MMAL_ENCODING_RGB24;
+    if(encoding == MMAL_ENCODING_OPAQUE) {
+        format->encoding = MMAL_ENCODING_OPAQUE;
+        format->encoding_variant = MMAL_ENCODING_I420;
+    }
+    else if(encoding) {
         format->encoding = encoding;
         if(!mmal_util_rgb_order_fixed(stillPort)) {
             if(format->encoding == MMAL_ENCODING_RGB24)
@@ -259,6 +504,18 @@ PiCamera::setPortFormats(bool fullResPreview,
         mmal_component_destroy(component);
         return status;
     }
+    if(rawCapture) {
+        status = mmal_port_parameter_set_boolean(stillPort, MMAL_PARAMETER_ENABLE_RAW_CAPTURE, 1);
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("%1: Failed to enable the raw capture").arg(__func__);
+            rawCapture = false;
+        }
+    }
+    // Geometry of the frames seen on the ARM side when the still port is not tunnelled
+    frameWidth  = width;
+    frameHeight = height;
+    frameStride = uint32_t(MY_VCOS_ALIGN_UP(width, 32)) * 3;
+    frameSize   = frameStride * uint32_t(MY_VCOS_ALIGN_UP(height, 16));
 
     return MMAL_SUCCESS;
 }
@@ -311,9 +568,33 @@ PiCamera::startPreview(Preview *pPreview) {
 
 MMAL_STATUS_T
 PiCamera::start(JpegEncoder *pEncoder) {
+    pStartedEncoder = pEncoder;
+    MMAL_STATUS_T status = connectEncoder(pEncoder);
+    if(status != MMAL_SUCCESS)
+        exit(EXIT_FAILURE);
+    return status;
+}
+
+
+/**
+ * Connect the still port (through the ISP stage if any)
+ * to the encoder and enable the encoder output
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::connectEncoder(JpegEncoder *pEncoder) {
     MMAL_STATUS_T status;
     MMAL_PORT_T* cameraStillPort   = component->output[MMAL_CAMERA_CAPTURE_PORT];
     MMAL_PORT_T* encoderInputPort  = pEncoder->pComponent->input[0];
+    // The opaque raw stills cannot go through the ISP
+    if(outputWidth > 0 && outputHeight > 0 && !rawCapture) {
+        status = createResizer();
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("%1: Failed to insert the ISP stage").arg(__func__);
+            return status;
+        }
+        cameraStillPort = resizer->output[0];
+    }
     if(verbose)
        qDebug() << QString("Connecting Camera Stills port to Encoder Input port");
     // Now connect the camera to the encoder
@@ -321,42 +602,234 @@ PiCamera::start(JpegEncoder *pEncoder) {
     if(status != MMAL_SUCCESS) {
        qDebug() << QString("%1: Failed to connect camera video port to encoder input")
                    .arg(__func__);
-       exit(EXIT_FAILURE);
+       encoderConnection = nullptr;
+       return status;
     }
     // Enable the encoder output port
     MMAL_PORT_T* encoderOutputPort = pEncoder->pComponent->output[0];
     if(verbose)
        qDebug() << QString("Enabling encoder output port");
     // Set up our userdata passed through to the callback
-    callbackData.file_handle  = nullptr; // Null until we open our filename
+    callbackData.pWriter      = nullptr; // Null until we open our filename
     callbackData.pSource      = pEncoder;
+    callbackData.pFrame       = nullptr;
+    callbackData.pConsumer    = nullptr;
+    callbackData.pExif        = nullptr;
+    // Our own EXIF segment replaces the one of the encoder
+    if(pEncoder->encoding == MMAL_ENCODING_JPEG &&
+       mmal_port_parameter_set_boolean(encoderOutputPort, MMAL_PARAMETER_EXIF_DISABLE,
+                                       pExifWriter ? MMAL_TRUE : MMAL_FALSE) != MMAL_SUCCESS)
+        qDebug() << QString("%1: Unable to configure the encoder EXIF").arg(__func__);
     encoderOutputPort->userdata = reinterpret_cast<struct MMAL_PORT_USERDATA_T *>(&callbackData);
     // Enable the Encoder output port and tell it its callback function
-    status = mmal_port_enable(encoderOutputPort, encoderBufferCallback);
-    if(status != MMAL_SUCCESS) {
+    status = pEncoder->enableOutput(encoderBufferCallback);
+    if(status != MMAL_SUCCESS)
         qDebug() << QString("Failed to setup camera output");
-        exit(EXIT_FAILURE);
+    return status;
+}
+
+
+/**
+ * Wait for the end of a capture
+ * @param pSemaphore Posted by the buffer callback at the end of the frame
+ * @return false if the frame did not arrive within captureTimeoutMs
+ */
+bool
+PiCamera::waitCapture(VCOS_SEMAPHORE_T *pSemaphore) {
+    if(captureTimeoutMs == 0) {
+        vcos_semaphore_wait(pSemaphore);
+        return true;
     }
-    // Send all the buffers to the encoder output port
-    uint32_t num = mmal_queue_length(pEncoder->pool->queue);
-    for(uint32_t q=0; q<num; q++) {
-        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(pEncoder->pool->queue);
-        if(!buffer)
-            qDebug() << QString("Unable to get a required buffer %1 from pool queue")
-                        .arg(q);
-        status = mmal_port_send_buffer(encoderOutputPort, buffer);
-        if(status != MMAL_SUCCESS) {
-            mmal_status_to_int(status);
-            qDebug() << QString("%1: Unable to send a buffer to encoder output port (%2)")
-                        .arg(__func__)
-                        .arg(q);
-            exit(EXIT_FAILURE);
-        }
+    return vcos_semaphore_wait_timeout(pSemaphore, captureTimeoutMs) == VCOS_SUCCESS;
+}
+
+
+/**
+ * Tear down and connect again the still port and the encoder after a
+ * capture that never completed (a buffer lost somewhere in the pipeline).
+ * The camera and the preview keep running: only the frame is lost.
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::rebuild() {
+    uint32_t startUs = vcos_getmicrosecs();
+    JpegEncoder *pEncoder = pStartedEncoder;
+    callbackData.pWriter   = nullptr;
+    callbackData.pFrame    = nullptr;
+    callbackData.pConsumer = nullptr;
+    MMAL_PORT_T *encoderOutputPort = pEncoder->pComponent->output[0];
+    if(encoderOutputPort->is_enabled)
+        mmal_port_disable(encoderOutputPort);
+    if(encoderConnection) {
+        mmal_connection_destroy(encoderConnection);
+        encoderConnection = nullptr;
     }
+    if(resizer) {
+        mmal_connection_destroy(resizerConnection);
+        resizerConnection = nullptr;
+        mmal_component_destroy(resizer);
+        resizer = nullptr;
+    }
+    // Drop the half encoded frame
+    mmal_component_disable(pEncoder->pComponent);
+    mmal_component_enable(pEncoder->pComponent);
+    // A completion arriving late must not end the next capture
+    while(vcos_semaphore_trywait(&callbackData.complete_semaphore) == VCOS_SUCCESS) {}
+    MMAL_STATUS_T status = connectEncoder(pEncoder);
+    rebuildUs = vcos_getmicrosecs() - startUs;
+    nRebuilds++;
+    qDebug() << QString("%1: Capture timed out after %2 ms, pipeline rebuilt in %3 ms (%4 so far)%5")
+                .arg(__func__)
+                .arg(captureTimeoutMs)
+                .arg(rebuildUs/1000.0, 0, 'f', 1)
+                .arg(nRebuilds)
+                .arg(status == MMAL_SUCCESS ? QString() : QString(": FAILED"));
+    return status;
+}
+
+
+/**
+ * As rebuild() for the direct path: give the still port
+ * its buffers back after a frame that never completed
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::rebuildDirect() {
+    uint32_t startUs = vcos_getmicrosecs();
+    stillData.pFrame    = nullptr;
+    stillData.pConsumer = nullptr;
+    MMAL_PORT_T* cameraStillPort = component->output[MMAL_CAMERA_CAPTURE_PORT];
+    if(cameraStillPort->is_enabled)
+        mmal_port_disable(cameraStillPort);
+    while(vcos_semaphore_trywait(&stillData.complete_semaphore) == VCOS_SUCCESS) {}
+    MMAL_STATUS_T status = startDirect();
+    rebuildUs = vcos_getmicrosecs() - startUs;
+    nRebuilds++;
+    qDebug() << QString("%1: Capture timed out after %2 ms, still port rebuilt in %3 ms (%4 so far)%5")
+                .arg(__func__)
+                .arg(captureTimeoutMs)
+                .arg(rebuildUs/1000.0, 0, 'f', 1)
+                .arg(nRebuilds)
+                .arg(status == MMAL_SUCCESS ? QString() : QString(": FAILED"));
     return status;
 }
 
 
+/// Pipeline rebuilds after lost frames since the camera was created
+int
+PiCamera::rebuildCount() {
+    return nRebuilds;
+}
+
+
+/// Duration of the last rebuild, in us
+uint32_t
+PiCamera::lastRebuildUs() {
+    return rebuildUs;
+}
+
+
+/**
+ * Exposure time of the next still: the shutter speed, or in auto exposure
+ * the one the camera reported for the last preview frame
+ * @return the exposure in us (0 if the camera has reported none yet, or without pAeConvergence)
+ */
+uint32_t
+PiCamera::exposureUs() {
+    uint32_t speed = uint32_t(pControl->get_shutter_speed());
+    if(speed == 0 && pAeConvergence)
+        speed = pAeConvergence->exposure();
+    return speed;
+}
+
+
+/**
+ * Cap the frame rate of the preview port while running
+ * (the long exposures keep the range set by setPortFormats())
+ * @param maxFps Highest frame rate (0 = no cap)
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::limitPreviewFrameRate(int maxFps) {
+    std::lock_guard<std::mutex> lock(accessMutex);
+    if(pControl->get_shutter_speed() > 1000000)
+        return MMAL_SUCCESS;
+    MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
+                                            { 166, 1000 },
+                                            { maxFps > 0 ? maxFps : 999, 1 }
+                                           };
+    return mmal_port_parameter_set(component->output[MMAL_CAMERA_PREVIEW_PORT], &fps_range.hdr);
+}
+
+
+/**
+ * Stop the sensor, the preview and the encoder between two stills
+ * (low power mode of the long intervals). The components, connections
+ * and pools are kept: resume() only has to enable them again.
+ * Tunnelled path only (see start()).
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::suspend(JpegEncoder *pEncoder) {
+    std::lock_guard<std::mutex> lock(accessMutex);
+    if(bSuspended)
+        return MMAL_SUCCESS;
+    if(previewConnection)
+        mmal_connection_disable(previewConnection);
+    mmal_connection_disable(encoderConnection);
+    if(resizerConnection)
+        mmal_connection_disable(resizerConnection);
+    if(previewConnection)
+        mmal_component_disable(previewConnection->in->component);
+    if(resizer)
+        mmal_component_disable(resizer);
+    mmal_component_disable(pEncoder->pComponent);
+    MMAL_STATUS_T status = mmal_component_disable(component);
+    if(status != MMAL_SUCCESS)
+        qDebug() << QString("%1: Unable to disable the camera").arg(__func__);
+    bSuspended = true;
+    return status;
+}
+
+
+/**
+ * Enable again what suspend() has stopped
+ * (the exposure has to settle again before capturing)
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::resume(JpegEncoder *pEncoder) {
+    std::lock_guard<std::mutex> lock(accessMutex);
+    if(!bSuspended)
+        return MMAL_SUCCESS;
+    MMAL_STATUS_T status = mmal_component_enable(component);
+    if(status == MMAL_SUCCESS)
+        status = mmal_component_enable(pEncoder->pComponent);
+    if(status == MMAL_SUCCESS && resizer)
+        status = mmal_component_enable(resizer);
+    if(status == MMAL_SUCCESS && previewConnection)
+        status = mmal_component_enable(previewConnection->in->component);
+    if(status == MMAL_SUCCESS && resizerConnection)
+        status = mmal_connection_enable(resizerConnection);
+    if(status == MMAL_SUCCESS)
+        status = mmal_connection_enable(encoderConnection);
+    if(status == MMAL_SUCCESS && previewConnection)
+        status = mmal_connection_enable(previewConnection);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Unable to enable the pipeline again").arg(__func__);
+        return status;
+    }
+    bSuspended = false;
+    return status;
+}
+
+
+bool
+PiCamera::isSuspended() const {
+    return bSuspended;
+}
+
+
 /**
  * Connect two specific ports together
  * @param output_port Pointer the output port
@@ -420,6 +893,7 @@ PiCamera::checkDisablePort(MMAL_PORT_T *port) {
 
 void
 PiCamera::stop(JpegEncoder *pEncoder) {
+    pStartedEncoder = nullptr;
     MMAL_PORT_T* encoderOutputPort = pEncoder->pComponent->output[0];
     checkDisablePort(encoderOutputPort);
     MMAL_STATUS_T status = mmal_connection_release(encoderConnection);
@@ -428,15 +902,100 @@ PiCamera::stop(JpegEncoder *pEncoder) {
                    .arg(__func__);
        exit(EXIT_FAILURE);
     }
+    if(resizer) {
+        mmal_connection_destroy(resizerConnection);
+        resizerConnection = nullptr;
+        mmal_component_destroy(resizer);
+        resizer = nullptr;
+    }
     if(verbose)
         qDebug() << QString("Disabling camera still output port");
 }
 
 
+/**
+ * Create the ISP stage that scales the stills on their way to the encoder
+ * and connect the still port to it. The camera keeps producing the frames
+ * of the sensor mode (full field of view) while the encoder receives
+ * outputWidth x outputHeight I420 frames: no pixel goes through the ARM.
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::createResizer() {
+    MMAL_STATUS_T status;
+    status = mmal_component_create("vc.ril.isp", &resizer);
+    if(status != MMAL_SUCCESS) // Older firmware
+        status = mmal_component_create("vc.ril.resize", &resizer);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to create the resize component");
+        resizer = nullptr;
+        return status;
+    }
+    MMAL_PORT_T *cameraStillPort = component->output[MMAL_CAMERA_CAPTURE_PORT];
+    MMAL_PORT_T *inputPort  = resizer->input[0];
+    MMAL_PORT_T *outputPort = resizer->output[0];
+    // The input takes the stills as they are
+    mmal_format_copy(inputPort->format, cameraStillPort->format);
+    inputPort->buffer_num = inputPort->buffer_num_recommended;
+    status = mmal_port_format_commit(inputPort);
+    if(status == MMAL_SUCCESS) {
+        mmal_format_copy(outputPort->format, inputPort->format);
+        outputPort->format->encoding = MMAL_ENCODING_I420;
+        outputPort->format->encoding_variant = MMAL_ENCODING_I420;
+        outputPort->format->es->video.width  = uint32_t(MY_VCOS_ALIGN_UP(outputWidth, 32));
+        outputPort->format->es->video.height = uint32_t(MY_VCOS_ALIGN_UP(outputHeight, 16));
+        outputPort->format->es->video.crop.x = 0;
+        outputPort->format->es->video.crop.y = 0;
+        outputPort->format->es->video.crop.width  = outputWidth;
+        outputPort->format->es->video.crop.height = outputHeight;
+        outputPort->buffer_num  = outputPort->buffer_num_recommended;
+        outputPort->buffer_size = outputPort->buffer_size_recommended;
+        status = mmal_port_format_commit(outputPort);
+    }
+    if(status == MMAL_SUCCESS)
+        status = mmal_component_enable(resizer);
+    if(status == MMAL_SUCCESS)
+        status = connectPorts(cameraStillPort, inputPort, &resizerConnection);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Unable to set up the resize component (%2x%3)")
+                    .arg(__func__)
+                    .arg(outputWidth)
+                    .arg(outputHeight);
+        mmal_component_destroy(resizer);
+        resizer = nullptr;
+    }
+    return status;
+}
+
+
+/**
+ * Build the EXIF segment of the next frame (if EXIF tagging is enabled)
+ * @param frameNumber Frame index in the run
+ */
 void
-PiCamera::capture(QString sPathName) {
-    FILE *output_file = fopen(sPathName.toLatin1(), "wb");
-    if (!output_file) {
+PiCamera::prepareExif(int frameNumber) {
+    callbackData.bFrameStart = true;
+    callbackData.pExif = nullptr;
+    if(pExifWriter) {
+        // In auto exposure: the one metered on the last preview frame
+        const std::vector<uint8_t>& segment = pExifWriter->build(frameNumber, exposureUs());
+        callbackData.pExif      = segment.data();
+        callbackData.exifLength = uint32_t(segment.size());
+    }
+}
+
+
+/**
+ * Capture a still to a file through the encoder (see start())
+ * @param sPathName   Output file
+ * @param frameNumber Frame index in the run (-1 = not journaled)
+ * @return false if the frame has been lost (see captureTimeoutMs)
+ */
+bool
+PiCamera::capture(QString sPathName, int frameNumber) {
+    std::lock_guard<std::mutex> lock(accessMutex);
+    bool bOpen = frameWriter.open(sPathName, frameNumber);
+    if (!bOpen) {
 // Notify user, carry on but discarding encoded output buffers
         qDebug() << QString("%1: Error opening output file: %2\nNo output file will be generated")
                     .arg(__func__)
@@ -446,19 +1005,305 @@ PiCamera::capture(QString sPathName) {
         if(verbose)
            qDebug() << "Writing" << sPathName;
     }
-    callbackData.file_handle = output_file;
+    callbackData.pWriter = bOpen ? &frameWriter : nullptr;
+    callbackData.pts = MMAL_TIME_UNKNOWN;
+    callbackData.encodedBytes = 0;
+    prepareExif(frameNumber);
     MMAL_PORT_T* cameraStillPort = component->output[MMAL_CAMERA_CAPTURE_PORT];
     if (verbose)
         qDebug() << QString("Starting capture...");
+    timing = { 0, 0, 0 };
+    uint32_t startUs = vcos_getmicrosecs();
+    callbackData.firstDataUs = startUs;
+    bool bDone = false;
     if (mmal_port_parameter_set_boolean(cameraStillPort, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
         qDebug() << QString("%1: Failed to start capture").arg(__func__);
     }
     else {
 // Wait for capture to complete
-        vcos_semaphore_wait(&callbackData.complete_semaphore);
-        if(verbose)
+        bDone = waitCapture(&callbackData.complete_semaphore);
+        if(verbose && bDone)
             qDebug() << QString("Capture Done !");
     }
-    fflush(output_file);
+    uint32_t endUs = vcos_getmicrosecs();
+    callbackData.pWriter = nullptr;
+    if(!bDone && pStartedEncoder)
+        rebuild();
+    if(!bDone) // Not published nor streamed either
+        frameWriter.cancel();
+    if(bOpen && !frameWriter.close()) // Not left behind truncated either
+        qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(sPathName);
+    timing.startUs  = callbackData.firstDataUs - startUs;
+    timing.encodeUs = endUs - callbackData.firstDataUs;
+    timing.writeUs  = vcos_getmicrosecs() - endUs;
+    return bDone;
+}
+
+
+/**
+ * Capture an encoded still into ARM memory instead of a file
+ * (the encoder must have been connected with start())
+ * @param pBuffer     Destination buffer
+ * @param size        Size of the destination buffer
+ * @param frameNumber Frame index in the run
+ * @return the length of the encoded stream (0 on failure)
+ */
+uint32_t
+PiCamera::captureEncoded(uint8_t *pBuffer, uint32_t size, int frameNumber) {
+    std::lock_guard<std::mutex> lock(accessMutex);
+    callbackData.pWriter     = nullptr;
+    callbackData.pFrame      = pBuffer;
+    callbackData.frameSize   = size;
+    callbackData.frameBytes  = 0;
+    callbackData.pts         = MMAL_TIME_UNKNOWN;
+    callbackData.encodedBytes= 0;
+    prepareExif(frameNumber);
+    MMAL_PORT_T* cameraStillPort = component->output[MMAL_CAMERA_CAPTURE_PORT];
+    timing = { 0, 0, 0 };
+    uint32_t startUs = vcos_getmicrosecs();
+    callbackData.firstDataUs = startUs;
+    if(mmal_port_parameter_set_boolean(cameraStillPort, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Failed to start capture").arg(__func__);
+        callbackData.pFrame = nullptr;
+        return 0;
+    }
+    if(!waitCapture(&callbackData.complete_semaphore)) {
+        callbackData.pFrame = nullptr;
+        if(pStartedEncoder)
+            rebuild();
+        return 0;
+    }
+    timing.startUs  = callbackData.firstDataUs - startUs;
+    timing.encodeUs = vcos_getmicrosecs() - callbackData.firstDataUs;
+    callbackData.pFrame = nullptr;
+    if(callbackData.frameBytes == size)
+        qDebug() << QString("%1: Encoded stream truncated to %2 bytes").arg(__func__).arg(size);
+    return callbackData.frameBytes;
+}
+
+
+
+/// Camera timestamp (STC, in us) of the last encoded capture, MMAL_TIME_UNKNOWN if none
+int64_t
+PiCamera::lastCapturePts() {
+    return callbackData.pts;
+}
+
+
+/// Size of the encoder output of the last capture (the EXIF segment we splice is not counted)
+uint32_t
+PiCamera::lastCaptureBytes() {
+    return callbackData.encodedBytes;
 }
 
+
+/// Where the time of the last capture() or captureEncoded() went
+PiCamera::CAPTURE_TIMING_T
+PiCamera::lastCaptureTiming() {
+    return timing;
+}
+
+
+/**
+ * Enable the still port with a callback that copies the frames
+ * to ARM memory (see captureFrame()). Used instead of start()
+ * when the frames must be processed before being encoded.
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::startDirect() {
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+    MMAL_PORT_T* cameraStillPort = component->output[MMAL_CAMERA_CAPTURE_PORT];
+    if(!pool)
+        createBufferPool();
+    if(!pool)
+        return MMAL_ENOMEM;
+    stillData.pWriter     = nullptr;
+    stillData.pSource     = this;
+    stillData.pFrame      = nullptr;
+    stillData.pConsumer   = nullptr;
+    cameraStillPort->userdata = reinterpret_cast<struct MMAL_PORT_USERDATA_T *>(&stillData);
+    status = mmal_port_enable(cameraStillPort, stillBufferCallback);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Failed to enable the camera still port").arg(__func__);
+        return status;
+    }
+    // Send all the buffers to the camera still port
+    uint32_t num = mmal_queue_length(pool->queue);
+    for(uint32_t q=0; q<num; q++) {
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(pool->queue);
+        if(!buffer)
+            qDebug() << QString("Unable to get a required buffer %1 from pool queue")
+                        .arg(q);
+        status = mmal_port_send_buffer(cameraStillPort, buffer);
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("%1: Unable to send a buffer to camera still port (%2)")
+                        .arg(__func__)
+                        .arg(q);
+            return status;
+        }
+    }
+    return status;
+}
+
+
+void
+PiCamera::stopDirect() {
+    checkDisablePort(component->output[MMAL_CAMERA_CAPTURE_PORT]);
+}
+
+
+/**
+ * Capture a still frame into ARM memory (startDirect() must have been called)
+ * @param pFrame Destination buffer
+ * @param size   Size of the destination buffer (at least frameSize)
+ * @return true if a complete frame has been received
+ */
+bool
+PiCamera::captureFrame(uint8_t *pFrame, uint32_t size) {
+    std::lock_guard<std::mutex> lock(accessMutex);
+    stillData.pFrame     = pFrame;
+    stillData.frameSize  = size;
+    stillData.frameBytes = 0;
+    MMAL_PORT_T* cameraStillPort = component->output[MMAL_CAMERA_CAPTURE_PORT];
+    if(mmal_port_parameter_set_boolean(cameraStillPort, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Failed to start capture").arg(__func__);
+        stillData.pFrame = nullptr;
+        return false;
+    }
+    if(!waitCapture(&stillData.complete_semaphore)) {
+        rebuildDirect();
+        return false;
+    }
+    stillData.pFrame = nullptr;
+    return stillData.frameBytes >= frameSize;
+}
+
+
+/**
+ * Capture a still frame handing it over, buffer by buffer,
+ * to a frame consumer (startDirect() must have been called)
+ * @param pConsumer The frame consumer
+ * @return true if a complete frame has been received
+ */
+bool
+PiCamera::captureFrame(FrameConsumer *pConsumer) {
+    std::lock_guard<std::mutex> lock(accessMutex);
+    stillData.pConsumer  = pConsumer;
+    stillData.frameBytes = 0;
+    MMAL_PORT_T* cameraStillPort = component->output[MMAL_CAMERA_CAPTURE_PORT];
+    if(mmal_port_parameter_set_boolean(cameraStillPort, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Failed to start capture").arg(__func__);
+        stillData.pConsumer = nullptr;
+        return false;
+    }
+    if(!waitCapture(&stillData.complete_semaphore)) {
+        rebuildDirect();
+        return false;
+    }
+    stillData.pConsumer = nullptr;
+    return stillData.frameBytes >= frameSize;
+}
+
+
+/**
+ * Stream the low resolution YUV frames of the video port
+ * to a frame consumer (videoWidth and videoHeight must
+ * have been set before setPortFormats(), with I420 encoding)
+ * @param pConsumer The frame consumer (called from the MMAL thread)
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::startAnalysis(FrameConsumer *pConsumer) {
+    MMAL_STATUS_T status = MMAL_SUCCESS;
+    MMAL_PORT_T* cameraVideoPort = component->output[MMAL_CAMERA_VIDEO_PORT];
+    if(videoWidth <= 0 || videoHeight <= 0)
+        return MMAL_EINVAL;
+    if(!videoPool) {
+        videoPool = mmal_port_pool_create(cameraVideoPort,
+                                          cameraVideoPort->buffer_num,
+                                          cameraVideoPort->buffer_size);
+        if(!videoPool) {
+            qDebug() << QString("Failed to create buffer header pool for camera video port %1")
+                        .arg(cameraVideoPort->name);
+            return MMAL_ENOMEM;
+        }
+    }
+    videoData.pWriter     = nullptr;
+    videoData.pSource     = this;
+    videoData.pFrame      = nullptr;
+    videoData.pConsumer   = pConsumer;
+    cameraVideoPort->userdata = reinterpret_cast<struct MMAL_PORT_USERDATA_T *>(&videoData);
+    status = mmal_port_enable(cameraVideoPort, videoBufferCallback);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Failed to enable the camera video port").arg(__func__);
+        return status;
+    }
+    uint32_t num = mmal_queue_length(videoPool->queue);
+    for(uint32_t q=0; q<num; q++) {
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(videoPool->queue);
+        if(!buffer)
+            qDebug() << QString("Unable to get a required buffer %1 from pool queue")
+                        .arg(q);
+        status = mmal_port_send_buffer(cameraVideoPort, buffer);
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("%1: Unable to send a buffer to camera video port (%2)")
+                        .arg(__func__)
+                        .arg(q);
+            return status;
+        }
+    }
+    status = mmal_port_parameter_set_boolean(cameraVideoPort, MMAL_PARAMETER_CAPTURE, 1);
+    if(status != MMAL_SUCCESS)
+        qDebug() << QString("%1: Failed to start the analysis stream").arg(__func__);
+    return status;
+}
+
+
+void
+PiCamera::stopAnalysis() {
+    MMAL_PORT_T* cameraVideoPort = component->output[MMAL_CAMERA_VIDEO_PORT];
+    if(cameraVideoPort->is_enabled)
+        mmal_port_parameter_set_boolean(cameraVideoPort, MMAL_PARAMETER_CAPTURE, 0);
+    checkDisablePort(cameraVideoPort);
+    videoData.pConsumer = nullptr;
+}
+
+
+/**
+ * Stream the video port to the video encoder (videoWidth and videoHeight
+ * must have been set before setPortFormats())
+ * @param pEncoder The video encoder
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+PiCamera::startVideo(VideoEncoder *pEncoder) {
+    MMAL_STATUS_T status;
+    MMAL_PORT_T* cameraVideoPort = component->output[MMAL_CAMERA_VIDEO_PORT];
+    if(videoWidth <= 0 || videoHeight <= 0)
+        return MMAL_EINVAL;
+    status = pEncoder->setInputFormat(cameraVideoPort->format);
+    if(status != MMAL_SUCCESS)
+        return status;
+    status = connectPorts(cameraVideoPort, pEncoder->pComponent->input[0], &videoConnection);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Failed to connect camera video port to video encoder input")
+                    .arg(__func__);
+        return status;
+    }
+    status = mmal_port_parameter_set_boolean(cameraVideoPort, MMAL_PARAMETER_CAPTURE, 1);
+    if(status != MMAL_SUCCESS)
+        qDebug() << QString("%1: Failed to start the video stream").arg(__func__);
+    return status;
+}
+
+
+void
+PiCamera::stopVideo() {
+    MMAL_PORT_T* cameraVideoPort = component->output[MMAL_CAMERA_VIDEO_PORT];
+    mmal_port_parameter_set_boolean(cameraVideoPort, MMAL_PARAMETER_CAPTURE, 0);
+    if(videoConnection) {
+        mmal_connection_destroy(videoConnection);
+        videoConnection = nullptr;
+    }
+}
@@ -11,8 +11,13 @@
 #include "cameracontrol.h"
 #include "preview.h"
 #include "jpegencoder.h"
+#include "videoencoder.h"
+#include "exifwriter.h"
+#include "framewriter.h"
+#include "aeconvergence.h"
 
 #include <stdio.h>
+#include <mutex>
 #include <QString>
 
 
@@ -23,17 +28,15 @@
 
 
 
-//struct {
-//   const char *format;
-//   MMAL_FOURCC_T encoding;
-//} encoding_xref[] = {
-//   {"jpg", MMAL_ENCODING_JPEG},
-//   {"bmp", MMAL_ENCODING_BMP},
-//   {"gif", MMAL_ENCODING_GIF},
-//   {"png", MMAL_ENCODING_PNG},
-//   {"ppm", MMAL_ENCODING_PPM},
-//   {"tga", MMAL_ENCODING_TGA}
-//};
+// Receives the still frames, buffer by buffer, as they arrive from the
+// camera still port (see PiCamera::captureFrame()).
+class FrameConsumer
+{
+public:
+    virtual ~FrameConsumer() {}
+    /// Called for every chunk of the frame: offset is the position of pData in the frame
+    virtual void consume(const uint8_t *pData, uint32_t offset, uint32_t length) = 0;
+};
 
 
 class PiCamera
@@ -52,12 +55,53 @@ public:
     MMAL_STATUS_T startPreview(Preview *pPreview);
     MMAL_STATUS_T start(JpegEncoder* pEncoder);
     void stop(JpegEncoder *pEncoder);
-    void capture(QString sPathName);
+    MMAL_STATUS_T limitPreviewFrameRate(int maxFps);
+    MMAL_STATUS_T suspend(JpegEncoder *pEncoder);
+    MMAL_STATUS_T resume(JpegEncoder *pEncoder);
+    bool isSuspended() const;
+    bool capture(QString sPathName, int frameNumber=-1);
+    uint32_t captureEncoded(uint8_t *pBuffer, uint32_t size, int frameNumber=-1);
+    int64_t lastCapturePts();
+    uint32_t lastCaptureBytes();
+    typedef struct {
+        uint32_t startUs;  /// Capture request to the first encoded data (exposure and mode switch)
+        uint32_t encodeUs; /// First encoded data to the end of the frame
+        uint32_t writeUs;  /// Closing the output file (0 for captureEncoded())
+    } CAPTURE_TIMING_T;
+    CAPTURE_TIMING_T lastCaptureTiming();
+    int rebuildCount();
+    uint32_t lastRebuildUs();
+    uint32_t exposureUs();
+    MMAL_STATUS_T startDirect();
+    void stopDirect();
+    bool captureFrame(uint8_t *pFrame, uint32_t size);
+    bool captureFrame(FrameConsumer *pConsumer);
+    MMAL_STATUS_T startAnalysis(FrameConsumer *pConsumer);
+    void stopAnalysis();
+    MMAL_STATUS_T startVideo(VideoEncoder *pEncoder);
+    void stopVideo();
 
 public:
     MMAL_COMPONENT_T *component;// The Camera Component
     CameraControl *pControl;
     MMAL_POOL_T *pool;
+    MMAL_POOL_T *videoPool;
+    int frameWidth;       /// Width of the still frames
+    int frameHeight;      /// Height of the still frames
+    uint32_t frameStride; /// Bytes per row of the (RGB24) still frames
+    uint32_t frameSize;   /// Bytes in a (RGB24) still frame
+    bool rawCapture;      /// Append the raw Bayer data to the JPEGs (set before setPortFormats())
+    int videoWidth;       /// Size of the stream on the video port
+    int videoHeight;      /// (0 = video port unused, set before setPortFormats())
+    int videoFrameRate;   /// Frames per second of the video port
+    uint32_t videoBufferNum; /// Buffers of the video port (0 = as recommended)
+    MMAL_FOURCC_T videoEncoding; /// I420 for the ARM side, OPAQUE for the video encoder
+    ExifWriter *pExifWriter; /// Tags the encoded stills (set before start(), nullptr = encoder EXIF)
+    FrameWriter frameWriter; /// Output layer of capture() (see FrameWriter::begin())
+    AeConvergence *pAeConvergence; /// Fed with the settings of every frame (nullptr = none)
+    int outputWidth;      /// Size of the encoded stills when scaled by the ISP
+    int outputHeight;     /// (0 = as captured, set before start())
+    uint32_t captureTimeoutMs; /// Deadline of a capture before the pipeline is rebuilt (0 = none)
 
 protected:
     MMAL_STATUS_T createComponent(int cameraNum, int sensorMode);
@@ -65,8 +109,23 @@ protected:
     void handleError(MMAL_STATUS_T status, Preview *pPreview);
     void checkDisablePort(MMAL_PORT_T *port);
     void set_defaults();
+    void prepareExif(int frameNumber);
+    MMAL_STATUS_T createResizer();
+    MMAL_STATUS_T connectEncoder(JpegEncoder *pEncoder);
+    bool waitCapture(VCOS_SEMAPHORE_T *pSemaphore);
+    MMAL_STATUS_T rebuild();
+    MMAL_STATUS_T rebuildDirect();
 
 private:
     MMAL_CONNECTION_T *previewConnection;
     MMAL_CONNECTION_T *encoderConnection;
+    MMAL_CONNECTION_T *videoConnection;
+    MMAL_COMPONENT_T *resizer;            /// ISP between the still port and the encoder (or nullptr)
+    MMAL_CONNECTION_T *resizerConnection;
+    CAPTURE_TIMING_T timing;
+    bool bSuspended;                      /// Between suspend() and resume()
+    JpegEncoder *pStartedEncoder;         /// Connected by start() (nullptr = none)
+    int nRebuilds;                        /// See rebuild()
+    uint32_t rebuildUs;
+    std::mutex accessMutex;               /// The captures and the reconfigurations come from several threads
 };
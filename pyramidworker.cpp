@@ -0,0 +1,280 @@
+#include "pyramidworker.h"
+#include "utility.h"
+#include <QDebug>
+
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define PYRAMID_USE_SSSE3
+#endif
+
+
+#define ALIGN_UP(x, n) (((x) + (n) - 1) & ~((n) - 1))
+
+#define WEB_QUALITY   85
+#define THUMB_QUALITY 75
+
+
+#if defined(PYRAMID_USE_SSSE3)
+// pshufb masks: RGB24 to planes (3 masks per plane, one per source
+// register) and two planes back to RGB24 (RG register, B register)
+static struct ShuffleMasks {
+    __m128i planar[3][3];
+    __m128i packedRG[2];
+    __m128i packedB[2];
+
+    ShuffleMasks() {
+        alignas(16) int8_t mask[16];
+        for(int c=0; c<3; c++) {
+            for(int k=0; k<3; k++) {
+                for(int j=0; j<16; j++) {
+                    int src = 3*j + c - 16*k;
+                    mask[j] = int8_t((src >= 0 && src < 16) ? src : 0x80);
+                }
+                planar[c][k] = _mm_load_si128(reinterpret_cast<const __m128i*>(mask));
+            }
+        }
+        for(int k=0; k<2; k++) {
+            alignas(16) int8_t maskB[16];
+            for(int j=0; j<16; j++) {
+                int o = 16*k + j;
+                int p = o/3, c = o%3;
+                mask[j]  = int8_t((o < 24 && c < 2) ? p + 8*c : 0x80);
+                maskB[j] = int8_t((o < 24 && c == 2) ? p : 0x80);
+            }
+            packedRG[k] = _mm_load_si128(reinterpret_cast<const __m128i*>(mask));
+            packedB[k]  = _mm_load_si128(reinterpret_cast<const __m128i*>(maskB));
+        }
+    }
+} shuffleMasks;
+
+
+/// 16 pixels of a RGB24 row as a plane
+static inline __m128i
+plane(const uint8_t *pRow, int c) {
+    const __m128i *p = reinterpret_cast<const __m128i*>(pRow);
+    return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128(p),   shuffleMasks.planar[c][0]),
+                                     _mm_shuffle_epi8(_mm_loadu_si128(p+1), shuffleMasks.planar[c][1])),
+                        _mm_shuffle_epi8(_mm_loadu_si128(p+2), shuffleMasks.planar[c][2]));
+}
+#endif
+
+
+/**
+ * Halve a pair of RGB24 rows: every output pixel is the rounded mean of a 2x2 block
+ * @param pRow0     First source row
+ * @param pRow1     Second source row
+ * @param pDst      Output row
+ * @param dstWidth  Output pixels
+ */
+static void
+downscaleRows(const uint8_t *pRow0, const uint8_t *pRow1, uint8_t *pDst, int dstWidth) {
+    int x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for(; x+8<=dstWidth; x+=8) {
+        uint8x16x3_t a = vld3q_u8(pRow0 + 6*x);
+        uint8x16x3_t b = vld3q_u8(pRow1 + 6*x);
+        uint8x8x3_t out;
+        for(int c=0; c<3; c++)
+            out.val[c] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[c]), vpaddlq_u8(b.val[c])), 2);
+        vst3_u8(pDst + 3*x, out);
+    }
+#elif defined(PYRAMID_USE_SSSE3)
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i two  = _mm_set1_epi16(2);
+    for(; x+8<=dstWidth; x+=8) {
+        __m128i mean[3];
+        for(int c=0; c<3; c++) {
+            // Horizontal pairs with maddubs, then the two rows
+            __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(plane(pRow0 + 6*x, c), ones),
+                                        _mm_maddubs_epi16(plane(pRow1 + 6*x, c), ones));
+            mean[c] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        }
+        __m128i rg = _mm_packus_epi16(mean[0], mean[1]);
+        __m128i bb = _mm_packus_epi16(mean[2], mean[2]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + 3*x),
+                         _mm_or_si128(_mm_shuffle_epi8(rg, shuffleMasks.packedRG[0]),
+                                      _mm_shuffle_epi8(bb, shuffleMasks.packedB[0])));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(pDst + 3*x + 16),
+                         _mm_or_si128(_mm_shuffle_epi8(rg, shuffleMasks.packedRG[1]),
+                                      _mm_shuffle_epi8(bb, shuffleMasks.packedB[1])));
+    }
+#endif
+    for(; x<dstWidth; x++) {
+        for(int c=0; c<3; c++) {
+            pDst[3*x+c] = uint8_t((pRow0[6*x+c] + pRow0[6*x+3+c] +
+                                   pRow1[6*x+c] + pRow1[6*x+3+c] + 2) >> 2);
+        }
+    }
+}
+
+
+/**
+ * @param pWriter   Output layer of the run
+ * @param width     Size of the full resolution frames
+ * @param height
+ * @param stride    Bytes per row of the full resolution frames
+ * @param timeoutMs Deadline of the encoding of a level (see JpegEncoder::encodeTimeoutMs)
+ */
+PyramidWorker::PyramidWorker(FrameWriter *pWriter, int width, int height, uint32_t stride, uint32_t timeoutMs)
+    : pWriter(pWriter)
+    , width(width)
+    , height(height)
+    , stride(stride)
+    , bValid(true)
+    , bStop(false)
+{
+    const char *suffixes[N_LEVELS] = {"_web", "_thumb"};
+    const uint32_t qualities[N_LEVELS] = {WEB_QUALITY, THUMB_QUALITY};
+    MMAL_ES_FORMAT_T *pFormat = mmal_format_alloc();
+    for(int i=0; i<N_LEVELS; i++) {
+        LEVEL_T& level = levels[i];
+        level.width     = width  >> (i+1);
+        level.height    = height >> (i+1);
+        level.stride    = uint32_t(ALIGN_UP(level.width, 32))*3;
+        level.frameSize = level.stride*uint32_t(ALIGN_UP(level.height, 16));
+        level.sSuffix   = QString(suffixes[i]);
+        // An encoder per level: their input formats never change
+        level.pEncoder  = new JpegEncoder();
+        level.pEncoder->setQuality(qualities[i]);
+        level.pEncoder->encodeTimeoutMs = timeoutMs;
+        pFormat->type     = MMAL_ES_TYPE_VIDEO;
+        pFormat->encoding = MMAL_ENCODING_RGB24;
+        pFormat->es->video.width       = uint32_t(ALIGN_UP(level.width, 32));
+        pFormat->es->video.height      = uint32_t(ALIGN_UP(level.height, 16));
+        pFormat->es->video.crop.x      = 0;
+        pFormat->es->video.crop.y      = 0;
+        pFormat->es->video.crop.width  = level.width;
+        pFormat->es->video.crop.height = level.height;
+        if(level.pEncoder->startDirect(pFormat, level.frameSize) != MMAL_SUCCESS) {
+            qDebug() << QString("%1: Unable to start the encoder of level %2").arg(__func__).arg(i+1);
+            bValid = false;
+        }
+    }
+    mmal_format_free(pFormat);
+    images.resize(size_t(N_SLOTS*N_LEVELS));
+    for(int slot=0; slot<N_SLOTS; slot++) {
+        for(int i=0; i<N_LEVELS; i++)
+            images[size_t(slot*N_LEVELS+i)].resize(levels[i].frameSize);
+        freeSlots.push_back(slot);
+    }
+    worker = std::thread(&PyramidWorker::run, this);
+}
+
+
+/// Waits for the pending pyramids to be written, then stops the worker
+PyramidWorker::~PyramidWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    cond.notify_all();
+    worker.join();
+    for(auto& level : levels) {
+        level.pEncoder->stopDirect();
+        level.pEncoder->destroy();
+        delete level.pEncoder;
+    }
+}
+
+
+bool
+PyramidWorker::isValid() const {
+    return bValid;
+}
+
+
+/// Rebuilds of the level encoders after lost frames (see JpegEncoder::rebuildDirect())
+int
+PyramidWorker::rebuildCount() const {
+    int rebuilds = 0;
+    for(int i=0; i<N_LEVELS; i++)
+        rebuilds += levels[i].pEncoder->rebuildCount();
+    return rebuilds;
+}
+
+
+/**
+ * Build the reduced images of a frame and queue them for encoding.
+ * The frame can be reused as soon as this returns.
+ * Blocks if all the slots are still waiting to be encoded.
+ * @param pFrame    RGB24 frame (width x height, stride bytes per row)
+ * @param sPathName Name of the full resolution file
+ */
+void
+PyramidWorker::submit(const uint8_t *pFrame, QString sPathName) {
+    int slot;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return !freeSlots.empty(); });
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    downscale(pFrame, slot);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(PYRAMID_JOB_T{slot, sPathName});
+    }
+    cond.notify_all();
+}
+
+
+/**
+ * Both levels in one pass: every band of four source rows gives two
+ * rows of the web copy, which give one row of the thumbnail while
+ * they are still in cache. The bands are shared among the cores.
+ */
+void
+PyramidWorker::downscale(const uint8_t *pFrame, int slot) {
+    const LEVEL_T& web   = levels[0];
+    const LEVEL_T& thumb = levels[1];
+    uint8_t *pWeb   = images[size_t(slot*N_LEVELS)].data();
+    uint8_t *pThumb = images[size_t(slot*N_LEVELS+1)].data();
+    runParallel(thumb.height, [&](int first, int last) {
+        for(int y=first; y<last; y++) {
+            uint8_t *pWeb0 = pWeb + size_t(2*y)*web.stride;
+            uint8_t *pWeb1 = pWeb0 + web.stride;
+            const uint8_t *pSrc = pFrame + size_t(4*y)*stride;
+            downscaleRows(pSrc,          pSrc + stride,   pWeb0, web.width);
+            downscaleRows(pSrc + 2*stride, pSrc + 3*stride, pWeb1, web.width);
+            downscaleRows(pWeb0, pWeb1, pThumb + size_t(y)*thumb.stride, thumb.width);
+        }
+    });
+    // The last row of the web copy when its height is odd
+    if(web.height > 2*thumb.height) {
+        const uint8_t *pSrc = pFrame + size_t(2*(web.height-1))*stride;
+        downscaleRows(pSrc, pSrc + stride, pWeb + size_t(web.height-1)*web.stride, web.width);
+    }
+}
+
+
+void
+PyramidWorker::run() {
+    for(;;) {
+        PYRAMID_JOB_T job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return bStop || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        QString sBase = job.sPathName.left(job.sPathName.lastIndexOf('.'));
+        for(int i=0; i<N_LEVELS; i++) {
+            const LEVEL_T& level = levels[i];
+            QString sPathName = sBase + level.sSuffix + QString(".jpg");
+            if(level.pEncoder->encode(images[size_t(job.slot*N_LEVELS+i)].data(),
+                                      level.frameSize, pWriter, sPathName) != MMAL_SUCCESS)
+                qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(sPathName);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeSlots.push_back(job.slot);
+        }
+        cond.notify_all();
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "jpegencoder.h"
+
+#include <QString>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Builds the reduced copies of the RGB24 stills (1/4 and 1/16 of the area)
+// in a single pass over the frame, and encodes them on a worker thread
+// with encoders of their own, next to the full resolution file.
+class PyramidWorker
+{
+public:
+    PyramidWorker(FrameWriter *pWriter, int width, int height, uint32_t stride, uint32_t timeoutMs);
+    ~PyramidWorker();
+
+public:
+    bool isValid() const;
+    void submit(const uint8_t *pFrame, QString sPathName);
+    int rebuildCount() const;
+
+protected:
+    void run();
+    void downscale(const uint8_t *pFrame, int slot);
+
+public:
+    static const int N_LEVELS = 2; /// Web copy (1/2 x 1/2) and thumbnail (1/4 x 1/4)
+    static const int N_SLOTS  = 2; /// Pyramids in flight (downscaling + encoding)
+
+private:
+    typedef struct {
+        int width;
+        int height;
+        uint32_t stride;
+        uint32_t frameSize;          /// Encoder input size (32x16 aligned)
+        JpegEncoder *pEncoder;
+        QString sSuffix;             /// Appended to the name of the full frame
+    } LEVEL_T;
+
+    typedef struct {
+        int slot;
+        QString sPathName;           /// Name of the full resolution frame
+    } PYRAMID_JOB_T;
+
+    FrameWriter *pWriter;                     /// Output layer of the run
+    int width;
+    int height;
+    uint32_t stride;
+    bool bValid;
+    LEVEL_T levels[N_LEVELS];
+    std::vector<std::vector<uint8_t>> images; /// N_SLOTS * N_LEVELS reduced images
+    std::vector<int> freeSlots;
+    std::deque<PYRAMID_JOB_T> jobs;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool bStop;
+    std::thread worker;
+};
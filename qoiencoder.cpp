@@ -0,0 +1,148 @@
+#include "qoiencoder.h"
+#include "utility.h"
+
+#include <string.h>
+#include <thread>
+
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xC0
+#define QOI_OP_RGB   0xFE
+
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN     62
+
+static const uint8_t qoiEnd[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+
+QoiEncoder::QoiEncoder(int width, int height, uint32_t stride)
+    : width(width)
+    , height(height)
+    , stride(stride)
+{
+    nStripes = int(std::thread::hardware_concurrency());
+    if(nStripes < 1)
+        nStripes = 4;
+    if(nStripes > height)
+        nStripes = height;
+    stripes.resize(size_t(nStripes));
+    stripeBytes.resize(size_t(nStripes));
+    // Worst case: a QOI_OP_RGB for every pixel
+    const size_t maxRows = size_t(height/nStripes + 1);
+    for(auto& stripe : stripes)
+        stripe.resize(maxRows*size_t(width)*4);
+    encoded.reserve(QOI_HEADER_SIZE + size_t(width)*size_t(height)*4 + sizeof(qoiEnd));
+}
+
+
+/**
+ * Encode a whole frame
+ * @param pFrame RGB24 frame (stride bytes per row)
+ * @return the QOI file image (valid until the next call)
+ */
+const std::vector<uint8_t>&
+QoiEncoder::encode(const uint8_t *pFrame) {
+    runParallel(nStripes, [&](int first, int last) {
+        for(int i=first; i<last; i++) {
+            int firstRow = int(int64_t(height)*i/nStripes);
+            int lastRow  = int(int64_t(height)*(i+1)/nStripes);
+            stripeBytes[size_t(i)] = encodeStripe(pFrame, firstRow, lastRow, stripes[size_t(i)].data());
+        }
+    });
+    encoded.resize(QOI_HEADER_SIZE);
+    uint8_t *p = encoded.data();
+    memcpy(p, "qoif", 4);
+    p[4]  = uint8_t(width >> 24);
+    p[5]  = uint8_t(width >> 16);
+    p[6]  = uint8_t(width >> 8);
+    p[7]  = uint8_t(width);
+    p[8]  = uint8_t(height >> 24);
+    p[9]  = uint8_t(height >> 16);
+    p[10] = uint8_t(height >> 8);
+    p[11] = uint8_t(height);
+    p[12] = 3; // RGB
+    p[13] = 0; // sRGB with linear alpha
+    for(int i=0; i<nStripes; i++)
+        encoded.insert(encoded.end(), stripes[size_t(i)].begin(),
+                       stripes[size_t(i)].begin() + stripeBytes[size_t(i)]);
+    encoded.insert(encoded.end(), qoiEnd, qoiEnd + sizeof(qoiEnd));
+    return encoded;
+}
+
+
+/**
+ * Encode the rows [firstRow, lastRow) of the frame.
+ * The decoder enters the stripe with the state left by the previous one:
+ * the first pixel is written in full and the index only hits entries
+ * written in this stripe (the decoder wrote the same values there).
+ * @return the number of bytes written in pOut
+ */
+uint32_t
+QoiEncoder::encodeStripe(const uint8_t *pFrame, int firstRow, int lastRow, uint8_t *pOut) {
+    uint32_t index[64];
+    memset(index, 0, sizeof(index)); // 0 never matches: our alpha is 255
+    uint8_t *p = pOut;
+    int run = 0;
+    uint8_t pr = 0, pg = 0, pb = 0;
+    bool bFirst = true;
+    for(int y=firstRow; y<lastRow; y++) {
+        const uint8_t *pRow = pFrame + size_t(y)*stride;
+        for(int x=0; x<width; x++, pRow+=3) {
+            const uint8_t r = pRow[0];
+            const uint8_t g = pRow[1];
+            const uint8_t b = pRow[2];
+            if(!bFirst && r == pr && g == pg && b == pb) {
+                if(++run == QOI_MAX_RUN) {
+                    *p++ = uint8_t(QOI_OP_RUN | (run-1));
+                    run = 0;
+                }
+                continue;
+            }
+            if(run) {
+                *p++ = uint8_t(QOI_OP_RUN | (run-1));
+                run = 0;
+            }
+            const uint32_t px   = 0xFF000000u | uint32_t(b) << 16 | uint32_t(g) << 8 | r;
+            const int      hash = (r*3 + g*5 + b*7 + 255*11) & 63;
+            if(bFirst) {
+                *p++ = QOI_OP_RGB;
+                *p++ = r;
+                *p++ = g;
+                *p++ = b;
+                bFirst = false;
+            }
+            else if(index[hash] == px) {
+                *p++ = uint8_t(QOI_OP_INDEX | hash);
+            }
+            else {
+                const int8_t dr = int8_t(r - pr);
+                const int8_t dg = int8_t(g - pg);
+                const int8_t db = int8_t(b - pb);
+                const int8_t dr_dg = int8_t(dr - dg);
+                const int8_t db_dg = int8_t(db - dg);
+                if(dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+                    *p++ = uint8_t(QOI_OP_DIFF | (dr+2) << 4 | (dg+2) << 2 | (db+2));
+                }
+                else if(dg > -33 && dg < 32 && dr_dg > -9 && dr_dg < 8 && db_dg > -9 && db_dg < 8) {
+                    *p++ = uint8_t(QOI_OP_LUMA | (dg+32));
+                    *p++ = uint8_t((dr_dg+8) << 4 | (db_dg+8));
+                }
+                else {
+                    *p++ = QOI_OP_RGB;
+                    *p++ = r;
+                    *p++ = g;
+                    *p++ = b;
+                }
+            }
+            index[hash] = px;
+            pr = r;
+            pg = g;
+            pb = b;
+        }
+    }
+    if(run) // Runs never cross a stripe boundary
+        *p++ = uint8_t(QOI_OP_RUN | (run-1));
+    return uint32_t(p - pOut);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+
+// Lossless QOI encoder for the RGB24 still frames, run on the CPU.
+// The rows are split in stripes encoded in parallel. Every stripe starts
+// with a literal pixel and only references index entries it wrote itself,
+// so the stripes concatenate into a single, standard QOI stream.
+class QoiEncoder
+{
+public:
+    QoiEncoder(int width, int height, uint32_t stride);
+
+public:
+    const std::vector<uint8_t>& encode(const uint8_t *pFrame);
+
+protected:
+    uint32_t encodeStripe(const uint8_t *pFrame, int firstRow, int lastRow, uint8_t *pOut);
+
+private:
+    int width;
+    int height;
+    uint32_t stride;
+    int nStripes;
+    std::vector<std::vector<uint8_t>> stripes; /// Worst case sized output of every stripe
+    std::vector<uint32_t> stripeBytes;
+    std::vector<uint8_t> encoded;              /// Header + stripes + end marker
+};
@@ -0,0 +1,92 @@
+#include "ratecontrol.h"
+
+#include <math.h>
+#include <algorithm>
+
+
+#define INITIAL_SLOPE (1.0/12.0) // The size doubles every ~12 points
+#define MIN_SLOPE     (1.0/40.0)
+#define MAX_SLOPE     (1.0/3.0)
+
+
+RateController::RateController(uint32_t initialQuality, uint32_t minQuality, uint32_t maxQuality)
+    : q(initialQuality)
+    , minQuality(minQuality)
+    , maxQuality(maxQuality)
+    , target(0)
+    , bRunBudget(false)
+    , remainingBytes(0)
+    , remainingFrames(0)
+    , slope(INITIAL_SLOPE)
+    , lastQ(0)
+    , lastLogSize(0.0)
+    , bHaveLast(false)
+{
+    q = std::min(std::max(q, minQuality), maxQuality);
+}
+
+
+/// Aim at a fixed size for every still
+void
+RateController::setFrameTarget(uint32_t bytes) {
+    bRunBudget = false;
+    target = bytes;
+}
+
+
+/// Spread a storage budget over the stills of a run
+void
+RateController::setRunBudget(uint64_t bytes, uint32_t frames) {
+    bRunBudget      = true;
+    remainingBytes  = int64_t(bytes);
+    remainingFrames = std::max(frames, 1u);
+    target = uint32_t(bytes/remainingFrames);
+}
+
+
+uint32_t
+RateController::quality() const {
+    return q;
+}
+
+
+uint32_t
+RateController::frameTarget() const {
+    return target;
+}
+
+
+/**
+ * Account for the still just encoded and choose the next quality
+ * @param frameBytes Encoded size of the still (with the current quality)
+ * @return the quality for the next still
+ */
+uint32_t
+RateController::update(uint32_t frameBytes) {
+    if(frameBytes == 0)
+        return q;
+    if(bRunBudget) {
+        // What is left is shared by the stills still to come
+        remainingBytes -= frameBytes;
+        if(remainingFrames > 1)
+            remainingFrames--;
+        target = remainingBytes > 0 ? uint32_t(remainingBytes/remainingFrames) : 1;
+    }
+    double logSize = log2(double(frameBytes));
+    // Secant estimate of the slope, only when the quality moved enough to tell
+    if(bHaveLast && (q > lastQ + 1 || lastQ > q + 1)) {
+        double observed = (logSize - lastLogSize)/(double(q) - double(lastQ));
+        if(observed > 0.0)
+            slope = 0.5*slope + 0.5*std::min(std::max(observed, MIN_SLOPE), MAX_SLOPE);
+    }
+    lastQ       = q;
+    lastLogSize = logSize;
+    bHaveLast   = true;
+    if(target == 0)
+        return q;
+    double step = (log2(double(target)) - logSize)/slope;
+    step = std::min(std::max(step, double(-MAX_STEP)), double(MAX_STEP));
+    int next = int(lround(double(q) + step));
+    q = uint32_t(std::min(std::max(next, int(minQuality)), int(maxQuality)));
+    return q;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Chooses the JPEG quality of the next still so that the encoded size
+// follows a per-frame target, or spreads a storage budget over a run.
+// The size is modelled as doubling every 1/slope quality points; the
+// slope is refined from the observed sizes when the quality changes.
+class RateController
+{
+public:
+    RateController(uint32_t initialQuality, uint32_t minQuality, uint32_t maxQuality);
+
+public:
+    void setFrameTarget(uint32_t bytes);
+    void setRunBudget(uint64_t bytes, uint32_t frames);
+    uint32_t update(uint32_t frameBytes);
+    uint32_t quality() const;
+    uint32_t frameTarget() const;
+
+public:
+    static const int MAX_STEP = 10; /// Max quality change between two stills
+
+private:
+    uint32_t q;
+    uint32_t minQuality;
+    uint32_t maxQuality;
+    uint32_t target;           /// Bytes per still
+    bool bRunBudget;
+    int64_t remainingBytes;    /// Run budget mode only
+    uint32_t remainingFrames;
+    double slope;              /// log2(size) change per quality point
+    uint32_t lastQ;            /// Quality and log2(size) of the previous still
+    double lastLogSize;
+    bool bHaveLast;
+};
@@ -0,0 +1,331 @@
+#include "rawworker.h"
+#include "utility.h"
+#include <QDebug>
+
+#include <string.h>
+#include <strings.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RAW_USE_NEON
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define RAW_USE_SSSE3
+#endif
+
+
+#define BRCM_HEADER_SIZE   32768 // The Bayer data follows this header
+#define BRCM_INFO_OFFSET   176   // Position of the mode description in the header
+#define RAW_SEQUENCE_MAGIC 0x57524d53 // "SMRW"
+
+
+// Layout of the mode description in the "BRCM" raw header
+typedef struct {
+    char     name[32];
+    uint16_t width;
+    uint16_t height;
+    uint16_t padding_right;
+    uint16_t padding_down;
+    uint32_t dummy[6];
+    uint16_t transform;
+    uint16_t format;
+    uint8_t  bayer_order;
+    uint8_t  bayer_format;
+} BRCM_RAW_INFO_T;
+
+
+// Header of every frame in a raw sequence file
+typedef struct {
+    uint32_t magic;
+    uint32_t frameNumber;
+    uint16_t width;
+    uint16_t height;
+    uint8_t  bayerOrder;
+    uint8_t  bitsPerSample;
+    uint16_t reserved;
+    uint32_t dataBytes;
+} RAW_SEQUENCE_HEADER_T;
+
+
+// Size of the raw block appended to the JPEG, by sensor
+static const struct {
+    const char *name;
+    uint32_t size;
+} rawSizes[] = {
+    {"ov5647",  6404096},
+    {"imx219", 10270208},
+    {"imx477", 18711040}
+};
+
+
+/**
+ * Unpack a row of 10 bit samples (4 samples in 5 bytes: 4 MSB bytes, then the 4x2 LSB)
+ * @param pSrc     Packed row
+ * @param pDst     Unpacked samples
+ * @param n        Number of samples (a multiple of 4)
+ * @param srcBytes Readable bytes in the row (vector loads overrun the packed samples)
+ */
+static void
+unpack10(const uint8_t *pSrc, uint16_t *pDst, int n, uint32_t srcBytes) {
+    int i = 0;
+#if defined(RAW_USE_NEON)
+    // 16 samples from 20 bytes per iteration: table lookups gather MSBs and LSBs
+    static const uint8_t msbIndex[16] = {0,1,2,3, 5,6,7,8, 10,11,12,13, 15,16,17,18};
+    static const uint8_t lsbIndex[16] = {4,4,4,4, 9,9,9,9, 14,14,14,14, 19,19,19,19};
+    static const int16_t lsbShift[8]  = {0,-2,-4,-6, 0,-2,-4,-6};
+    const uint8x8_t  msbLo  = vld1_u8(msbIndex),  msbHi = vld1_u8(msbIndex+8);
+    const uint8x8_t  lsbLo  = vld1_u8(lsbIndex),  lsbHi = vld1_u8(lsbIndex+8);
+    const int16x8_t  shifts = vld1q_s16(lsbShift);
+    const uint16x8_t three  = vdupq_n_u16(3);
+    for(; i+16<=n && uint32_t(i/4*5 + 24)<=srcBytes; i+=16, pSrc+=20) {
+        uint8x8x3_t table = {{ vld1_u8(pSrc), vld1_u8(pSrc+8), vld1_u8(pSrc+16) }}; // Reads 24 bytes
+        uint16x8_t lo = vorrq_u16(vshll_n_u8(vtbl3_u8(table, msbLo), 2),
+                                  vandq_u16(vshlq_u16(vmovl_u8(vtbl3_u8(table, lsbLo)), shifts), three));
+        uint16x8_t hi = vorrq_u16(vshll_n_u8(vtbl3_u8(table, msbHi), 2),
+                                  vandq_u16(vshlq_u16(vmovl_u8(vtbl3_u8(table, lsbHi)), shifts), three));
+        vst1q_u16(pDst+i,   lo);
+        vst1q_u16(pDst+i+8, hi);
+    }
+#elif defined(RAW_USE_SSSE3)
+    // 8 samples from 10 bytes per iteration
+    const __m128i msbShuffle = _mm_setr_epi8(0,-1, 1,-1, 2,-1, 3,-1, 5,-1, 6,-1, 7,-1, 8,-1);
+    const __m128i lsbShuffle = _mm_setr_epi8(4,-1, 4,-1, 4,-1, 4,-1, 9,-1, 9,-1, 9,-1, 9,-1);
+    const __m128i lsbScale   = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1); // << (6 - 2*k)
+    const __m128i three      = _mm_set1_epi16(3);
+    for(; i+8<=n && uint32_t(i/4*5 + 16)<=srcBytes; i+=8, pSrc+=10) {
+        __m128i v   = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc)); // Reads 16 bytes
+        __m128i msb = _mm_slli_epi16(_mm_shuffle_epi8(v, msbShuffle), 2);
+        __m128i lsb = _mm_mullo_epi16(_mm_shuffle_epi8(v, lsbShuffle), lsbScale);
+        lsb = _mm_and_si128(_mm_srli_epi16(lsb, 6), three);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst+i), _mm_or_si128(msb, lsb));
+    }
+#else
+    (void)srcBytes;
+#endif
+    for(; i+4<=n; i+=4, pSrc+=5) {
+        pDst[i]   = uint16_t((pSrc[0] << 2) | ( pSrc[4]       & 3));
+        pDst[i+1] = uint16_t((pSrc[1] << 2) | ((pSrc[4] >> 2) & 3));
+        pDst[i+2] = uint16_t((pSrc[2] << 2) | ((pSrc[4] >> 4) & 3));
+        pDst[i+3] = uint16_t((pSrc[3] << 2) | ((pSrc[4] >> 6) & 3));
+    }
+}
+
+
+/**
+ * Unpack a row of 12 bit samples (2 samples in 3 bytes: 2 MSB bytes, then the 2x4 LSB)
+ * @param pSrc Packed row
+ * @param pDst Unpacked samples
+ * @param n    Number of samples (a multiple of 2)
+ */
+static void
+unpack12(const uint8_t *pSrc, uint16_t *pDst, int n) {
+    for(int i=0; i+2<=n; i+=2, pSrc+=3) {
+        pDst[i]   = uint16_t((pSrc[0] << 4) | (pSrc[2] & 0x0f));
+        pDst[i+1] = uint16_t((pSrc[1] << 4) | (pSrc[2] >> 4));
+    }
+}
+
+
+RawWorker::RawWorker(FrameWriter *pWriter, uint32_t bufferSize, int rawFormat, QString sSequencePath,
+                     const char *cameraName)
+    : pWriter(pWriter)
+    , rawFormat(rawFormat)
+    , size(bufferSize)
+    , sequenceFile(nullptr)
+    , bStop(false)
+{
+    strncpy(this->cameraName, cameraName, sizeof(this->cameraName));
+    this->cameraName[sizeof(this->cameraName)-1] = 0;
+    if(rawFormat == RAW_SEQUENCE) {
+        sequenceFile = fopen(sSequencePath.toLatin1(), "ab");
+        if(!sequenceFile)
+            qDebug() << QString("%1: Error opening raw sequence file: %2")
+                        .arg(__func__)
+                        .arg(sSequencePath);
+    }
+    buffers.resize(N_BUFFERS);
+    for(auto& buffer : buffers)
+        buffer.resize(size);
+    for(int i=0; i<N_BUFFERS; i++)
+        freeBuffers.push_back(i);
+    worker = std::thread(&RawWorker::run, this);
+}
+
+
+/// Waits for the pending frames to be written, then stops the worker
+RawWorker::~RawWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    cond.notify_all();
+    worker.join();
+    if(sequenceFile)
+        fclose(sequenceFile);
+}
+
+
+/**
+ * Size of the raw block appended to the JPEG by a given sensor
+ * @param cameraName The sensor name as reported by the camera info
+ * @return the size in bytes (the biggest known one if the sensor is unknown)
+ */
+uint32_t
+RawWorker::rawBlockSize(const char *cameraName) {
+    uint32_t maxSize = 0;
+    for(const auto& raw : rawSizes) {
+        if(strncasecmp(cameraName, raw.name, strlen(raw.name)) == 0)
+            return raw.size;
+        if(raw.size > maxSize)
+            maxSize = raw.size;
+    }
+    return maxSize;
+}
+
+
+/// Get a free buffer to capture into. Blocks if all the buffers are waiting to be written.
+int
+RawWorker::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !freeBuffers.empty(); });
+    int index = freeBuffers.back();
+    freeBuffers.pop_back();
+    return index;
+}
+
+
+uint8_t*
+RawWorker::buffer(int index) {
+    return buffers[size_t(index)].data();
+}
+
+
+uint32_t
+RawWorker::bufferSize() const {
+    return size;
+}
+
+
+/// Queue a captured JPEG+raw stream for writing
+void
+RawWorker::submit(int index, uint32_t length, int frameNumber, QString sPathName) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(RAW_JOB_T{index, length, frameNumber, sPathName});
+    }
+    cond.notify_all();
+}
+
+
+void
+RawWorker::release(int index) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeBuffers.push_back(index);
+    }
+    cond.notify_all();
+}
+
+
+void
+RawWorker::run() {
+    for(;;) {
+        RAW_JOB_T job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return bStop || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        if(!process(buffer(job.index), job.length, job.frameNumber, job.sPathName))
+            qDebug() << QString("%1: Unable to write %2").arg(__func__).arg(job.sPathName);
+        else if(verbose)
+            qDebug() << "Written" << job.sPathName;
+        release(job.index);
+    }
+}
+
+
+/**
+ * Write the JPEG part of the stream and the unpacked Bayer data
+ * @param pData       The JPEG+raw stream
+ * @param length      Length of the stream
+ * @param frameNumber Frame index in the run
+ * @param sPathName   Output JPEG file (the DNG replaces the extension)
+ * @return true if all OK
+ */
+bool
+RawWorker::process(const uint8_t *pData, uint32_t length, int frameNumber, QString sPathName) {
+    // The raw block is at the very end of the stream: try the known sizes
+    uint32_t rawOffset = length;
+    for(const auto& raw : rawSizes) {
+        if(raw.size < length && memcmp(pData + length - raw.size, "BRCM", 4) == 0) {
+            rawOffset = length - raw.size;
+            break;
+        }
+    }
+    if(!pWriter->open(sPathName, frameNumber))
+        return false;
+    if(pWriter->write(pData, rawOffset) != rawOffset)
+        pWriter->cancel();
+    bool bOk = pWriter->close();
+    if(rawOffset == length) {
+        qDebug() << QString("%1: No raw data found in %2").arg(__func__).arg(sPathName);
+        return bOk;
+    }
+
+    BRCM_RAW_INFO_T info;
+    memcpy(&info, pData + rawOffset + BRCM_INFO_OFFSET, sizeof(info));
+    const int width  = info.width;
+    const int height = info.height;
+    const uint32_t available = length - rawOffset - BRCM_HEADER_SIZE;
+    // The packing is not in the header: 12 bit when it fits, 10 bit otherwise
+    int bits = 12;
+    uint32_t stride = ((uint32_t(width + info.padding_right)*uint32_t(bits) + 7)/8 + 31) & ~31u;
+    if(stride*uint32_t(height) > available) {
+        bits = 10;
+        stride = ((uint32_t(width + info.padding_right)*uint32_t(bits) + 7)/8 + 31) & ~31u;
+    }
+    if(width == 0 || height == 0 || stride*uint32_t(height) > available) {
+        qDebug() << QString("%1: Unexpected raw geometry %2x%3").arg(__func__).arg(width).arg(height);
+        return false;
+    }
+    unpacked.resize(size_t(width)*size_t(height));
+    const uint8_t *pBayer = pData + rawOffset + BRCM_HEADER_SIZE;
+    runParallel(height, [this, pBayer, stride, width, bits](int first, int last) {
+        for(int y=first; y<last; y++) {
+            const uint8_t *pRow = pBayer + size_t(y)*stride;
+            uint16_t *pOut = unpacked.data() + size_t(y)*size_t(width);
+            if(bits == 10)
+                unpack10(pRow, pOut, width & ~3, stride);
+            else
+                unpack12(pRow, pOut, width & ~1);
+        }
+    });
+
+    if(rawFormat == RAW_SEQUENCE) {
+        if(!sequenceFile)
+            return false;
+        RAW_SEQUENCE_HEADER_T header;
+        memset(&header, 0, sizeof(header));
+        header.magic         = RAW_SEQUENCE_MAGIC;
+        header.frameNumber   = uint32_t(frameNumber);
+        header.width         = uint16_t(width);
+        header.height        = uint16_t(height);
+        header.bayerOrder    = info.bayer_order;
+        header.bitsPerSample = uint8_t(bits);
+        header.dataBytes     = uint32_t(unpacked.size()*sizeof(uint16_t));
+        bOk &= fwrite(&header, sizeof(header), 1, sequenceFile) == 1;
+        bOk &= fwrite(unpacked.data(), sizeof(uint16_t), unpacked.size(), sequenceFile) == unpacked.size();
+        return bOk;
+    }
+    QString sDngName = sPathName.left(sPathName.lastIndexOf(QChar('.'))) + QString(".dng");
+    if(!pWriter->open(sDngName)) // Next to its JPEG: not journaled on its own
+        return false;
+    if(!dngWriter.write(pWriter, unpacked.data(), width, height, info.bayer_order, bits, cameraName))
+        pWriter->cancel();
+    bOk &= pWriter->close();
+    return bOk;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "dngwriter.h"
+
+#include <QString>
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Splits the JPEG+raw streams produced with raw capture enabled,
+// unpacks the Bayer data to 16 bit and writes it as DNG files
+// or as a single raw sequence, away from the capture thread.
+class RawWorker
+{
+public:
+    RawWorker(FrameWriter *pWriter, uint32_t bufferSize, int rawFormat, QString sSequencePath, const char *cameraName);
+    ~RawWorker();
+
+public:
+    int acquire();
+    uint8_t *buffer(int index);
+    uint32_t bufferSize() const;
+    void submit(int index, uint32_t length, int frameNumber, QString sPathName);
+    void release(int index);
+    static uint32_t rawBlockSize(const char *cameraName);
+
+protected:
+    void run();
+    bool process(const uint8_t *pData, uint32_t length, int frameNumber, QString sPathName);
+
+public:
+    enum RawFormat {
+        RAW_DNG      = 0, /// One DNG next to every JPEG
+        RAW_SEQUENCE = 1  /// All the frames, unpacked, in a single file
+    };
+    static const int N_BUFFERS = 2; /// Frames in flight (capturing + writing)
+
+private:
+    typedef struct {
+        int index;
+        uint32_t length;
+        int frameNumber;
+        QString sPathName;
+    } RAW_JOB_T;
+
+    FrameWriter *pWriter;   /// Output layer of the run (JPEG and DNG files)
+    int rawFormat;
+    uint32_t size;
+    char cameraName[32];
+    FILE *sequenceFile;     /// Appended to, frame after frame: not a still of its own
+    DngWriter dngWriter;
+    std::vector<std::vector<uint8_t>> buffers;
+    std::vector<uint16_t> unpacked;
+    std::vector<int> freeBuffers;
+    std::deque<RAW_JOB_T> jobs;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool bStop;
+    std::thread worker;
+};
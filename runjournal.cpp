@@ -0,0 +1,181 @@
+#include "runjournal.h"
+#include "crc32c.h"
+
+#include <QDebug>
+#include <QFileInfo>
+#include <QDateTime>
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+#define JOURNAL_MAGIC   0x314a4d53 // "SMJ1"
+#define JOURNAL_VERSION 2
+
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entrySize;
+    uint32_t reserved;
+} JOURNAL_HEADER_T;
+
+
+static_assert(sizeof(RunJournal::ENTRY_T) == 128, "Journal entries must keep their on-disk size");
+
+
+RunJournal::RunJournal()
+    : fd(-1)
+    , bHasLast(false)
+    , nEntries(0)
+{
+    memset(&lastEntry, 0, sizeof(lastEntry));
+}
+
+
+RunJournal::~RunJournal() {
+    close();
+}
+
+
+uint32_t
+RunJournal::checksum(const ENTRY_T& entry) {
+    return crc32c(0, &entry, offsetof(ENTRY_T, checksum));
+}
+
+
+/**
+ * Open (or create) the journal of a run and find its last committed entry
+ * @param sPathName The journal file
+ * @return true if all OK
+ */
+bool
+RunJournal::open(QString sPathName) {
+    close();
+    fd = ::open(sPathName.toLocal8Bit().constData(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        qDebug() << QString("%1: Unable to open %2: %3").arg(__func__).arg(sPathName).arg(strerror(errno));
+        return false;
+    }
+    if(!recover()) {
+        qDebug() << QString("%1: %2 is not a run journal").arg(__func__).arg(sPathName);
+        close();
+        return false;
+    }
+    return true;
+}
+
+
+void
+RunJournal::close() {
+    if(fd >= 0)
+        ::close(fd);
+    fd = -1;
+    bHasLast = false;
+    nEntries = 0;
+}
+
+
+/**
+ * Check the header (write it to a new journal), cut a torn tail
+ * and read the last valid entry: only the end of the file is read
+ * @return false if the file is not a journal
+ */
+bool
+RunJournal::recover() {
+    JOURNAL_HEADER_T header;
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        return false;
+    if(st.st_size < off_t(sizeof(header))) {
+        header.magic     = JOURNAL_MAGIC;
+        header.version   = JOURNAL_VERSION;
+        header.entrySize = sizeof(ENTRY_T);
+        header.reserved  = 0;
+        if(ftruncate(fd, 0) != 0 ||
+           write(fd, &header, sizeof(header)) != ssize_t(sizeof(header)) ||
+           fdatasync(fd) != 0)
+            return false;
+        return true;
+    }
+    if(pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) ||
+       header.magic != JOURNAL_MAGIC ||
+       header.version != JOURNAL_VERSION ||
+       header.entrySize != sizeof(ENTRY_T))
+        return false;
+    // A power loss may leave a partial or corrupted last entry
+    nEntries = uint64_t(st.st_size - off_t(sizeof(header)))/sizeof(ENTRY_T);
+    while(nEntries > 0) {
+        off_t offset = off_t(sizeof(header) + (nEntries-1)*sizeof(ENTRY_T));
+        if(pread(fd, &lastEntry, sizeof(lastEntry), offset) == ssize_t(sizeof(lastEntry)) &&
+           lastEntry.checksum == checksum(lastEntry))
+            break;
+        nEntries--;
+    }
+    off_t validSize = off_t(sizeof(header) + nEntries*sizeof(ENTRY_T));
+    if(validSize != st.st_size) {
+        qDebug() << QString("%1: Dropping %2 bytes of torn journal entries")
+                    .arg(__func__)
+                    .arg(st.st_size - validSize);
+        if(ftruncate(fd, validSize) != 0)
+            return false;
+    }
+    bHasLast = nEntries > 0;
+    return true;
+}
+
+
+/**
+ * Commit the entry of a still complete on the storage (synced before returning)
+ * @param index     Frame index in the run
+ * @param sFileName Output file
+ * @param size      Bytes written
+ * @param crc       CRC-32C of the bytes written
+ * @return true if the entry is on the storage
+ */
+bool
+RunJournal::append(uint32_t index, QString sFileName, uint32_t size, uint32_t crc) {
+    if(fd < 0)
+        return false;
+    ENTRY_T entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.index       = index;
+    entry.size        = size;
+    entry.crc         = crc;
+    entry.timestampMs = QDateTime::currentMSecsSinceEpoch();
+    strncpy(entry.name, QFileInfo(sFileName).fileName().toLocal8Bit().constData(), sizeof(entry.name)-1);
+    entry.checksum    = checksum(entry);
+    if(write(fd, &entry, sizeof(entry)) != ssize_t(sizeof(entry)) || fdatasync(fd) != 0) {
+        qDebug() << QString("%1: Unable to journal %2: %3").arg(__func__).arg(sFileName).arg(strerror(errno));
+        return false;
+    }
+    lastEntry = entry;
+    bHasLast = true;
+    nEntries++;
+    return true;
+}
+
+
+/// true if the journal has at least one committed entry
+bool
+RunJournal::hasLast() const {
+    return bHasLast;
+}
+
+
+/// The last committed entry (see hasLast())
+RunJournal::ENTRY_T
+RunJournal::last() const {
+    return lastEntry;
+}
+
+
+/// Committed entries
+uint64_t
+RunJournal::entries() const {
+    return nEntries;
+}
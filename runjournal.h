@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QString>
+#include <stdint.h>
+
+
+// Append-only journal of the stills of a run: one fixed size entry per
+// still, synced to the storage as soon as it is written. After a power
+// loss the last committed entry, read at a fixed distance from the end
+// of the file, tells where to resume (numbering and schedule phase)
+// without scanning the output folder. A torn last entry is dropped.
+// The entries double as the manifest of the run: name, size and CRC-32C
+// of every still, so its integrity can be checked without reading the
+// data again on the device.
+class RunJournal
+{
+public:
+    typedef struct {
+        uint32_t index;       /// Frame index in the run
+        uint32_t size;        /// Bytes on disk
+        uint64_t reserved;    /// Zero
+        int64_t  timestampMs; /// Capture time, ms since the epoch
+        char     name[96];    /// File name (without the folder), null terminated
+        uint32_t crc;         /// CRC-32C of the file
+        uint32_t checksum;    /// CRC-32C of all the fields above
+    } ENTRY_T;
+
+public:
+    RunJournal();
+    ~RunJournal();
+
+public:
+    bool open(QString sPathName);
+    void close();
+    bool append(uint32_t index, QString sFileName, uint32_t size, uint32_t crc);
+    bool hasLast() const;
+    ENTRY_T last() const;
+    uint64_t entries() const;
+
+protected:
+    bool recover();
+    static uint32_t checksum(const ENTRY_T& entry);
+
+private:
+    int fd;
+    ENTRY_T lastEntry;
+    bool bHasLast;
+    uint64_t nEntries;
+};
@@ -0,0 +1,258 @@
+#include "sensorcalibration.h"
+#include "picamera.h"
+#include "jpegencoder.h"
+#include "utility.h"
+
+#include <QDebug>
+#include <QSettings>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <chrono>
+
+
+#define CALIBRATION_FRAMES 5
+#define INTERVAL_MARGIN    1.2 // The capture must take less than interval/margin
+#define AE_TOLERANCE       0.05
+#define AE_STABLE_FRAMES   3
+
+
+// Modes of the supported sensors (see the camera documentation)
+static const struct {
+    const char *name;
+    SensorCalibration::SENSOR_MODE_T modes[7];
+    int nModes;
+} sensorTable[] = {
+    {"ov5647", {{1, 1920, 1080, 30.0, false},
+                {2, 2592, 1944, 15.0, true},
+                {3, 2592, 1944,  1.0, true},
+                {4, 1296,  972, 42.0, true},
+                {5, 1296,  730, 49.0, false},
+                {6,  640,  480, 90.0, false},
+                {7,  640,  480, 90.0, false}}, 7},
+    {"imx219", {{1, 1920, 1080, 30.0, false},
+                {2, 3280, 2464, 15.0, true},
+                {3, 3280, 2464, 15.0, true},
+                {4, 1640, 1232, 40.0, true},
+                {5, 1640,  922, 40.0, false},
+                {6, 1280,  720, 90.0, false},
+                {7,  640,  480, 90.0, false}}, 7},
+    {"imx477", {{1, 2028, 1080, 50.0, false},
+                {2, 2028, 1520, 50.0, true},
+                {3, 4056, 3040, 10.0, true},
+                {4, 1332,  990, 120.0, false}}, 4}
+};
+
+
+SensorCalibration::SensorCalibration(int cameraNum, const char *cameraName, int width, int height)
+    : cameraNum(cameraNum)
+    , width(width)
+    , height(height)
+{
+    strncpy(this->cameraName, cameraName, sizeof(this->cameraName));
+    this->cameraName[sizeof(this->cameraName)-1] = 0;
+}
+
+
+/// The modes of a sensor (empty if the sensor is unknown)
+std::vector<SensorCalibration::SENSOR_MODE_T>
+SensorCalibration::sensorModes(const char *cameraName) {
+    for(const auto& sensor : sensorTable) {
+        if(strncasecmp(cameraName, sensor.name, strlen(sensor.name)) == 0)
+            return std::vector<SENSOR_MODE_T>(sensor.modes, sensor.modes + sensor.nModes);
+    }
+    return std::vector<SENSOR_MODE_T>();
+}
+
+
+const std::vector<SensorCalibration::RESULT_T>&
+SensorCalibration::results() const {
+    return measured;
+}
+
+
+/**
+ * Measure all the modes of the sensor, one camera pipeline at a time
+ * @param nFrames Captures per mode
+ * @return false if the sensor is unknown
+ */
+bool
+SensorCalibration::run(int nFrames) {
+    std::vector<SENSOR_MODE_T> modes = sensorModes(cameraName);
+    if(modes.empty()) {
+        qDebug() << QString("%1: No mode table for %2").arg(__func__).arg(cameraName);
+        return false;
+    }
+    measured.clear();
+    for(const auto& sensorMode : modes) {
+        measured.push_back(measure(sensorMode, nFrames));
+        const RESULT_T& result = measured.back();
+        qDebug() << QString("Mode %1 (%2x%3%4): %5 ms, %6 fps, %7 bytes")
+                    .arg(sensorMode.mode)
+                    .arg(sensorMode.width)
+                    .arg(sensorMode.height)
+                    .arg(sensorMode.bFullFov ? " full FOV" : "")
+                    .arg(result.latencyMs, 0, 'f', 1)
+                    .arg(result.fps, 0, 'f', 2)
+                    .arg(result.bytes);
+    }
+    return true;
+}
+
+
+/**
+ * Build the tunnelled still pipeline in a sensor mode and time the captures
+ * (the preview port goes to a null sink: nothing is shown)
+ */
+SensorCalibration::RESULT_T
+SensorCalibration::measure(const SENSOR_MODE_T& sensorMode, int nFrames) {
+    RESULT_T result = {sensorMode, false, 0.0, 0.0, 0};
+    AeConvergence convergence(AE_TOLERANCE, AE_STABLE_FRAMES);
+    PiCamera camera(cameraNum, sensorMode.mode);
+    camera.pAeConvergence = &convergence;
+    MMAL_PARAMETER_CAMERA_CONFIG_T camConfig;
+    camConfig.hdr = { MMAL_PARAMETER_CAMERA_CONFIG, sizeof(camConfig) };
+    camConfig.max_stills_w = uint32_t(width);
+    camConfig.max_stills_h = uint32_t(height);
+    camConfig.stills_yuv422 = 0;
+    camConfig.one_shot_stills = 1;
+    camConfig.max_preview_video_w = 640;
+    camConfig.max_preview_video_h = 480;
+    camConfig.num_preview_video_frames = 3;
+    camConfig.stills_capture_circular_buffer_height = 0;
+    camConfig.fast_preview_resume = 0;
+    camConfig.use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC;
+    if(camera.setConfig(&camConfig) != MMAL_SUCCESS ||
+       camera.setPortFormats(false, MMAL_ENCODING_JPEG, width, height) != MMAL_SUCCESS ||
+       camera.enableCamera() != MMAL_SUCCESS)
+        return result;
+    MMAL_COMPONENT_T *nullSink = nullptr;
+    MMAL_CONNECTION_T *previewConnection = nullptr;
+    if(mmal_component_create("vc.null_sink", &nullSink) != MMAL_SUCCESS)
+        return result;
+    if(mmal_connection_create(&previewConnection,
+                              camera.component->output[MMAL_CAMERA_PREVIEW_PORT],
+                              nullSink->input[0],
+                              MMAL_CONNECTION_FLAG_TUNNELLING |
+                              MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT) != MMAL_SUCCESS ||
+       mmal_connection_enable(previewConnection) != MMAL_SUCCESS) {
+        if(previewConnection)
+            mmal_connection_destroy(previewConnection);
+        mmal_component_destroy(nullSink);
+        return result;
+    }
+    JpegEncoder encoder;
+    camera.start(&encoder);
+    // Let the exposure settle as the real runs do
+    convergence.wait(CAMERA_SETTLE_TIME);
+    std::vector<uint8_t> buffer(size_t(width)*size_t(height)*3);
+    std::vector<double> latencies;
+    uint64_t totalBytes = 0;
+    auto runStart = std::chrono::steady_clock::now();
+    for(int i=0; i<nFrames; i++) {
+        auto start = std::chrono::steady_clock::now();
+        uint32_t length = camera.captureEncoded(buffer.data(), uint32_t(buffer.size()));
+        auto end = std::chrono::steady_clock::now();
+        if(length == 0)
+            break;
+        latencies.push_back(std::chrono::duration<double, std::milli>(end-start).count());
+        totalBytes += length;
+    }
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-runStart).count();
+    camera.stop(&encoder);
+    encoder.destroy();
+    mmal_connection_destroy(previewConnection);
+    mmal_component_destroy(nullSink);
+    if(int(latencies.size()) == nFrames) {
+        std::sort(latencies.begin(), latencies.end());
+        result.bOk       = true;
+        result.latencyMs = latencies[latencies.size()/2];
+        result.fps       = 1000.0*nFrames/totalMs;
+        result.bytes     = uint32_t(totalBytes/uint64_t(nFrames));
+    }
+    return result;
+}
+
+
+/**
+ * The mode to use for a run.
+ * Among the modes with the required field of view whose captures fit
+ * in the interval, the fastest one reading at least the output size
+ * (no upscaling). If none reads enough pixels, the biggest one. If none
+ * fits in the interval, simply the fastest one.
+ * @param msecInterval Interval between the stills
+ * @param bFullFov     Only consider the modes using the whole sensor
+ * @return the sensor mode (0 = let the firmware choose)
+ */
+int
+SensorCalibration::bestMode(int msecInterval, bool bFullFov) const {
+    const RESULT_T *pFastest = nullptr;
+    const RESULT_T *pBest    = nullptr;
+    const RESULT_T *pBiggest = nullptr;
+    for(const auto& result : measured) {
+        const SENSOR_MODE_T& mode = result.sensorMode;
+        if(!result.bOk || (bFullFov && !mode.bFullFov))
+            continue;
+        if(!pFastest || result.latencyMs < pFastest->latencyMs)
+            pFastest = &result;
+        if(result.latencyMs*INTERVAL_MARGIN > msecInterval)
+            continue;
+        if(mode.width >= width && mode.height >= height) {
+            if(!pBest || result.latencyMs < pBest->latencyMs)
+                pBest = &result;
+        }
+        else if(!pBiggest || mode.width*mode.height > pBiggest->sensorMode.width*pBiggest->sensorMode.height)
+            pBiggest = &result;
+    }
+    if(pBest)
+        return pBest->sensorMode.mode;
+    if(pBiggest)
+        return pBiggest->sensorMode.mode;
+    if(pFastest)
+        return pFastest->sensorMode.mode;
+    return 0;
+}
+
+
+/// Persist the measures and the chosen mode (used by the next runs)
+void
+SensorCalibration::save(int bestMode) const {
+    QSettings settings;
+    for(const auto& result : measured) {
+        QString sKey = QString("Calibration/%1/Mode%2/").arg(cameraName).arg(result.sensorMode.mode);
+        settings.setValue(sKey + QString("LatencyMs"), result.latencyMs);
+        settings.setValue(sKey + QString("Fps"), result.fps);
+        settings.setValue(sKey + QString("Bytes"), result.bytes);
+    }
+    // Its LatencyMs above seeds the LatencyModel of the runs
+    settings.setValue("SensorMode", bestMode);
+}
+
+
+/**
+ * Calibrate the detected camera and store the best mode for the saved
+ * interval and field of view (run with: slowMotion --calibrate [width height])
+ * @param width   Output width  (0 = sensor size)
+ * @param height  Output height (0 = sensor size)
+ * @return the process exit status
+ */
+int
+runSensorCalibration(int width, int height) {
+    char cameraName[MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN];
+    getSensorDefaults(0, cameraName, &width, &height);
+    QSettings settings;
+    int msecInterval = settings.value("Interval", 10000).toInt();
+    bool bFullFov    = settings.value("RequireFullFov", true).toBool();
+    SensorCalibration calibration(0, cameraName, width, height);
+    if(!calibration.run(CALIBRATION_FRAMES))
+        return EXIT_FAILURE;
+    int mode = calibration.bestMode(msecInterval, bFullFov);
+    calibration.save(mode);
+    qDebug() << QString("%1 at %2x%3, interval %4 ms: sensor mode %5")
+                .arg(cameraName)
+                .arg(width)
+                .arg(height)
+                .arg(msecInterval)
+                .arg(mode);
+    return EXIT_SUCCESS;
+}
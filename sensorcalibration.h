@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+
+// Measures every sensor mode of the detected camera at the requested
+// output size (real capture latency, sustained rate and encoded size)
+// and picks the one that fits a capture interval and field of view.
+class SensorCalibration
+{
+public:
+    SensorCalibration(int cameraNum, const char *cameraName, int width, int height);
+
+public:
+    typedef struct {
+        int mode;         /// Value for MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG
+        int width;        /// Frame size read from the sensor
+        int height;
+        double maxFps;
+        bool bFullFov;    /// Whole sensor area (binned or not)
+    } SENSOR_MODE_T;
+
+    typedef struct {
+        SENSOR_MODE_T sensorMode;
+        bool bOk;
+        double latencyMs; /// Median time from the capture request to the end of the JPEG
+        double fps;       /// Sustained back to back captures
+        uint32_t bytes;   /// Mean encoded size
+    } RESULT_T;
+
+    static std::vector<SENSOR_MODE_T> sensorModes(const char *cameraName);
+    bool run(int nFrames);
+    int bestMode(int msecInterval, bool bFullFov) const;
+    void save(int bestMode) const;
+    const std::vector<RESULT_T>& results() const;
+
+protected:
+    RESULT_T measure(const SENSOR_MODE_T& sensorMode, int nFrames);
+
+private:
+    int cameraNum;
+    char cameraName[32];
+    int width;            /// Output size
+    int height;
+    std::vector<RESULT_T> measured;
+};
+
+
+int runSensorCalibration(int width, int height);
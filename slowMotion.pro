@@ -19,6 +19,12 @@ SDKSTAGE = /home/pi/vc
 CONFIG += c++14
 
 
+# The image processing kernels use NEON when the compiler is allowed to
+contains(QMAKE_HOST.arch, armv7l): QMAKE_CXXFLAGS += -mfpu=neon-vfpv4
+# and the checksums the ARMv8 CRC instructions (all the 64 bit Pi have them)
+contains(QMAKE_HOST.arch, aarch64): QMAKE_CXXFLAGS += -march=armv8-a+crc
+
+
 SOURCES += main.cpp \
     utility.cpp \
     jpegencoder.cpp
@@ -28,6 +34,31 @@ SOURCES += maindialog.cpp
 SOURCES += preview.cpp
 SOURCES +=
 SOURCES += cameracontrol.cpp
+SOURCES += hdrfusion.cpp
+SOURCES += hdrworker.cpp
+SOURCES += stackaccumulator.cpp
+SOURCES += dngwriter.cpp
+SOURCES += rawworker.cpp
+SOURCES += motiondetector.cpp
+SOURCES += framering.cpp
+SOURCES += videoencoder.cpp
+SOURCES += triggercapture.cpp
+SOURCES += exifwriter.cpp
+SOURCES += framewriter.cpp
+SOURCES += stagingmover.cpp
+SOURCES += ratecontrol.cpp
+SOURCES += qoiencoder.cpp
+SOURCES += benchmark.cpp
+SOURCES += pyramidworker.cpp
+SOURCES += sensorcalibration.cpp
+SOURCES += latencymodel.cpp
+SOURCES += aeconvergence.cpp
+SOURCES += thermalgovernor.cpp
+SOURCES += bufferplanner.cpp
+SOURCES += runjournal.cpp
+SOURCES += crc32c.cpp
+SOURCES += framebus.cpp
+SOURCES += streamsink.cpp
 
 
 INCLUDEPATH += $$SDKSTAGE/include/
@@ -45,6 +76,31 @@ HEADERS += picamera.h
 HEADERS += preview.h
 HEADERS +=
 HEADERS += cameracontrol.h
+HEADERS += hdrfusion.h
+HEADERS += hdrworker.h
+HEADERS += stackaccumulator.h
+HEADERS += dngwriter.h
+HEADERS += rawworker.h
+HEADERS += motiondetector.h
+HEADERS += framering.h
+HEADERS += videoencoder.h
+HEADERS += triggercapture.h
+HEADERS += exifwriter.h
+HEADERS += framewriter.h
+HEADERS += stagingmover.h
+HEADERS += ratecontrol.h
+HEADERS += qoiencoder.h
+HEADERS += benchmark.h
+HEADERS += pyramidworker.h
+HEADERS += sensorcalibration.h
+HEADERS += latencymodel.h
+HEADERS += aeconvergence.h
+HEADERS += thermalgovernor.h
+HEADERS += bufferplanner.h
+HEADERS += runjournal.h
+HEADERS += crc32c.h
+HEADERS += framebus.h
+HEADERS += streamsink.h
 
 
 FORMS += maindialog.ui
@@ -59,6 +115,7 @@ LIBS += -lvcos
 LIBS += -lmmal
 LIBS += -lmmal_core
 LIBS += -lmmal_util
+LIBS += -lrt # shm_open() on the older glibc
 
 LIBS += -L"/usr/local/lib" -lpigpiod_if2
 
@@ -0,0 +1,206 @@
+#include "stackaccumulator.h"
+#include "utility.h"
+
+#include <string.h>
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define STACK_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define STACK_USE_SSE2
+#endif
+
+
+#define MEDIAN_START_STEP (64 << 8) // First correction of the running median (8.8 fixed point)
+#define MEDIAN_MIN_STEP   (1 << 8)  // Smallest correction of the running median
+#define PARALLEL_MIN_BYTES 65536    // Chunks smaller than this are not worth splitting
+
+
+/// acc += src
+static void
+sumKernel(uint32_t *pAcc, const uint8_t *pSrc, int n) {
+    int i = 0;
+#if defined(STACK_USE_NEON)
+    for(; i+16<=n; i+=16) {
+        uint8x16_t v  = vld1q_u8(pSrc+i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+        vst1q_u32(pAcc+i,    vaddw_u16(vld1q_u32(pAcc+i),    vget_low_u16(lo)));
+        vst1q_u32(pAcc+i+4,  vaddw_u16(vld1q_u32(pAcc+i+4),  vget_high_u16(lo)));
+        vst1q_u32(pAcc+i+8,  vaddw_u16(vld1q_u32(pAcc+i+8),  vget_low_u16(hi)));
+        vst1q_u32(pAcc+i+12, vaddw_u16(vld1q_u32(pAcc+i+12), vget_high_u16(hi)));
+    }
+#elif defined(STACK_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for(; i+16<=n; i+=16) {
+        __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc+i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i *pA = reinterpret_cast<__m128i*>(pAcc+i);
+        _mm_storeu_si128(pA,   _mm_add_epi32(_mm_loadu_si128(pA),   _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(pA+1, _mm_add_epi32(_mm_loadu_si128(pA+1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(pA+2, _mm_add_epi32(_mm_loadu_si128(pA+2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(pA+3, _mm_add_epi32(_mm_loadu_si128(pA+3), _mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+    for(; i<n; i++)
+        pAcc[i] += pSrc[i];
+}
+
+
+/// acc = max(acc, src << 8)
+static void
+maxKernel(uint16_t *pAcc, const uint8_t *pSrc, int n) {
+    int i = 0;
+#if defined(STACK_USE_NEON)
+    for(; i+16<=n; i+=16) {
+        uint8x16_t v = vld1q_u8(pSrc+i);
+        vst1q_u16(pAcc+i,   vmaxq_u16(vld1q_u16(pAcc+i),   vshll_n_u8(vget_low_u8(v), 8)));
+        vst1q_u16(pAcc+i+8, vmaxq_u16(vld1q_u16(pAcc+i+8), vshll_n_u8(vget_high_u8(v), 8)));
+    }
+#elif defined(STACK_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for(; i+16<=n; i+=16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc+i));
+        __m128i *pA = reinterpret_cast<__m128i*>(pAcc+i);
+        __m128i xLo = _mm_unpacklo_epi8(zero, v);
+        __m128i xHi = _mm_unpackhi_epi8(zero, v);
+        __m128i aLo = _mm_loadu_si128(pA);
+        __m128i aHi = _mm_loadu_si128(pA+1);
+        // SSE2 has no unsigned 16 bit max: max(a, x) = x + (a -sat x)
+        _mm_storeu_si128(pA,   _mm_adds_epu16(_mm_subs_epu16(aLo, xLo), xLo));
+        _mm_storeu_si128(pA+1, _mm_adds_epu16(_mm_subs_epu16(aHi, xHi), xHi));
+    }
+#endif
+    for(; i<n; i++)
+        pAcc[i] = std::max(pAcc[i], uint16_t(pSrc[i] << 8));
+}
+
+
+/// acc moves towards (src << 8) by at most step
+static void
+medianKernel(uint16_t *pAcc, const uint8_t *pSrc, int n, uint16_t step) {
+    int i = 0;
+#if defined(STACK_USE_NEON)
+    const uint16x8_t vStep = vdupq_n_u16(step);
+    for(; i+16<=n; i+=16) {
+        uint8x16_t v = vld1q_u8(pSrc+i);
+        uint16x8_t x[2] = { vshll_n_u8(vget_low_u8(v), 8), vshll_n_u8(vget_high_u8(v), 8) };
+        for(int h=0; h<2; h++) {
+            uint16x8_t a    = vld1q_u16(pAcc+i+8*h);
+            uint16x8_t up   = vminq_u16(vqsubq_u16(x[h], a), vStep);
+            uint16x8_t down = vminq_u16(vqsubq_u16(a, x[h]), vStep);
+            vst1q_u16(pAcc+i+8*h, vsubq_u16(vaddq_u16(a, up), down));
+        }
+    }
+#elif defined(STACK_USE_SSE2)
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i vStep = _mm_set1_epi16(short(step));
+    for(; i+16<=n; i+=16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc+i));
+        __m128i x[2] = { _mm_unpacklo_epi8(zero, v), _mm_unpackhi_epi8(zero, v) };
+        for(int h=0; h<2; h++) {
+            __m128i *pA = reinterpret_cast<__m128i*>(pAcc+i+8*h);
+            __m128i a    = _mm_loadu_si128(pA);
+            __m128i up   = _mm_subs_epu16(x[h], a);
+            __m128i down = _mm_subs_epu16(a, x[h]);
+            // SSE2 has no unsigned 16 bit min: min(d, s) = d - (d -sat s)
+            up   = _mm_sub_epi16(up,   _mm_subs_epu16(up,   vStep));
+            down = _mm_sub_epi16(down, _mm_subs_epu16(down, vStep));
+            _mm_storeu_si128(pA, _mm_sub_epi16(_mm_add_epi16(a, up), down));
+        }
+    }
+#endif
+    for(; i<n; i++) {
+        int x = pSrc[i] << 8;
+        int delta = std::max(-int(step), std::min(int(step), x - int(pAcc[i])));
+        pAcc[i] = uint16_t(pAcc[i] + delta);
+    }
+}
+
+
+StackAccumulator::StackAccumulator(StackMode mode, uint32_t frameSize)
+    : mode(mode)
+    , frameSize(frameSize)
+    , nFrames(0)
+{
+    if(mode == STACK_MEAN)
+        sum.resize(frameSize);
+    else
+        acc.resize(frameSize);
+}
+
+
+/// Start a new stack
+void
+StackAccumulator::reset() {
+    nFrames = 0;
+    if(mode == STACK_MEAN)
+        memset(sum.data(), 0, sum.size()*sizeof(uint32_t));
+    else
+        memset(acc.data(), 0, acc.size()*sizeof(uint16_t));
+}
+
+
+/**
+ * Fold a chunk of a still frame into the accumulator
+ * @param pData  Chunk data
+ * @param offset Position of the chunk in the frame (0 starts a new frame)
+ * @param length Chunk length in bytes
+ */
+void
+StackAccumulator::consume(const uint8_t *pData, uint32_t offset, uint32_t length) {
+    if(offset == 0)
+        nFrames++;
+    if(offset >= frameSize)
+        return;
+    length = std::min(length, frameSize-offset);
+    uint16_t step = uint16_t(std::max(MEDIAN_MIN_STEP, MEDIAN_START_STEP >> std::min(nFrames-1, 15)));
+    // The kernels are byte-wise: any split of the chunk gives the same result
+    int nBands = int(std::min(length / PARALLEL_MIN_BYTES + 1, 64u));
+    runParallel(nBands, [this, pData, offset, length, nBands, step](int first, int last) {
+        uint32_t begin = uint32_t(uint64_t(length)*uint32_t(first)/uint32_t(nBands));
+        uint32_t end   = uint32_t(uint64_t(length)*uint32_t(last)/uint32_t(nBands));
+        int n = int(end-begin);
+        if(mode == STACK_MEAN)
+            sumKernel(sum.data()+offset+begin, pData+begin, n);
+        else if(mode == STACK_LIGHTEN)
+            maxKernel(acc.data()+offset+begin, pData+begin, n);
+        else if(nFrames == 1) // The running median starts from the first frame
+            for(int i=0; i<n; i++)
+                acc[offset+begin+uint32_t(i)] = uint16_t(pData[begin+uint32_t(i)] << 8);
+        else
+            medianKernel(acc.data()+offset+begin, pData+begin, n, step);
+    });
+}
+
+
+/**
+ * Convert the accumulator to an 8 bit frame
+ * @param pOut Destination frame (frameSize bytes)
+ */
+void
+StackAccumulator::result(uint8_t *pOut) {
+    if(mode == STACK_MEAN) {
+        if(nFrames == 0) {
+            memset(pOut, 0, frameSize);
+            return;
+        }
+        // sum * (2^24/n) can not overflow: sum <= 255*n
+        const uint32_t reciprocal = (1u << 24) / uint32_t(nFrames);
+        for(uint32_t i=0; i<frameSize; i++)
+            pOut[i] = uint8_t(std::min((sum[i]*reciprocal + (1u << 23)) >> 24, 255u));
+    }
+    else {
+        for(uint32_t i=0; i<frameSize; i++)
+            pOut[i] = uint8_t(std::min((acc[i] + 128u) >> 8, 255u));
+    }
+}
+
+
+int
+StackAccumulator::stackedFrames() const {
+    return nFrames;
+}
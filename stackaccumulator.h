@@ -0,0 +1,35 @@
+#pragma once
+
+#include "picamera.h"
+
+#include <stdint.h>
+#include <vector>
+
+
+// Stacks several short exposures into a single frame.
+// Every still is folded into the accumulator as its buffers arrive,
+// so the memory needed does not depend on the number of stacked frames.
+class StackAccumulator : public FrameConsumer
+{
+public:
+    enum StackMode {
+        STACK_MEAN,    /// Average: lowest noise
+        STACK_MEDIAN,  /// Running median estimate: rejects planes, satellites, hot pixels
+        STACK_LIGHTEN  /// Per pixel maximum: star trails
+    };
+
+    StackAccumulator(StackMode mode, uint32_t frameSize);
+
+public:
+    void reset();
+    void consume(const uint8_t *pData, uint32_t offset, uint32_t length) Q_DECL_OVERRIDE;
+    void result(uint8_t *pOut);
+    int stackedFrames() const;
+
+private:
+    StackMode mode;
+    uint32_t frameSize;
+    int nFrames;                  /// Frames started since the last reset()
+    std::vector<uint32_t> sum;    /// Mean accumulator
+    std::vector<uint16_t> acc;    /// Median and lighten accumulator (8.8 fixed point)
+};
@@ -0,0 +1,170 @@
+#include "stagingmover.h"
+#include "utility.h"
+#include <QDebug>
+#include <QFileInfo>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <vector>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+
+// From linux/ioprio.h (not exported by the C library)
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_WHO_PROCESS 1
+
+#define MOVE_CHUNK    (1 << 20)
+#define MOVE_RETRY_MS 500 // Times the retry number
+
+
+StagingMover::StagingMover(QString sStagingDir, uint64_t budget)
+    : sStagingDir(sStagingDir)
+    , budget(budget)
+    , pending(0)
+    , stranded(0)
+    , bStop(false)
+{
+    worker = std::thread(&StagingMover::run, this);
+}
+
+
+/// Waits for all the staged stills to be moved, then stops the mover
+StagingMover::~StagingMover() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    cond.notify_all();
+    worker.join();
+    target.end();
+    if(stranded)
+        qDebug() << QString("%1 MB of stills left in %2").arg(stranded >> 20).arg(sStagingDir);
+}
+
+
+/// Where a still goes before being moved to sPathName
+QString
+StagingMover::stagingPath(QString sPathName) const {
+    return QString("%1/%2").arg(sStagingDir).arg(QFileInfo(sPathName).fileName());
+}
+
+
+/**
+ * Block until the staging area has room for a still
+ * (an empty staging area always accepts one)
+ * @param bytes Expected size of the still
+ * @return false if the area is full of stills that could not be moved
+ */
+bool
+StagingMover::waitForRoom(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if(pending && pending + bytes > budget && verbose)
+        qDebug() << QString("%1: Staging area full, waiting for the mover").arg(__func__);
+    cond.wait(lock, [this, bytes] { return pending == stranded || pending + bytes <= budget; });
+    return pending == 0 || pending + bytes <= budget;
+}
+
+
+/// Queue a staged still for moving (frameIndex: of the still in the run)
+void
+StagingMover::submit(QString sStagedPath, QString sPathName, int frameIndex) {
+    struct stat fileStat;
+    if(stat(sStagedPath.toLatin1(), &fileStat) != 0) {
+        qDebug() << QString("%1: %2 was not staged").arg(__func__).arg(sStagedPath);
+        return;
+    }
+    uint64_t bytes = uint64_t(fileStat.st_size);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(MOVE_JOB_T{sStagedPath, sPathName, frameIndex, bytes});
+        pending += bytes;
+    }
+    cond.notify_all();
+}
+
+
+uint64_t
+StagingMover::pendingBytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending;
+}
+
+
+void
+StagingMover::run() {
+    // Only this thread: the capture keeps the normal priority
+    if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+               (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | MOVER_IO_PRIORITY) != 0)
+        qDebug() << "Unable to lower the I/O priority of the mover";
+    for(;;) {
+        MOVE_JOB_T job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return bStop || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+            job = jobs.front(); // Stays queued (and counted) until moved
+        }
+        bool bMoved = move(job.sStagedPath, job.sPathName, job.frameIndex);
+        for(int retry=1; !bMoved && retry<=MOVE_RETRIES; retry++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(MOVE_RETRY_MS*retry));
+            bMoved = move(job.sStagedPath, job.sPathName, job.frameIndex);
+        }
+        if(!bMoved)
+            qDebug() << QString("%1: Unable to move %2 to %3: left in the staging area")
+                        .arg(__func__)
+                        .arg(job.sStagedPath)
+                        .arg(job.sPathName);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.pop_front();
+            if(bMoved)
+                pending -= job.bytes;
+            else // Still taking room in the staging area
+                stranded += job.bytes;
+        }
+        cond.notify_all();
+    }
+}
+
+
+/**
+ * Copy a staged still to its destination and remove it from the staging area
+ * (the staged file is kept if the copy fails)
+ */
+bool
+StagingMover::move(QString sStagedPath, QString sPathName, int frameIndex) {
+    int fd = open(sStagedPath.toLatin1(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    if(!target.open(sPathName, frameIndex)) {
+        close(fd);
+        return false;
+    }
+    std::vector<uint8_t> buffer(MOVE_CHUNK);
+    bool bOk = true;
+    for(;;) {
+        ssize_t length = read(fd, buffer.data(), buffer.size());
+        if(length < 0 && errno == EINTR)
+            continue;
+        if(length <= 0) {
+            bOk = length == 0;
+            break;
+        }
+        if(target.write(buffer.data(), uint32_t(length)) != uint32_t(length)) {
+            bOk = false;
+            break;
+        }
+    }
+    close(fd);
+    if(!bOk) // Neither kept nor journaled
+        target.cancel();
+    bOk = target.close() && bOk;
+    if(bOk)
+        unlink(sStagedPath.toLatin1());
+    return bOk;
+}
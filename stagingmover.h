@@ -0,0 +1,58 @@
+#pragma once
+
+#include "framewriter.h"
+
+#include <QString>
+#include <stdint.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Moves the stills captured into a RAM (tmpfs) staging directory to
+// their final destination, in capture order, from a thread running at
+// the lowest I/O priority. The staging area is bounded: waitForRoom()
+// blocks the capture side until the mover has caught up. A still that
+// cannot be moved (after a few retries) stays in the staging area, and
+// keeps its room there, for recovery by hand.
+class StagingMover
+{
+public:
+    StagingMover(QString sStagingDir, uint64_t budget);
+    ~StagingMover();
+
+public:
+    QString stagingPath(QString sPathName) const;
+    bool waitForRoom(uint64_t bytes);
+    void submit(QString sStagedPath, QString sPathName, int frameIndex);
+    uint64_t pendingBytes();
+
+protected:
+    void run();
+    bool move(QString sStagedPath, QString sPathName, int frameIndex);
+
+public:
+    FrameWriter target;        /// Writes the final files (see FrameWriter::begin())
+
+    static const int MOVER_IO_PRIORITY = 7; /// Lowest of the best effort class
+    static const int MOVE_RETRIES      = 3; /// Before a still is left in the staging area
+
+private:
+    typedef struct {
+        QString sStagedPath;
+        QString sPathName;
+        int frameIndex;        /// Journaled when moved (see FrameWriter::open())
+        uint64_t bytes;
+    } MOVE_JOB_T;
+
+    QString sStagingDir;
+    uint64_t budget;
+    uint64_t pending;          /// Bytes in the staging area
+    uint64_t stranded;         /// Of them, the stills that could not be moved
+    std::deque<MOVE_JOB_T> jobs;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool bStop;
+    std::thread worker;
+};
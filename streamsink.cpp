@@ -0,0 +1,288 @@
+#include "streamsink.h"
+
+#include <QDebug>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+
+#define PIPE_SIZE (1 << 20) // Asked for the pipe (the default pipe-max-size)
+#define POLL_MS   100       // The waits for the consumer check for a stop this often
+#define SPARE_FRAMES 2      // Besides the queue: the frame being assembled and the one being output
+
+
+/**
+ * @param sPathName     "-" for stdout, or a FIFO (created if missing)
+ * @param maxFrameBytes Largest frame: larger ones are dropped
+ * @param backpressure  A StreamSink::Backpressure
+ * @param framing       A StreamSink::Framing
+ * @param queueDepth    Frames waiting for the consumer
+ */
+StreamSink::StreamSink(QString sPathName, uint32_t maxFrameBytes, int backpressure, int framing, int queueDepth)
+    : sPathName(sPathName)
+    , mapSize(0)
+    , pageSize(0)
+    , backpressure(backpressure)
+    , framing(framing)
+    , queueDepth(size_t(queueDepth > 0 ? queueDepth : 1))
+    , fd(-1)
+    , bPipe(false)
+    , pCurrent(nullptr)
+    , currentLength(0)
+    , bOverflow(false)
+    , seq(0)
+    , nDropped(0)
+    , bStop(false)
+{
+    pageSize = uint32_t(sysconf(_SC_PAGESIZE));
+    mapSize = (uint32_t(sizeof(FRAME_HEADER_T)) + maxFrameBytes + pageSize-1) / pageSize * pageSize;
+    // Mapped once: the pages are only populated when the frames are written
+    for(size_t i=0; i<this->queueDepth+SPARE_FRAMES; i++) {
+        void *p = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) {
+            qDebug() << QString("%1: Unable to map the frame buffers: %2").arg(__func__).arg(strerror(errno));
+            break;
+        }
+        pool.push_back(static_cast<uint8_t*>(p));
+    }
+    freeFrames = pool;
+    // A consumer going away must not kill the capture
+    signal(SIGPIPE, SIG_IGN);
+    worker = std::thread(&StreamSink::run, this);
+}
+
+
+/// Outputs the queued frames, then stops
+StreamSink::~StreamSink() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    cond.notify_all();
+    worker.join();
+    discard();
+    for(uint8_t *pFrame : pool)
+        munmap(pFrame, mapSize);
+    if(fd >= 0 && fd != STDOUT_FILENO)
+        close(fd);
+}
+
+
+/// Add a chunk to the current frame (called from the encoder callbacks)
+void
+StreamSink::append(const uint8_t *pData, uint32_t length) {
+    if(!pCurrent && !bOverflow) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(backpressure == BACKPRESSURE_BLOCK && !pool.empty())
+            cond.wait(lock, [this] { return bStop || !freeFrames.empty(); });
+        if(freeFrames.empty()) { // Dropped at endFrame()
+            bOverflow = true;
+            return;
+        }
+        pCurrent = freeFrames.back();
+        freeFrames.pop_back();
+        currentLength = framing == FRAMING_HEADER ? uint32_t(sizeof(FRAME_HEADER_T)) : 0;
+    }
+    if(bOverflow || length > mapSize - currentLength) {
+        bOverflow = true;
+        return;
+    }
+    memcpy(pCurrent + currentLength, pData, length);
+    currentLength += length;
+}
+
+
+/// The current frame is complete: queue it for the consumer
+void
+StreamSink::endFrame() {
+    if(!pCurrent && !bOverflow)
+        return;
+    seq++;
+    if(bOverflow) {
+        discard();
+        std::lock_guard<std::mutex> lock(mutex);
+        nDropped++;
+        return;
+    }
+    if(framing == FRAMING_HEADER) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        FRAME_HEADER_T header;
+        header.magic       = FRAME_MAGIC;
+        header.seq         = seq;
+        header.length      = currentLength - uint32_t(sizeof(FRAME_HEADER_T));
+        header.reserved    = 0;
+        header.timestampUs = int64_t(now.tv_sec)*1000000 + now.tv_nsec/1000;
+        memcpy(pCurrent, &header, sizeof(header));
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if(backpressure == BACKPRESSURE_BLOCK)
+        cond.wait(lock, [this] { return bStop || frames.size() < queueDepth; });
+    if(bStop || frames.size() >= queueDepth) {
+        lock.unlock();
+        discard();
+        lock.lock();
+        nDropped++;
+        return;
+    }
+    frames.push_back(FRAME_T{pCurrent, currentLength});
+    pCurrent = nullptr;
+    lock.unlock();
+    cond.notify_all();
+}
+
+
+/// Forget the current frame (it could not be written)
+void
+StreamSink::discard() {
+    if(pCurrent) // Never spliced: reused as it is
+        recycle(pCurrent, 0);
+    pCurrent = nullptr;
+    currentLength = 0;
+    bOverflow = false;
+}
+
+
+/**
+ * Give a buffer back to the pool
+ * @param pFrame        The buffer
+ * @param splicedLength Bytes handed over to the pipe: their pages are
+ *                      replaced, the pipe may still be reading them
+ */
+void
+StreamSink::recycle(uint8_t *pFrame, uint32_t splicedLength) {
+    if(splicedLength)
+        madvise(pFrame, (splicedLength + pageSize-1) / pageSize * pageSize, MADV_DONTNEED);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeFrames.push_back(pFrame);
+    }
+    cond.notify_all();
+}
+
+
+/// Frames not sent to the consumer so far
+uint32_t
+StreamSink::dropped() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return nDropped;
+}
+
+
+/// true once the destructor has been called
+bool
+StreamSink::stopping() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bStop;
+}
+
+
+/// Open stdout or the FIFO (waits for a reader of the FIFO)
+bool
+StreamSink::openOutput() {
+    if(sPathName == QString("-")) {
+        fd = STDOUT_FILENO;
+    }
+    else {
+        QByteArray path = sPathName.toLocal8Bit();
+        struct stat st;
+        if(stat(path.constData(), &st) != 0 && mkfifo(path.constData(), 0644) != 0) {
+            qDebug() << QString("%1: Unable to create %2: %3").arg(__func__).arg(sPathName).arg(strerror(errno));
+            return false;
+        }
+        // Without a reader a non blocking open fails with ENXIO
+        while((fd = open(path.constData(), O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+            if(errno != ENXIO || stopping()) {
+                qDebug() << QString("%1: Unable to open %2: %3").arg(__func__).arg(sPathName).arg(strerror(errno));
+                return false;
+            }
+            usleep(POLL_MS*1000);
+        }
+    }
+    struct stat st;
+    bPipe = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    if(bPipe) { // Room for a few frames before the producer notices
+        fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    return true;
+}
+
+
+/**
+ * Hand a frame over to the consumer
+ * @return false if the consumer has gone
+ */
+bool
+StreamSink::output(uint8_t *pFrame, uint32_t length) {
+    struct iovec iov = { pFrame, length };
+    while(iov.iov_len) {
+        // The pipe takes references to the pages: see recycle()
+        ssize_t result = bPipe ? vmsplice(fd, &iov, 1, SPLICE_F_NONBLOCK)
+                               : write(fd, iov.iov_base, iov.iov_len);
+        if(result < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN) { // The consumer lags: wait for room
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                if(poll(&pfd, 1, POLL_MS) < 0 && errno != EINTR)
+                    return false;
+                if(stopping() && !(pfd.revents & POLLOUT)) {
+                    errno = EAGAIN;
+                    return false;
+                }
+                continue;
+            }
+            if(bPipe && errno == EINVAL) { // Not spliceable after all
+                bPipe = false;
+                continue;
+            }
+            return false;
+        }
+        iov.iov_base = static_cast<uint8_t*>(iov.iov_base) + result;
+        iov.iov_len -= size_t(result);
+    }
+    return true;
+}
+
+
+void
+StreamSink::run() {
+    bool bOpen = openOutput();
+    while(true) {
+        FRAME_T frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return bStop || !frames.empty(); });
+            if(frames.empty())
+                return;
+            frame = frames.front();
+            frames.pop_front();
+        }
+        cond.notify_all(); // Room in the queue
+        bool bSpliced = bOpen && bPipe;
+        if(bOpen && !output(frame.pMap, frame.length)) {
+            qDebug() << QString("%1: The consumer of %2 has gone: %3")
+                        .arg(__func__)
+                        .arg(sPathName)
+                        .arg(strerror(errno));
+            if(fd != STDOUT_FILENO) {
+                // Wait for the next reader of the FIFO
+                close(fd);
+                fd = -1;
+                bOpen = openOutput();
+            }
+            else
+                bOpen = false;
+        }
+        recycle(frame.pMap, bSpliced ? frame.length : 0);
+    }
+}
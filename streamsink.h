@@ -0,0 +1,88 @@
+#pragma once
+
+#include <QString>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Streams the encoded frames (the stills, or the MJPEG video of the
+// pre-trigger encoder) to stdout or a FIFO, for an external muxer such
+// as ffmpeg. The frames are assembled in a small pool of page aligned
+// buffers mapped once, and handed over to the pipe with vmsplice(), so
+// the pipe references their pages instead of copying them. Once a frame
+// is out, the pages it spliced are dropped (MADV_DONTNEED) before the
+// buffer is reused: the pipe keeps the old ones, the next frame faults
+// in new ones. A thread does the output; when the consumer lags, whole
+// frames are either dropped or the producer blocks, depending on the
+// Backpressure.
+class StreamSink
+{
+public:
+    enum Backpressure {
+        BACKPRESSURE_DROP  = 0, /// Drop the frames that do not fit in the queue
+        BACKPRESSURE_BLOCK = 1  /// Wait for the consumer (stalls the capture)
+    };
+    enum Framing {
+        FRAMING_NONE   = 0, /// The frames only (MJPEG concatenation)
+        FRAMING_HEADER = 1  /// A FRAME_HEADER_T before every frame
+    };
+
+    typedef struct {
+        uint32_t magic;       /// FRAME_MAGIC
+        uint32_t seq;         /// Frame number in the stream, dropped frames leave gaps
+        uint32_t length;      /// Bytes following the header
+        uint32_t reserved;
+        int64_t  timestampUs; /// End of the frame, CLOCK_REALTIME
+    } FRAME_HEADER_T;
+
+public:
+    StreamSink(QString sPathName, uint32_t maxFrameBytes, int backpressure, int framing, int queueDepth);
+    ~StreamSink();
+
+public:
+    void append(const uint8_t *pData, uint32_t length);
+    void endFrame();
+    void discard();
+    uint32_t dropped();
+
+public:
+    static const uint32_t FRAME_MAGIC = 0x52464d53; // "SMFR"
+
+protected:
+    void run();
+    bool openOutput();
+    bool stopping();
+    bool output(uint8_t *pFrame, uint32_t length);
+    void recycle(uint8_t *pFrame, uint32_t splicedLength);
+
+private:
+    typedef struct {
+        uint8_t *pMap;        /// A buffer of the pool
+        uint32_t length;      /// Bytes to output, the header included
+    } FRAME_T;
+
+    QString sPathName;        /// "-" for stdout
+    uint32_t mapSize;         /// Of every buffer of the pool
+    uint32_t pageSize;
+    int backpressure;
+    int framing;
+    size_t queueDepth;
+    int fd;
+    bool bPipe;               /// vmsplice() can be used
+    uint8_t *pCurrent;        /// Frame being assembled (producer side only)
+    uint32_t currentLength;
+    bool bOverflow;
+    uint32_t seq;
+    uint32_t nDropped;
+    std::vector<uint8_t*> pool;       /// All the buffers
+    std::vector<uint8_t*> freeFrames; /// Not queued nor being output
+    std::deque<FRAME_T> frames;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool bStop;
+    std::thread worker;
+};
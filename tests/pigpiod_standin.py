@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# Local stand-in for pigpiod: answers the socket protocol of pigpiod_if2
+# for the commands slowMotion uses, and reports the level changes of the
+# emulated GPIOs to the notification sockets, so that the trigger
+# callbacks can be fired without a Raspberry Pi.
+#
+# A level change comes from gpio_write() (the pin loops back to its input)
+# or from set_pull_up_down() (the pull sets the level of a floating pin).
+#
+# Usage: pigpiod_standin.py [port]   (PIGPIO_PORT for the clients, 8888 by default)
+
+import socket
+import struct
+import sys
+import threading
+import time
+
+PI_CMD_MODES = 0
+PI_CMD_PUD   = 2
+PI_CMD_WRITE = 4
+PI_CMD_BR1   = 10
+PI_CMD_TICK  = 16
+PI_CMD_NB    = 19
+PI_CMD_NC    = 21
+PI_CMD_NOIB  = 99
+
+PI_PUD_DOWN = 1
+PI_PUD_UP   = 2
+
+
+class StandIn:
+    def __init__(self):
+        self.lock     = threading.Lock()
+        self.levels   = 0          # Bank 1 levels
+        self.notifies = {}         # handle -> [socket, watched bits]
+        self.seqno    = 0
+        self.start    = time.monotonic()
+
+    def tick(self):
+        return int((time.monotonic() - self.start) * 1e6) & 0xffffffff
+
+    def set_level(self, gpio, level):
+        with self.lock:
+            old = self.levels
+            if level:
+                self.levels |= 1 << gpio
+            else:
+                self.levels &= ~(1 << gpio)
+            if self.levels == old:
+                return
+            # gpioReport_t: seqno, flags, tick, level. Every change goes to
+            # every notification: pigpiod_if2 keeps the last level of the
+            # bank from them, and only calls back for the watched bits
+            report = struct.pack('<HHII', self.seqno & 0xffff, 0, self.tick(), self.levels)
+            self.seqno += 1
+            for sock, _ in self.notifies.values():
+                try:
+                    sock.sendall(report)
+                except OSError:
+                    pass
+
+    def command(self, conn, cmd, p1, p2):
+        if cmd == PI_CMD_NOIB:
+            with self.lock:
+                handle = len(self.notifies)
+                self.notifies[handle] = [conn, 0]
+            return handle
+        if cmd == PI_CMD_NB:
+            with self.lock:
+                if p1 in self.notifies:
+                    self.notifies[p1][1] = p2
+            return 0
+        if cmd == PI_CMD_NC:
+            with self.lock:
+                self.notifies.pop(p1, None)
+            return 0
+        if cmd == PI_CMD_BR1:
+            with self.lock:
+                return self.levels
+        if cmd == PI_CMD_TICK:
+            return self.tick()
+        if cmd == PI_CMD_WRITE:
+            self.set_level(p1, p2)
+            return 0
+        if cmd == PI_CMD_PUD:
+            if p2 in (PI_PUD_DOWN, PI_PUD_UP):
+                self.set_level(p1, p2 == PI_PUD_UP)
+            return 0
+        return 0 # MODES, PWM... accepted and ignored
+
+    def serve(self, conn):
+        with conn:
+            while True:
+                request = b''
+                while len(request) < 16:
+                    chunk = conn.recv(16 - len(request))
+                    if not chunk:
+                        return
+                    request += chunk
+                cmd, p1, p2, p3 = struct.unpack('<IIII', request)
+                if p3: # Extension bytes (not used by slowMotion): skipped
+                    conn.recv(p3, socket.MSG_WAITALL)
+                result = self.command(conn, cmd, p1, p2)
+                conn.sendall(struct.pack('<IIII', cmd, p1, p2, result & 0xffffffff))
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8888
+    standIn = StandIn()
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(('127.0.0.1', port))
+    server.listen()
+    print('pigpiod stand-in listening on port %d' % port, flush=True)
+    while True:
+        conn, _ = server.accept()
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        threading.Thread(target=standIn.serve, args=(conn,), daemon=True).start()
+
+
+if __name__ == '__main__':
+    main()
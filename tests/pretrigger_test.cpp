@@ -0,0 +1,125 @@
+// Fires the pre-trigger ring through pigpiod_if2 and a local pigpiod
+// stand-in (see run_tests.sh): a falling edge of the trigger GPIO calls
+// FrameRing::edgeCallback(), which must write the frames of the last
+// PRE_ROLL_MS and of the next POST_ROLL_MS, and report the pre-roll depth.
+
+#include "framering.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+
+#include <pigpiod_if2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+
+#define TRIGGER_PIN  17
+#define FRAME_MS     10    // Frame interval of the fake encoder
+#define FRAME_BYTES  256
+#define PRE_ROLL_MS  300
+#define POST_ROLL_MS 100
+#define RING_BUDGET  (128*FRAME_BYTES) // 1280 ms of frames: more than the pre-roll
+
+
+static int failures = 0;
+
+
+static void
+check(bool bOk, const char *what) {
+    if(!bOk) {
+        qDebug() << "FAILED:" << what;
+        failures++;
+    }
+}
+
+
+int
+main() {
+    QString sEventBase = QString("%1/pretrigger_test_").arg(QDir::tempPath());
+    QString sEventFile = sEventBase + QString("0000.mjpeg");
+    QFile::remove(sEventFile);
+
+    int pi = pigpio_start(nullptr, nullptr); // PIGPIO_ADDR, PIGPIO_PORT
+    if(pi < 0) {
+        qDebug() << "FAILED: no pigpiod (start the stand-in)";
+        return EXIT_FAILURE;
+    }
+    FrameRing *pRing = new FrameRing(RING_BUDGET, FRAME_BYTES, PRE_ROLL_MS, POST_ROLL_MS);
+    FrameRing::TRIGGER_T trigger;
+    trigger.pRing      = pRing;
+    trigger.sEventBase = sEventBase;
+    trigger.eventNum   = 0;
+
+    // The frames carry their number: the file tells which ones were written
+    std::atomic<bool> bStop(false);
+    std::thread encoder([pRing, &bStop] {
+        uint8_t frame[FRAME_BYTES];
+        for(uint32_t n=0; !bStop; n++) {
+            memset(frame, 0, sizeof(frame));
+            memcpy(frame, &n, sizeof(n));
+            pRing->append(frame, FRAME_BYTES/2, false);
+            pRing->append(frame+FRAME_BYTES/2, FRAME_BYTES/2, true);
+            std::this_thread::sleep_for(std::chrono::milliseconds(FRAME_MS));
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(3*PRE_ROLL_MS));
+
+    // As MainDialog::startPreTrigger(): pulled up, watched for falling edges
+    check(set_mode(pi, TRIGGER_PIN, PI_INPUT) == 0, "set_mode");
+    check(set_pull_up_down(pi, TRIGGER_PIN, PI_PUD_UP) == 0, "set_pull_up_down");
+    int callbackId = callback_ex(pi, TRIGGER_PIN, FALLING_EDGE, FrameRing::edgeCallback, &trigger);
+    check(callbackId >= 0, "callback_ex");
+    // The stand-in loops the level back to the input
+    check(gpio_write(pi, TRIGGER_PIN, 0) == 0, "gpio_write");
+    for(int i=0; i<100; i++) {
+        {
+            std::lock_guard<std::mutex> lock(trigger.mutex);
+            if(trigger.eventNum)
+                break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(FRAME_MS));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2*POST_ROLL_MS));
+
+    if(callbackId >= 0)
+        callback_cancel(unsigned(callbackId));
+    pigpio_stop(pi);
+    {
+        std::lock_guard<std::mutex> lock(trigger.mutex);
+        check(trigger.eventNum == 1, "one event triggered");
+        trigger.pRing = nullptr;
+    }
+    int depthMs = pRing->preRollDepth();
+    bStop = true;
+    encoder.join();
+    delete pRing; // Waits for the flush
+
+    check(depthMs > PRE_ROLL_MS-2*FRAME_MS && depthMs <= PRE_ROLL_MS, "pre-roll depth");
+    QFile file(sEventFile);
+    check(file.open(QIODevice::ReadOnly), "event file written");
+    QByteArray data = file.readAll();
+    check(data.size() % FRAME_BYTES == 0, "whole frames");
+    int nFrames = data.size()/FRAME_BYTES;
+    int expected = (PRE_ROLL_MS+POST_ROLL_MS)/FRAME_MS;
+    check(nFrames >= expected-4 && nFrames <= expected+2, "frames of the pre-roll and the post-roll");
+    // Consecutive frames: none missing, none repeated
+    for(int i=1; i<nFrames; i++) {
+        uint32_t previous, current;
+        memcpy(&previous, data.constData() + (i-1)*FRAME_BYTES, sizeof(previous));
+        memcpy(&current,  data.constData() + i*FRAME_BYTES, sizeof(current));
+        if(current != previous+1) {
+            check(false, "consecutive frames");
+            break;
+        }
+    }
+    qDebug() << QString("%1 frames, %2 ms of pre-roll").arg(nFrames).arg(depthMs);
+    file.remove();
+    if(failures)
+        return EXIT_FAILURE;
+    qDebug() << "PASSED";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,22 @@
+# Pre-trigger test: FrameRing fired by pigpiod_if2 (see run_tests.sh)
+QT += core
+QT -= gui
+
+TARGET = pretrigger_test
+TEMPLATE = app
+CONFIG += console c++14
+CONFIG -= app_bundle
+
+SDKSTAGE = /home/pi/vc
+
+INCLUDEPATH += ..
+INCLUDEPATH += $$SDKSTAGE/include/ # framering.cpp includes utility.h
+INCLUDEPATH += /usr/local/include
+
+SOURCES += pretrigger_test.cpp
+SOURCES += ../framering.cpp
+
+HEADERS += ../framering.h
+
+LIBS += -L"/usr/local/lib" -lpigpiod_if2
+LIBS += -lpthread
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Builds and runs the tests against the local pigpiod stand-in
+# (no Raspberry Pi, camera or pigpiod needed).
+set -e
+cd "$(dirname "$0")"
+
+PIGPIO_ADDR=127.0.0.1
+PIGPIO_PORT=${PIGPIO_PORT:-18888}
+export PIGPIO_ADDR PIGPIO_PORT
+
+mkdir -p build
+(cd build && qmake ../pretrigger_test.pro && make)
+
+python3 pigpiod_standin.py "$PIGPIO_PORT" &
+STANDIN=$!
+trap 'kill $STANDIN' EXIT
+sleep 1
+
+./build/pretrigger_test
@@ -0,0 +1,163 @@
+#include "thermalgovernor.h"
+#include "utility.h"
+#include <QDebug>
+
+#include <chrono>
+#include <algorithm>
+
+
+// get_throttled bits (the current state, not the "since boot" ones)
+#define THROTTLED_UNDERVOLTAGE 0x1
+#define THROTTLED_ARM_CAPPED   0x2
+#define THROTTLED_THROTTLED    0x4
+#define THROTTLED_SOFT_LIMIT   0x8
+
+#define HYSTERESIS 3.0 // Degrees C below a threshold to leave its level
+
+
+ThermalGovernor::ThermalGovernor(double warmTemp, double hotTemp, double criticalTemp)
+    : last({ 0.0, 0, 0, 0 })
+    , currentLevel(LEVEL_NORMAL)
+    , pLog(nullptr)
+    , bStop(false)
+{
+    thresholds[0] = warmTemp;
+    thresholds[1] = hotTemp;
+    thresholds[2] = criticalTemp;
+    worker = std::thread(&ThermalGovernor::run, this);
+}
+
+
+/// Stops the polling thread
+ThermalGovernor::~ThermalGovernor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    cond.notify_all();
+    worker.join();
+    if(pLog)
+        fclose(pLog);
+}
+
+
+/// The load the capture side should run at (lock free)
+ThermalGovernor::Level
+ThermalGovernor::level() const {
+    return Level(currentLevel.load());
+}
+
+
+/// The last telemetry read
+ThermalGovernor::TELEMETRY_T
+ThermalGovernor::telemetry() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return last;
+}
+
+
+/**
+ * Log the telemetry of every still of a run to a CSV file
+ * @param sPathName The log file
+ * @return false if the file cannot be created
+ */
+bool
+ThermalGovernor::startLog(QString sPathName) {
+    FILE *pFile = fopen(sPathName.toLatin1(), "w");
+    if(!pFile)
+        return false;
+    fprintf(pFile, "frame,temp_c,throttled,arm_hz,core_hz,level\n");
+    std::lock_guard<std::mutex> lock(mutex);
+    if(pLog)
+        fclose(pLog);
+    pLog = pFile;
+    return true;
+}
+
+
+void
+ThermalGovernor::stopLog() {
+    std::lock_guard<std::mutex> lock(mutex);
+    marks.clear();
+    if(pLog)
+        fclose(pLog);
+    pLog = nullptr;
+}
+
+
+/**
+ * A still has been taken: its telemetry is read and logged by the
+ * governor thread (nothing waits for the firmware here)
+ * @param frameNumber Frame index in the run
+ */
+void
+ThermalGovernor::markFrame(int frameNumber) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!pLog)
+            return;
+        marks.push_back(frameNumber);
+    }
+    cond.notify_all();
+}
+
+
+/**
+ * The level of a telemetry sample. The temperature levels have some
+ * hysteresis; the firmware throttling forces the higher ones at once.
+ */
+ThermalGovernor::Level
+ThermalGovernor::evaluate(const TELEMETRY_T& sample, Level current) const {
+    int newLevel = LEVEL_NORMAL;
+    for(int i=0; i<3; i++) {
+        double threshold = thresholds[i];
+        if(current > i) // Already above: leave it only well below
+            threshold -= HYSTERESIS;
+        if(sample.temp >= threshold)
+            newLevel = i+1;
+    }
+    if(sample.throttled & (THROTTLED_ARM_CAPPED | THROTTLED_SOFT_LIMIT))
+        newLevel = std::max(newLevel, int(LEVEL_HOT));
+    if(sample.throttled & (THROTTLED_UNDERVOLTAGE | THROTTLED_THROTTLED))
+        newLevel = LEVEL_CRITICAL;
+    return Level(newLevel);
+}
+
+
+void
+ThermalGovernor::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!bStop) {
+        lock.unlock();
+        TELEMETRY_T sample;
+        sample.temp      = measure_temp();
+        sample.throttled = get_throttled();
+        sample.armClock  = measure_clock("arm");
+        sample.coreClock = measure_clock("core");
+        Level newLevel = evaluate(sample, level());
+        if(newLevel != level())
+            qDebug() << QString("%1: %2 C, throttled 0x%3: level %4")
+                        .arg(__func__)
+                        .arg(sample.temp, 0, 'f', 1)
+                        .arg(sample.throttled, 0, 16)
+                        .arg(newLevel);
+        lock.lock();
+        last = sample;
+        currentLevel = newLevel;
+        while(pLog && !marks.empty()) {
+            fprintf(pLog, "%d,%.1f,0x%x,%u,%u,%d\n",
+                    marks.front(),
+                    sample.temp,
+                    sample.throttled,
+                    sample.armClock,
+                    sample.coreClock,
+                    int(newLevel));
+            marks.pop_front();
+        }
+        if(pLog)
+            fflush(pLog);
+        cond.wait_for(lock,
+                      std::chrono::milliseconds(POLL_INTERVAL),
+                      [this] { return bStop || !marks.empty(); });
+    }
+}
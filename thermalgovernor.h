@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QString>
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Watches the SoC temperature, the throttling state and the clocks
+// (VideoCore telemetry through vc_gencmd) from its own thread, so the
+// capture never waits for the firmware. The telemetry is turned into a
+// Level the capture side polls to shed load before the firmware throttles;
+// it is also logged for every still (see markFrame()).
+class ThermalGovernor
+{
+public:
+    enum Level {
+        LEVEL_NORMAL   = 0,
+        LEVEL_WARM     = 1, /// Lighten the preview and the analysis
+        LEVEL_HOT      = 2, /// Shorter bursts too
+        LEVEL_CRITICAL = 3  /// Throttled or under-voltage: minimum load
+    };
+
+    typedef struct {
+        double temp;        /// SoC temperature, in degrees C
+        uint32_t throttled; /// get_throttled bits
+        uint32_t armClock;  /// in Hz
+        uint32_t coreClock; /// in Hz
+    } TELEMETRY_T;
+
+    ThermalGovernor(double warmTemp, double hotTemp, double criticalTemp);
+    ~ThermalGovernor();
+
+public:
+    Level level() const;
+    TELEMETRY_T telemetry();
+    bool startLog(QString sPathName);
+    void stopLog();
+    void markFrame(int frameNumber);
+
+protected:
+    void run();
+    Level evaluate(const TELEMETRY_T& sample, Level current) const;
+
+public:
+    static const int POLL_INTERVAL = 1000; /// in ms
+
+private:
+    double thresholds[3];        /// Warm, hot and critical temperatures
+    TELEMETRY_T last;
+    std::atomic<int> currentLevel;
+    std::deque<int> marks;       /// Stills waiting to be logged
+    FILE *pLog;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool bStop;
+    std::thread worker;
+};
@@ -0,0 +1,206 @@
+#include "triggercapture.h"
+#include "utility.h"
+#include "pigpiod_if2.h"
+#include <QDebug>
+#include <QElapsedTimer>
+
+#include <pthread.h>
+#include <sched.h>
+
+
+TriggerCapture::TriggerCapture(PiCamera *pCamera, int gpioHandle, unsigned gpio,
+                               int debounceUs, int minIntervalMs,
+                               QString sBaseName, QString sLogPath, int firstFrame)
+    : pCamera(pCamera)
+    , gpioHandle(gpioHandle)
+    , gpio(gpio)
+    , debounceUs(debounceUs)
+    , minIntervalUs(uint32_t(minIntervalMs)*1000)
+    , sBaseName(sBaseName)
+    , callbackId(-1)
+    , firstFrame(firstFrame)
+    , nFrames(firstFrame)
+    , nRejected(0)
+    , nLost(0)
+    , lastTick(0)
+    , bHaveLast(false)
+    , pendingTick(0)
+    , bPending(false)
+    , bCapturing(false)
+    , bStop(false)
+{
+    logFile = fopen(sLogPath.toLatin1(), "a");
+    if(!logFile)
+        qDebug() << QString("%1: Error opening latency log: %2")
+                    .arg(__func__)
+                    .arg(sLogPath);
+    else if(ftell(logFile) == 0)
+        fprintf(logFile, "frame,trigger_tick,latency_us,capture_ms\n");
+}
+
+
+TriggerCapture::~TriggerCapture() {
+    stop();
+    if(logFile)
+        fclose(logFile);
+    if(nRejected)
+        qDebug() << QString("%1 triggers rejected by the rate limit").arg(nRejected);
+    if(nLost)
+        qDebug() << QString("%1 triggered frames lost").arg(nLost);
+}
+
+
+/**
+ * Configure the trigger GPIO and start the capture thread
+ * @return false if the GPIO cannot be watched
+ */
+bool
+TriggerCapture::start() {
+    if(set_mode(gpioHandle, gpio, PI_INPUT) < 0 ||
+       set_pull_up_down(gpioHandle, gpio, PI_PUD_UP) < 0) {
+        qDebug() << QString("Unable to initialize GPIO%1 as trigger input").arg(gpio);
+        return false;
+    }
+    // The level must be steady for debounceUs before pigpiod reports the edge
+    if(debounceUs > 0 && set_glitch_filter(gpioHandle, gpio, unsigned(debounceUs)) < 0)
+        qDebug() << QString("Unable to set the glitch filter on GPIO%1").arg(gpio);
+    worker = std::thread(&TriggerCapture::run, this);
+    sched_param param;
+    param.sched_priority = CAPTURE_PRIORITY;
+    if(pthread_setschedparam(worker.native_handle(), SCHED_FIFO, &param) != 0)
+        qDebug() << "Unable to give real time priority to the capture thread";
+    callbackId = callback_ex(gpioHandle, gpio, FALLING_EDGE, edgeCallback, this);
+    if(callbackId < 0) {
+        qDebug() << QString("Unable to watch GPIO%1").arg(gpio);
+        return false;
+    }
+    return true;
+}
+
+
+/// Stills captured since the start
+/// Stops watching the GPIO and waits for the capture in progress
+void
+TriggerCapture::stop() {
+    if(callbackId >= 0)
+        callback_cancel(unsigned(callbackId));
+    callbackId = -1;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    cond.notify_all();
+    if(worker.joinable())
+        worker.join();
+}
+
+
+int
+TriggerCapture::frames() const {
+    return nFrames - firstFrame;
+}
+
+
+/// Number the next still would take: where the run continues
+int
+TriggerCapture::nextFrame() const {
+    return nFrames;
+}
+
+
+/// Called by pigpiod_if2 (in its own thread) on the trigger edge
+void
+TriggerCapture::edgeCallback(int pi, unsigned gpio, unsigned level, uint32_t tick, void *userdata) {
+    Q_UNUSED(pi)
+    Q_UNUSED(gpio)
+    Q_UNUSED(level)
+    reinterpret_cast<TriggerCapture *>(userdata)->trigger(tick);
+}
+
+
+void
+TriggerCapture::trigger(uint32_t tick) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // The tick wraps every ~72 minutes: compare differences only
+        if(bPending || bCapturing || (bHaveLast && tick - lastTick < minIntervalUs)) {
+            nRejected++;
+            return;
+        }
+        lastTick    = tick;
+        bHaveLast   = true;
+        pendingTick = tick;
+        bPending    = true;
+    }
+    cond.notify_all();
+}
+
+
+void
+TriggerCapture::run() {
+    for(;;) {
+        uint32_t tick;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return bStop || bPending; });
+            if(bStop)
+                return;
+            tick = pendingTick;
+            bPending   = false;
+            bCapturing = true;
+        }
+        QString sFileName = QString("%1_%2.jpg")
+                .arg(sBaseName)
+                .arg(int(nFrames), 4, 10, QLatin1Char('0'));
+        QElapsedTimer captureTime;
+        captureTime.start();
+        // A lost frame has no exposure to measure and takes no frame number
+        if(pCamera->capture(sFileName, nFrames)) {
+            logLatency(tick, captureTime.elapsed());
+            nFrames++;
+        }
+        else {
+            nLost++;
+            qDebug() << QString("%1: Trigger at tick %2 lost: %3 not captured")
+                        .arg(__func__)
+                        .arg(tick)
+                        .arg(sFileName);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        bCapturing = false;
+    }
+}
+
+
+/**
+ * Log the trigger to exposure latency of the last frame.
+ * The latency is left empty when the frame has no pts
+ * @param triggerTick pigpio tick of the trigger edge
+ * @param captureMs   Duration of the whole capture
+ */
+void
+TriggerCapture::logLatency(uint32_t triggerTick, qint64 captureMs) {
+    // Read both clocks back to back: their difference maps the pts onto the ticks
+    uint64_t stcNow  = pCamera->pControl->get_system_time();
+    uint32_t tickNow = get_current_tick(gpioHandle);
+    int64_t pts = pCamera->lastCapturePts();
+    bool bKnown = pts != MMAL_TIME_UNKNOWN && stcNow != 0;
+    int64_t latency = 0;
+    if(bKnown)
+        latency = int64_t(tickNow - triggerTick) - (int64_t(stcNow) - pts);
+    if(logFile) {
+        if(bKnown)
+            fprintf(logFile, "%d,%u,%lld,%lld\n", int(nFrames), triggerTick,
+                    static_cast<long long>(latency), static_cast<long long>(captureMs));
+        else
+            fprintf(logFile, "%d,%u,,%lld\n", int(nFrames), triggerTick,
+                    static_cast<long long>(captureMs));
+        fflush(logFile);
+    }
+    if(verbose) {
+        if(bKnown)
+            qDebug() << QString("Frame %1: trigger to exposure %2 us").arg(int(nFrames)).arg(latency);
+        else
+            qDebug() << QString("Frame %1: no pts, trigger to exposure unknown").arg(int(nFrames));
+    }
+}
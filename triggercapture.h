@@ -0,0 +1,64 @@
+#pragma once
+
+#include "picamera.h"
+
+#include <QString>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Captures a still on every edge of a GPIO (beam break, PIR...).
+// The pigpiod callback wakes a real time capture thread that calls
+// PiCamera::capture() directly, without going through the Qt event loop.
+// The trigger to exposure latency of every frame is logged: the trigger
+// tick (pigpio clock) is compared with the frame pts (camera clock)
+// after mapping one clock onto the other.
+class TriggerCapture
+{
+public:
+    TriggerCapture(PiCamera *pCamera, int gpioHandle, unsigned gpio,
+                   int debounceUs, int minIntervalMs,
+                   QString sBaseName, QString sLogPath, int firstFrame=0);
+    ~TriggerCapture();
+
+public:
+    bool start();
+    void stop();
+    int frames() const;
+    int nextFrame() const;
+
+protected:
+    static void edgeCallback(int pi, unsigned gpio, unsigned level, uint32_t tick, void *userdata);
+    void trigger(uint32_t tick);
+    void run();
+    void logLatency(uint32_t triggerTick, qint64 captureMs);
+
+public:
+    static const int CAPTURE_PRIORITY = 50; /// SCHED_FIFO priority of the capture thread
+
+private:
+    PiCamera *pCamera;
+    int gpioHandle;
+    unsigned gpio;
+    int debounceUs;
+    uint32_t minIntervalUs;
+    QString sBaseName;
+    FILE *logFile;
+    int callbackId;
+    int firstFrame;
+    std::atomic<int> nFrames;   /// Number of the next still
+    int nRejected;              /// Edges inside the rate limit or while capturing
+    int nLost;                  /// Accepted triggers whose capture failed (not in the log)
+    uint32_t lastTick;          /// Tick of the last accepted trigger
+    bool bHaveLast;
+    uint32_t pendingTick;
+    bool bPending;
+    bool bCapturing;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool bStop;
+    std::thread worker;
+};
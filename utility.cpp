@@ -2,6 +2,16 @@
 #include <QString>
 #include <QDebug>
 #include "bcm_host.h"
+#include "interface/mmal/util/mmal_default_components.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 
 /// Convert a MMAL status return value to a simple boolean of success
@@ -100,6 +110,54 @@ get_camera(int *supported, int *detected) {
 }
 
 
+/**
+ * Ask GPU about the SoC temperature
+ * @return the temperature in degrees C (0 if unknown)
+ */
+double
+measure_temp(void) {
+    char response[80] = "";
+    double temp = 0.0;
+    if (vc_gencmd(response, sizeof response, "measure_temp") == 0)
+        sscanf(response, "temp=%lf", &temp);
+    return temp;
+}
+
+
+/**
+ * Ask GPU about the throttling state
+ * @return the get_throttled bits: 0 under-voltage, 1 ARM frequency capped,
+ *         2 throttled, 3 soft temperature limit (16-19: the same, since boot)
+ */
+uint32_t
+get_throttled(void) {
+    char response[80] = "";
+    uint32_t throttled = 0;
+    if (vc_gencmd(response, sizeof response, "get_throttled") == 0)
+        sscanf(response, "throttled=%x", &throttled);
+    return throttled;
+}
+
+
+/**
+ * Ask GPU about the frequency of a clock
+ * @param clock Clock name ("arm", "core", "isp", "v3d", ...)
+ * @return the frequency in Hz (0 if unknown)
+ */
+uint32_t
+measure_clock(const char *clock) {
+    char command[32];
+    char response[80] = "";
+    uint32_t frequency = 0;
+    snprintf(command, sizeof command, "measure_clock %s", clock);
+    if (vc_gencmd(response, sizeof response, command) == 0) {
+        const char *pValue = strchr(response, '=');
+        if (pValue)
+            frequency = uint32_t(strtoul(pValue+1, nullptr, 10));
+    }
+    return frequency;
+}
+
 
 /**
  * Check to see if camera is supported, and we have allocated enough memory
@@ -136,3 +194,188 @@ checkConfiguration(int min_gpu_mem) {
         qDebug() << "N° of Camera Detected" << detected;
     }
 }
+
+
+namespace {
+
+// The threads of runParallel(), started once: some callers (the stacking of
+// every camera buffer) run bands so small that starting threads for every
+// call would cost more than the work itself.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(int nThreads);
+    ~WorkerPool();
+    int size() const;
+    void run(int nBands, int nItems, const std::function<void(int, int)>& job);
+
+private:
+    typedef struct {
+        const std::function<void(int, int)> *pJob;
+        int nItems;
+        int nBands;
+        int nextBand; /// First band nobody runs yet
+        int nDone;
+    } BATCH_T;
+
+    void loop();
+    bool runBand(std::unique_lock<std::mutex>& lock, BATCH_T *pBatch);
+
+    std::vector<std::thread> threads;
+    std::deque<BATCH_T *> batches;       /// With bands left to run
+    std::mutex mutex;
+    std::condition_variable work;        /// A batch is queued (or bStop)
+    std::condition_variable finished;    /// The last band of a batch is done
+    bool bStop;
+};
+
+
+WorkerPool::WorkerPool(int nThreads)
+    : bStop(false)
+{
+    for(int i=0; i<nThreads; i++)
+        threads.emplace_back(&WorkerPool::loop, this);
+}
+
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+    }
+    work.notify_all();
+    for(auto& thread : threads)
+        thread.join();
+}
+
+
+/// Threads of the pool (the calling thread of run() comes in addition)
+int
+WorkerPool::size() const {
+    return int(threads.size());
+}
+
+
+/**
+ * Claim the next band of a batch and run it (the lock is released meanwhile)
+ * @return false if all the bands of the batch were already claimed
+ */
+bool
+WorkerPool::runBand(std::unique_lock<std::mutex>& lock, BATCH_T *pBatch) {
+    if(pBatch->nextBand >= pBatch->nBands)
+        return false;
+    int band = pBatch->nextBand++;
+    if(pBatch->nextBand == pBatch->nBands)
+        batches.erase(std::find(batches.begin(), batches.end(), pBatch));
+    int first = int(int64_t(pBatch->nItems)*band/pBatch->nBands);
+    int last  = int(int64_t(pBatch->nItems)*(band+1)/pBatch->nBands);
+    lock.unlock();
+    (*pBatch->pJob)(first, last);
+    lock.lock();
+    if(++pBatch->nDone == pBatch->nBands)
+        finished.notify_all();
+    return true;
+}
+
+
+void
+WorkerPool::loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        work.wait(lock, [this] { return bStop || !batches.empty(); });
+        if(bStop)
+            return;
+        runBand(lock, batches.front());
+    }
+}
+
+
+/**
+ * Run the bands of a job on the pool, the calling thread taking its share:
+ * the call returns even if the pool is busy with the jobs of other threads
+ */
+void
+WorkerPool::run(int nBands, int nItems, const std::function<void(int, int)>& job) {
+    BATCH_T batch = { &job, nItems, nBands, 0, 0 };
+    std::unique_lock<std::mutex> lock(mutex);
+    batches.push_back(&batch);
+    work.notify_all();
+    while(runBand(lock, &batch))
+        ;
+    finished.wait(lock, [&batch] { return batch.nDone == batch.nBands; });
+}
+
+} // namespace
+
+
+/**
+ * Split nItems in contiguous bands and process them on all the available cores
+ * (the threads are kept between the calls, see WorkerPool)
+ * @param nItems Number of items (rows, blocks, bytes...) to process
+ * @param job    Function processing the items in [first, last)
+ */
+void
+runParallel(int nItems, const std::function<void(int, int)>& job) {
+    static WorkerPool pool([] {
+        int nThreads = int(std::thread::hardware_concurrency());
+        return (nThreads < 1 ? 4 : nThreads) - 1;
+    }());
+    const int nThreads = pool.size() + 1;
+    const int nBands = nThreads < nItems ? nThreads : nItems;
+    if(nBands <= 1) {
+        if(nItems > 0)
+            job(0, nItems);
+        return;
+    }
+    pool.run(nBands, nItems, job);
+}
+
+
+/**
+ * Name and maximum resolution of the camera (OV5647 defaults if unknown)
+ * width and height are only set when zero
+ */
+void
+getSensorDefaults(int camera_num, char *camera_name, int *width, int *height) {
+   MMAL_COMPONENT_T *cameraInfo;
+   MMAL_STATUS_T status;
+   // Default to the OV5647 setup
+   strncpy(camera_name, "OV5647", MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN);
+   // Try to get the camera name and maximum supported resolution
+   status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &cameraInfo);
+   if(status == MMAL_SUCCESS) {
+      MMAL_PARAMETER_CAMERA_INFO_T param;
+      param.hdr.id = MMAL_PARAMETER_CAMERA_INFO;
+      param.hdr.size = sizeof(param)-4;  // Deliberately undersize to check firmware version
+      status = mmal_port_parameter_get(cameraInfo->control, &param.hdr);
+
+      if(status != MMAL_SUCCESS) {// Running on newer firmware
+         param.hdr.size = sizeof(param);
+         status = mmal_port_parameter_get(cameraInfo->control, &param.hdr);
+         if(status == MMAL_SUCCESS && param.num_cameras > uint32_t(camera_num)) {
+            // Take the parameters from the first camera listed.
+            if(*width == 0)
+               *width = int32_t(param.cameras[camera_num].max_width);
+            if(*height == 0)
+               *height = int32_t(param.cameras[camera_num].max_height);
+            strncpy(camera_name, param.cameras[camera_num].camera_name, MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN);
+            camera_name[MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN-1] = 0;
+         }
+         else
+            qDebug() << QString("Cannot read camera info, keeping the defaults for OV5647");
+      }
+      else {
+         // Older firmware
+         // Nothing to do here, keep the defaults for OV5647
+      }
+      mmal_component_destroy(cameraInfo);
+   }
+   else {
+      qDebug() << QString("Failed to create camera_info component");
+   }
+   // default to OV5647 if nothing detected..
+   if(*width == 0)
+      *width = 2592;
+   if(*height == 0)
+      *height = 1944;
+}
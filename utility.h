@@ -1,6 +1,7 @@
 #pragma once
 
 #include "interface/mmal/mmal.h"
+#include <functional>
 
 #define verbose false
 
@@ -8,4 +9,9 @@
 int mmal_status_to_int(MMAL_STATUS_T status);
 int get_mem_gpu(void);
 void get_camera(int *supported, int *detected);
+double measure_temp(void);
+uint32_t get_throttled(void);
+uint32_t measure_clock(const char *clock);
 void checkConfiguration(int min_gpu_mem);
+void runParallel(int nItems, const std::function<void(int, int)>& job);
+void getSensorDefaults(int camera_num, char *camera_name, int *width, int *height);
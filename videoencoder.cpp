@@ -0,0 +1,178 @@
+#include "videoencoder.h"
+#include "QDebug"
+#include "utility.h"
+
+
+#include "interface/mmal/mmal_buffer.h"
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+
+
+/**
+ *  buffer header callback function for the video encoder output port
+ *
+ *  Callback will append the encoded data to the frame ring
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void
+videoEncoderCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    VideoEncoder *pEncoder = reinterpret_cast<VideoEncoder *>(port->userdata);
+    if(pEncoder->pRing && !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+        mmal_buffer_header_mem_lock(buffer);
+        pEncoder->pRing->append(buffer->data,
+                                buffer->length,
+                                buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+        mmal_buffer_header_mem_unlock(buffer);
+    }
+    if(pEncoder->pSink && !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+        mmal_buffer_header_mem_lock(buffer);
+        pEncoder->pSink->append(buffer->data, buffer->length);
+        mmal_buffer_header_mem_unlock(buffer);
+        if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+            pEncoder->pSink->endFrame();
+    }
+    mmal_buffer_header_release(buffer);
+    if(port->is_enabled) {
+        MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pEncoder->pool->queue);
+        if(!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            qDebug() << QString("Unable to return a buffer to the video encoder port");
+    }
+}
+
+
+VideoEncoder::VideoEncoder()
+    : pComponent(nullptr)
+    , pool(nullptr)
+    , pRing(nullptr)
+    , pSink(nullptr)
+{
+    bitrate = 25000000;
+    encoding = MMAL_ENCODING_MJPEG;
+    if(createComponent() != MMAL_SUCCESS)
+        exit(EXIT_FAILURE);
+}
+
+
+MMAL_STATUS_T
+VideoEncoder::createComponent() {
+    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &pComponent);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to create video encoder component");
+        if(pComponent)
+            mmal_component_destroy(pComponent);
+        pComponent = nullptr;
+        return status;
+    }
+    if(!pComponent->input_num || !pComponent->output_num) {
+        qDebug() << QString("Video encoder doesn't have input/output ports");
+        mmal_component_destroy(pComponent);
+        pComponent = nullptr;
+        return MMAL_ENOSYS;
+    }
+    return status;
+}
+
+
+void
+VideoEncoder::destroy() {
+    if(pComponent) {
+        if(pool)
+            mmal_port_pool_destroy(pComponent->output[0], pool);
+        mmal_component_destroy(pComponent);
+    }
+    pComponent = nullptr;
+    pool = nullptr;
+}
+
+
+/**
+ * Configure the encoder for the frames of the camera video port
+ * (must be called before the ports are connected)
+ * @param pInputFormat Format of the camera video port
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+VideoEncoder::setInputFormat(MMAL_ES_FORMAT_T *pInputFormat) {
+    MMAL_PORT_T *encoder_input  = pComponent->input[0];
+    MMAL_PORT_T *encoder_output = pComponent->output[0];
+    mmal_format_copy(encoder_input->format, pInputFormat);
+    MMAL_STATUS_T status = mmal_port_format_commit(encoder_input);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to set format on video encoder input port");
+        return status;
+    }
+    mmal_format_copy(encoder_output->format, encoder_input->format);
+    encoder_output->format->encoding = encoding;
+    encoder_output->format->bitrate  = bitrate;
+    encoder_output->buffer_size = encoder_output->buffer_size_recommended;
+    if(encoder_output->buffer_size < encoder_output->buffer_size_min)
+        encoder_output->buffer_size = encoder_output->buffer_size_min;
+    encoder_output->buffer_num = encoder_output->buffer_num_recommended;
+    if(encoder_output->buffer_num < encoder_output->buffer_num_min)
+        encoder_output->buffer_num = encoder_output->buffer_num_min;
+    status = mmal_port_format_commit(encoder_output);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to set format on video encoder output port");
+        return status;
+    }
+    status = mmal_component_enable(pComponent);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("Unable to enable video encoder component");
+        return status;
+    }
+    if(!pool) {
+        pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
+        if(!pool) {
+            qDebug() << QString("Failed to create buffer header pool for video encoder output port %1")
+                        .arg(encoder_output->name);
+            return MMAL_ENOMEM;
+        }
+    }
+    return status;
+}
+
+
+/**
+ * Enable the encoder output, sending the encoded frames to the ring
+ * @param pRing The frame ring
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T
+VideoEncoder::start(FrameRing *pRing) {
+    MMAL_PORT_T *encoderOutputPort = pComponent->output[0];
+    this->pRing = pRing;
+    encoderOutputPort->userdata = reinterpret_cast<struct MMAL_PORT_USERDATA_T *>(this);
+    MMAL_STATUS_T status = mmal_port_enable(encoderOutputPort, videoEncoderCallback);
+    if(status != MMAL_SUCCESS) {
+        qDebug() << QString("%1: Failed to enable the video encoder output port").arg(__func__);
+        return status;
+    }
+    uint32_t num = mmal_queue_length(pool->queue);
+    for(uint32_t q=0; q<num; q++) {
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(pool->queue);
+        if(!buffer)
+            qDebug() << QString("Unable to get a required buffer %1 from pool queue")
+                        .arg(q);
+        status = mmal_port_send_buffer(encoderOutputPort, buffer);
+        if(status != MMAL_SUCCESS) {
+            qDebug() << QString("%1: Unable to send a buffer to video encoder output port (%2)")
+                        .arg(__func__)
+                        .arg(q);
+            return status;
+        }
+    }
+    return status;
+}
+
+
+void
+VideoEncoder::stop() {
+    MMAL_PORT_T *encoderOutputPort = pComponent->output[0];
+    if(encoderOutputPort->is_enabled)
+        mmal_port_disable(encoderOutputPort);
+    if(pComponent->is_enabled)
+        mmal_component_disable(pComponent);
+    pRing = nullptr;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/util/mmal_default_components.h"
+
+#include "framering.h"
+#include "streamsink.h"
+
+
+// MJPEG encoder fed by the camera video port through a tunnel.
+// The encoded frames are appended to a FrameRing (and streamed to a
+// StreamSink, if any).
+class VideoEncoder
+{
+public:
+    VideoEncoder();
+
+public:
+    void destroy();
+    MMAL_STATUS_T setInputFormat(MMAL_ES_FORMAT_T *pInputFormat);
+    MMAL_STATUS_T start(FrameRing *pRing);
+    void stop();
+
+protected:
+    MMAL_STATUS_T createComponent();
+
+public:
+    MMAL_COMPONENT_T *pComponent;
+    MMAL_POOL_T *pool;
+    FrameRing *pRing;
+    StreamSink *pSink;     /// Set before start() (nullptr = none)
+    uint32_t bitrate;      /// in bits per second
+    MMAL_FOURCC_T encoding;
+};